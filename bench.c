@@ -0,0 +1,349 @@
+/*
+ * Benchmark driver for the shell's hot paths. Prints one JSON object per
+ * line so results can be collected and compared across commits:
+ *   launch:     time per pipeline of N 'true' stages, run from a script
+ *   throughput: MB/s through 'cat FILE | cat | ... | wc -c' chains
+ *   tokenize:   cost per token of tokenizing a long command line
+ *   strvec:     cost of strvec_find/find_last/num_occurrences on a long
+ *               vector, scanning and with strvec_index()
+ *   filters:    time per small 'cat | tr | head | wc -l' pipeline, exec'd
+ *               and with the in-shell filters (-B)
+ * Usage: swish_bench [-q] [-s path/to/swish]
+ *   -q: quick run with fewer repetitions (for smoke testing)
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "string_vector.h"
+#include "swish_funcs.h"
+
+#define SCRIPT_PATH "/tmp/swish_bench_script.txt"
+#define DATA_PATH "/tmp/swish_bench_data.bin"
+
+static const char *swish_path = "./swish";
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run swish on a script with the given launcher, discarding its output
+ * flag: Extra option to pass to swish, or NULL
+ * Returns the elapsed wall time in seconds, or -1 on error
+ */
+static double run_script(const char *launcher, const char *flag) {
+    double start = now_sec();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1) {
+            perror("/dev/null");
+            exit(1);
+        }
+        close(null_fd);
+        if (flag != NULL) {
+            execl(swish_path, swish_path, flag, "-l", launcher, "-f", SCRIPT_PATH, (char *) NULL);
+        } else {
+            execl(swish_path, swish_path, "-l", launcher, "-f", SCRIPT_PATH, (char *) NULL);
+        }
+        perror("exec");
+        exit(1);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "swish failed on %s\n", SCRIPT_PATH);
+        return -1;
+    }
+    return now_sec() - start;
+}
+
+/*
+ * Write 'lines' copies of a pipeline of 'stages' commands to the script file.
+ * first: Command for the first stage
+ * rest: Command for every other stage
+ * Returns 0 on success or -1 on error
+ */
+static int write_script(int lines, int stages, const char *first, const char *rest) {
+    FILE *f = fopen(SCRIPT_PATH, "w");
+    if (f == NULL) {
+        perror(SCRIPT_PATH);
+        return -1;
+    }
+    for (int i = 0; i < lines; i++) {
+        fputs(first, f);
+        for (int j = 1; j < stages; j++) {
+            fprintf(f, " | %s", rest);
+        }
+        fputc('\n', f);
+    }
+    return fclose(f);
+}
+
+static int bench_launch(int quick) {
+    const char *launchers[] = {"fork", "spawn", "vfork", "pool"};
+    int stage_counts[] = {2, 5, 10, 20};
+    int lines = quick ? 20 : 500;
+    for (int i = 0; i < sizeof(stage_counts) / sizeof(stage_counts[0]); i++) {
+        if (write_script(lines, stage_counts[i], "true", "true") != 0) {
+            return -1;
+        }
+        for (int j = 0; j < sizeof(launchers) / sizeof(launchers[0]); j++) {
+            double elapsed = run_script(launchers[j], NULL);
+            if (elapsed < 0) {
+                return -1;
+            }
+            printf("{\"bench\":\"launch\",\"launcher\":\"%s\",\"stages\":%d,\"pipelines\":%d,"
+                   "\"us_per_pipeline\":%.1f,\"us_per_stage\":%.1f}\n",
+                   launchers[j], stage_counts[i], lines, elapsed * 1e6 / lines,
+                   elapsed * 1e6 / lines / stage_counts[i]);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+static int bench_throughput(int quick) {
+    size_t size = (quick ? 16 : 256) << 20;
+    int fd = open(DATA_PATH, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror(DATA_PATH);
+        return -1;
+    }
+    char block[65536];
+    for (size_t i = 0; i < sizeof(block); i++) {
+        block[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+    }
+    for (size_t written = 0; written < size; written += sizeof(block)) {
+        if (write(fd, block, sizeof(block)) != sizeof(block)) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    int stage_counts[] = {2, 4, 8};
+    for (int i = 0; i < sizeof(stage_counts) / sizeof(stage_counts[0]); i++) {
+        // cat FILE | cat | ... | wc -c, with stage_counts[i] stages in all
+        FILE *f = fopen(SCRIPT_PATH, "w");
+        if (f == NULL) {
+            perror(SCRIPT_PATH);
+            return -1;
+        }
+        fprintf(f, "cat %s", DATA_PATH);
+        for (int j = 2; j < stage_counts[i]; j++) {
+            fputs(" | cat", f);
+        }
+        fputs(" | wc -c\n", f);
+        fclose(f);
+
+        double elapsed = run_script("fork", NULL);
+        if (elapsed < 0) {
+            return -1;
+        }
+        printf("{\"bench\":\"throughput\",\"stages\":%d,\"bytes\":%zu,\"mb_per_s\":%.1f}\n",
+               stage_counts[i], size, size / elapsed / (1 << 20));
+        fflush(stdout);
+    }
+    unlink(DATA_PATH);
+    return 0;
+}
+
+static int bench_tokenize(int quick) {
+    int num_tokens = 2000;
+    int iterations = quick ? 50 : 2000;
+    // a long pipeline-like line: words, operators, and a quoted argument
+    size_t line_len = 0;
+    char *line = malloc(num_tokens * 16);
+    char *work = malloc(num_tokens * 16);
+    if (line == NULL || work == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        free(line);
+        free(work);
+        return -1;
+    }
+    for (int i = 0; i < num_tokens; i++) {
+        const char *tok = (i % 10 == 7) ? "|" : (i % 10 == 4) ? "'a b'" : "arg";
+        line_len += sprintf(line + line_len, "%s%s", i > 0 ? " " : "", tok);
+    }
+
+    strvec_t tokens;
+    strvec_init_arena(&tokens, 0);
+    double start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        memcpy(work, line, line_len + 1);  // tokenizing modifies the line
+        if (tokenize_inplace(work, &tokens) != 0) {
+            fprintf(stderr, "tokenize_inplace failed\n");
+            break;
+        }
+        strvec_reset(&tokens);
+    }
+    double inplace = now_sec() - start;
+    strvec_clear(&tokens);
+
+    // the same line with no quotes, through the copying tokenizer and a heap vector
+    for (size_t i = 0; i < line_len; i++) {
+        if (line[i] == '\'') {
+            line[i] = 'q';
+        }
+    }
+    strvec_init(&tokens);
+    start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        memcpy(work, line, line_len + 1);
+        if (tokenize(work, &tokens) != 0) {
+            fprintf(stderr, "tokenize failed\n");
+            break;
+        }
+        strvec_clear(&tokens);
+    }
+    double copying = now_sec() - start;
+
+    // parsing the tokens into stages
+    strvec_init_arena(&tokens, 0);
+    memcpy(work, line, line_len + 1);
+    tokenize_inplace(work, &tokens);
+    start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        pipeline_t pipeline;
+        if (parse_pipeline(&tokens, &pipeline) != 0) {
+            break;
+        }
+        pipeline_free(&pipeline);
+    }
+    double parse = now_sec() - start;
+    strvec_clear(&tokens);
+
+    double per_token = 1e9 / ((double) iterations * num_tokens);
+    printf("{\"bench\":\"tokenize\",\"impl\":\"tokenize_inplace\",\"tokens\":%d,\"ns_per_token\":%.2f}\n",
+           num_tokens, inplace * per_token);
+    printf("{\"bench\":\"tokenize\",\"impl\":\"tokenize\",\"tokens\":%d,\"ns_per_token\":%.2f}\n",
+           num_tokens, copying * per_token);
+    printf("{\"bench\":\"tokenize\",\"impl\":\"parse_pipeline\",\"tokens\":%d,\"ns_per_token\":%.2f}\n",
+           num_tokens, parse * per_token);
+    free(line);
+    free(work);
+    return 0;
+}
+
+static int bench_strvec(int quick) {
+    int length = 4096;
+    int iterations = quick ? 200 : 20000;
+    strvec_t vecs[2];
+    char word[32];
+    for (int v = 0; v < 2; v++) {
+        strvec_init_arena(&vecs[v], 0);
+        if (v == 1 && strvec_index(&vecs[v]) != 0) {
+            fprintf(stderr, "strvec_index failed\n");
+            return -1;
+        }
+        for (int i = 0; i < length; i++) {  // i % 512 distinct words, each occurring 8 times
+            snprintf(word, sizeof(word), "word%d", i % 512);
+            if (strvec_add(&vecs[v], word) != 0) {
+                fprintf(stderr, "strvec_add failed\n");
+                return -1;
+            }
+        }
+    }
+    const char *impls[] = {"scan", "indexed"};
+    for (int v = 0; v < 2; v++) {
+        long sink = 0;
+        double start = now_sec();
+        for (int i = 0; i < iterations; i++) {
+            snprintf(word, sizeof(word), "word%d", (i * 7) % 600);  // some are missing
+            sink += strvec_find(&vecs[v], word) + strvec_find_last(&vecs[v], word)
+                    + strvec_num_occurrences(&vecs[v], word);
+        }
+        double elapsed = now_sec() - start;
+        printf("{\"bench\":\"strvec\",\"impl\":\"%s\",\"length\":%d,\"ns_per_query\":%.1f,\"check\":%ld}\n",
+               impls[v], length, elapsed * 1e9 / (3.0 * iterations), sink);
+        strvec_clear(&vecs[v]);
+    }
+    return 0;
+}
+
+static int bench_filters(int quick) {
+    int lines = quick ? 20 : 500;
+    char first[128];
+    snprintf(first, sizeof(first), "cat %s", SCRIPT_PATH);  // the script itself is the small input
+    FILE *f = fopen(SCRIPT_PATH, "w");
+    if (f == NULL) {
+        perror(SCRIPT_PATH);
+        return -1;
+    }
+    for (int i = 0; i < lines; i++) {
+        fprintf(f, "%s | tr a-z A-Z | head -n 50 | wc -l\n", first);
+    }
+    if (fclose(f) != 0) {
+        return -1;
+    }
+    const char *modes[] = {"exec", "builtin"};
+    for (int j = 0; j < 2; j++) {
+        double elapsed = run_script("fork", (j == 1) ? "-B" : NULL);
+        if (elapsed < 0) {
+            return -1;
+        }
+        printf("{\"bench\":\"filters\",\"mode\":\"%s\",\"pipelines\":%d,\"us_per_pipeline\":%.1f}\n",
+               modes[j], lines, elapsed * 1e6 / lines);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// the shell's own copying, waiting with io_uring or with poll(), over a split and merge of many pipes
+static int bench_pumps(int quick) {
+    int lines = quick ? 5 : 50;
+    if (write_script(lines, 1, "seq 1 200000 ||= 16 cat | tail -n 1", "") != 0) {
+        return -1;
+    }
+    const char *modes[] = {"io_uring", "poll"};
+    for (int j = 0; j < 2; j++) {
+        setenv("SWISH_URING", (j == 0) ? "1" : "0", 1);
+        double elapsed = run_script("fork", NULL);
+        if (elapsed < 0) {
+            return -1;
+        }
+        printf("{\"bench\":\"pumps\",\"wait\":\"%s\",\"pipelines\":%d,\"ms_per_pipeline\":%.2f}\n",
+               modes[j], lines, elapsed * 1e3 / lines);
+        fflush(stdout);
+    }
+    unsetenv("SWISH_URING");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int quick = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "qs:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quick = 1;
+            break;
+        case 's':
+            swish_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-s path/to/swish]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int ret = 0;
+    if (bench_tokenize(quick) != 0 || bench_strvec(quick) != 0 || bench_launch(quick) != 0 || bench_throughput(quick) != 0
+        || bench_filters(quick) != 0 || bench_pumps(quick) != 0) {
+        ret = 1;
+    }
+    unlink(SCRIPT_PATH);
+    return ret;
+}
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE  // mkostemp()
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define COPY_BUF_SIZE (64 * 1024)
+
+void cache_key_init(cache_key_t *key) {
+    key->data = NULL;
+    key->len = 0;
+    key->cap = 0;
+}
+
+int cache_key_add(cache_key_t *key, const void *data, size_t len) {
+    if (key->len + len > key->cap) {
+        size_t new_cap = (key->cap == 0) ? 256 : key->cap;
+        while (new_cap < key->len + len) {
+            new_cap *= 2;
+        }
+        char *new_data = realloc(key->data, new_cap);
+        if (new_data == NULL) {
+            return -1;
+        }
+        key->data = new_data;
+        key->cap = new_cap;
+    }
+    memcpy(key->data + key->len, data, len);
+    key->len += len;
+    return 0;
+}
+
+int cache_key_add_file(cache_key_t *key, const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {  // a pipe or device has no fixed contents
+        return -1;
+    }
+    // fixed-width fields, so the key can't be ambiguous
+    uint64_t id[6] = {st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, strlen(path)};
+    if (cache_key_add(key, id, sizeof(id)) == -1 || cache_key_add(key, path, strlen(path)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+void cache_key_free(cache_key_t *key) {
+    free(key->data);
+    cache_key_init(key);
+}
+
+// path of the entry for a key: the directory and a 64-bit FNV-1a hash of the key in hex
+static char *entry_path(const char *dir, const cache_key_t *key) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < key->len; i++) {
+        h = (h ^ (unsigned char) key->data[i]) * 1099511628211ull;
+    }
+    size_t len = strlen(dir) + 18;
+    char *path = malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s/%016llx", dir, (unsigned long long) h);
+    }
+    return path;
+}
+
+int cache_lookup(const char *dir, const cache_key_t *key, off_t *len) {
+    char *path = entry_path(dir, key);
+    if (path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    uint64_t key_len;
+    char *saved = NULL;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t) (key->len + sizeof(key_len))
+        || pread(fd, &key_len, sizeof(key_len), st.st_size - sizeof(key_len)) != sizeof(key_len)
+        || key_len != key->len || (saved = malloc(key->len + 1)) == NULL) {
+        goto miss;
+    }
+    off_t data_len = st.st_size - sizeof(key_len) - key->len;
+    if (pread(fd, saved, key->len, data_len) != (ssize_t) key->len || memcmp(saved, key->data, key->len) != 0) {
+        goto miss;  // a different key with the same hash, or a damaged entry
+    }
+    utimensat(AT_FDCWD, path, NULL, 0);  // recently used, so evicted last
+    free(saved);
+    free(path);
+    *len = data_len;
+    return fd;
+
+miss:
+    if (fd != -1) {
+        close(fd);
+    }
+    free(saved);
+    free(path);
+    return -1;
+}
+
+int cache_create(const char *dir, char **tmp_path) {
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    size_t len = strlen(dir) + 12;
+    char *path = malloc(len);
+    if (path == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    snprintf(path, len, "%s/tmp.XXXXXX", dir);
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        perror("mkostemp");
+        free(path);
+        return -1;
+    }
+    *tmp_path = path;
+    return fd;
+}
+
+void cache_discard(int fd, char *tmp_path) {
+    unlink(tmp_path);
+    close(fd);
+    free(tmp_path);
+}
+
+typedef struct {
+    char *name;
+    off_t size;
+    struct timespec used;
+} entry_t;
+
+static int older_first(const void *a, const void *b) {
+    const struct timespec *x = &((const entry_t *) a)->used;
+    const struct timespec *y = &((const entry_t *) b)->used;
+    if (x->tv_sec != y->tv_sec) {
+        return (x->tv_sec < y->tv_sec) ? -1 : 1;
+    }
+    return (x->tv_nsec < y->tv_nsec) ? -1 : (x->tv_nsec > y->tv_nsec);
+}
+
+// remove the least recently used entries in the directory until they hold at most 'limit' bytes
+static void evict(const char *dir, unsigned long limit) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    entry_t *entries = NULL;
+    size_t num_entries = 0;
+    size_t capacity = 0;
+    unsigned long total = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+        if (strncmp(de->d_name, "tmp.", 4) == 0  // a recording, maybe another shell's, not yet an entry
+            || fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (num_entries == capacity) {
+            size_t new_capacity = (capacity == 0) ? 64 : 2 * capacity;
+            entry_t *new_entries = realloc(entries, new_capacity * sizeof(entry_t));
+            if (new_entries == NULL) {
+                break;
+            }
+            entries = new_entries;
+            capacity = new_capacity;
+        }
+        entry_t *e = &entries[num_entries];
+        if ((e->name = strdup(de->d_name)) == NULL) {
+            break;
+        }
+        e->size = st.st_size;
+        e->used = st.st_mtim;
+        total += st.st_size;
+        num_entries++;
+    }
+    if (total > limit) {
+        qsort(entries, num_entries, sizeof(entry_t), older_first);
+        for (size_t i = 0; i < num_entries && total > limit; i++) {
+            if (unlinkat(dirfd(d), entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    for (size_t i = 0; i < num_entries; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+    closedir(d);
+}
+
+int cache_commit(const char *dir, const cache_key_t *key, int fd, char *tmp_path, unsigned long limit) {
+    struct stat st;
+    uint64_t key_len = key->len;
+    char *path = entry_path(dir, key);
+    if (path == NULL || fstat(fd, &st) == -1
+        || st.st_size + key->len + sizeof(key_len) > limit  // would only push everything else out
+        || pwrite(fd, key->data, key->len, st.st_size) != (ssize_t) key->len
+        || pwrite(fd, &key_len, sizeof(key_len), st.st_size + key->len) != sizeof(key_len)
+        || rename(tmp_path, path) == -1) {
+        free(path);
+        cache_discard(fd, tmp_path);
+        return -1;
+    }
+    close(fd);
+    free(tmp_path);
+    free(path);
+    evict(dir, limit);
+    return 0;
+}
+
+int cache_copy(int src_fd, off_t len, int dst_fd) {
+    off_t off = 0;
+    while (off < len) {
+        ssize_t n = sendfile(dst_fd, src_fd, &off, len - off);  // advances off, not the file offset
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            break;  // the destination can't take sendfile(), copy the rest by hand
+        } else if (n == -1) {
+            perror("sendfile");
+            return -1;
+        } else if (n == 0) {
+            return 0;  // the entry was truncated under us
+        }
+    }
+    char buf[COPY_BUF_SIZE];
+    while (off < len) {
+        ssize_t n = pread(src_fd, buf, (len - off < COPY_BUF_SIZE) ? len - off : COPY_BUF_SIZE, off);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return (n == 0) ? 0 : -1;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(dst_fd, buf + done, n - done);
+            if (w == -1 && errno != EINTR) {
+                perror("write");
+                return -1;
+            }
+            done += (w > 0) ? w : 0;
+        }
+        off += n;
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * On-disk cache of pipeline output. Each entry is a file in the cache
+ * directory named after a hash of its key, holding the saved output followed
+ * by the full key (checked on every lookup, so hash collisions can't replay
+ * the wrong output) and the key's length. Entries are evicted least recently
+ * used first once the directory grows past its size limit.
+ */
+
+// what a cached result depends on, built up with cache_key_add*()
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} cache_key_t;
+
+void cache_key_init(cache_key_t *key);
+
+/*
+ * Append bytes to a key
+ * key: Key to extend
+ * data: Bytes to append
+ * len: Number of bytes
+ * Returns 0 on success or -1 on error
+ */
+int cache_key_add(cache_key_t *key, const void *data, size_t len);
+
+/*
+ * Append a file's name and identity (device, inode, size and modification
+ * time) to a key, so that the key changes whenever the file does
+ * key: Key to extend
+ * path: File to add
+ * Returns 0 on success or -1 if the file can't be examined
+ */
+int cache_key_add_file(cache_key_t *key, const char *path);
+
+void cache_key_free(cache_key_t *key);
+
+/*
+ * Find the saved output for a key, marking the entry as recently used
+ * dir: Cache directory
+ * key: Key to look up
+ * len: Set to the length of the saved output
+ * Returns a descriptor to read the output from (at offset 0), or -1 if the
+ * key has no entry
+ */
+int cache_lookup(const char *dir, const cache_key_t *key, off_t *len);
+
+/*
+ * Create a temporary file in the cache directory (creating the directory if
+ * needed) to record output into
+ * dir: Cache directory
+ * tmp_path: Set to the file's path, a malloc'd string
+ * Returns a descriptor for the file (close-on-exec) or -1 on error
+ */
+int cache_create(const char *dir, char **tmp_path);
+
+/*
+ * Turn a recorded file into the entry for a key, then evict entries while the
+ * directory is over its limit. The descriptor is closed and tmp_path freed.
+ * dir: Cache directory
+ * key: Key the output was produced for
+ * fd: Descriptor from cache_create(), with the output written to it
+ * tmp_path: Path from cache_create()
+ * limit: Most bytes to keep in the directory
+ * Returns 0 on success or -1 on error (the recording is discarded)
+ */
+int cache_commit(const char *dir, const cache_key_t *key, int fd, char *tmp_path, unsigned long limit);
+
+/*
+ * Throw away a recording, closing the descriptor and freeing tmp_path
+ */
+void cache_discard(int fd, char *tmp_path);
+
+/*
+ * Copy saved output to its destination, with sendfile() where possible
+ * src_fd: Descriptor to copy from, starting at offset 0
+ * len: Number of bytes to copy
+ * dst_fd: Descriptor to write to
+ * Returns 0 on success or -1 on error
+ */
+int cache_copy(int src_fd, off_t len, int dst_fd);
+
+#endif // CACHE_H
@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cmd_hash.h"
+
+#define INITIAL_SLOTS 32  // must be a power of 2
+
+typedef struct {
+    char *name;  // NULL for an empty slot
+    char *path;
+    unsigned hits;
+} entry_t;
+
+// open addressing with linear probing; entries are only removed all at once,
+// except by cmd_hash_forget() which re-inserts the rest of the probe run
+static entry_t *slots = NULL;
+static unsigned num_slots = 0;
+static unsigned num_entries = 0;
+static char *path_env = NULL;  // value of PATH the cache was built against
+
+static uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    while (*s != '\0') {
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    }
+    return h;
+}
+
+static entry_t *find_slot(entry_t *table, unsigned size, const char *name) {
+    unsigned i = hash_name(name) & (size - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+void cmd_hash_clear(void) {
+    for (unsigned i = 0; i < num_slots; i++) {
+        if (slots[i].name != NULL) {
+            free(slots[i].name);
+            free(slots[i].path);
+        }
+    }
+    free(slots);
+    slots = NULL;
+    num_slots = 0;
+    num_entries = 0;
+    free(path_env);
+    path_env = NULL;
+}
+
+// make room for one more entry, keeping the load factor at or below 1/2
+static int grow(void) {
+    if (2 * (num_entries + 1) <= num_slots) {
+        return 0;
+    }
+    unsigned new_size = (num_slots == 0) ? INITIAL_SLOTS : 2 * num_slots;
+    entry_t *table = calloc(new_size, sizeof(entry_t));
+    if (table == NULL) {
+        return -1;
+    }
+    for (unsigned i = 0; i < num_slots; i++) {
+        if (slots[i].name != NULL) {
+            *find_slot(table, new_size, slots[i].name) = slots[i];
+        }
+    }
+    free(slots);
+    slots = table;
+    num_slots = new_size;
+    return 0;
+}
+
+/*
+ * Search PATH for an executable the way execvp() does
+ * Returns a newly allocated path, or NULL if there is none
+ */
+static char *search_path(const char *name, const char *path) {
+    size_t name_len = strlen(name);
+    const char *dir = path;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = (end != NULL) ? (size_t) (end - dir) : strlen(dir);
+        char *candidate = malloc(dir_len + name_len + 3);
+        if (candidate == NULL) {
+            return NULL;
+        }
+        if (dir_len == 0) {  // empty entry means the current directory
+            strcpy(candidate, "./");
+        } else {
+            memcpy(candidate, dir, dir_len);
+            candidate[dir_len] = '/';
+            candidate[dir_len + 1] = '\0';
+        }
+        strcat(candidate, name);
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        if (end == NULL) {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+const char *cmd_hash_lookup(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "/bin:/usr/bin";  // execvp()'s default
+    }
+    if (path_env != NULL && strcmp(path, path_env) != 0) {
+        cmd_hash_clear();  // PATH changed, every entry may be stale
+    }
+    if (path_env == NULL && (path_env = strdup(path)) == NULL) {
+        return NULL;
+    }
+
+    if (num_slots > 0) {
+        entry_t *entry = find_slot(slots, num_slots, name);
+        if (entry->name != NULL) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+    char *found = search_path(name, path);
+    if (found == NULL) {
+        return NULL;  // not cached, the next lookup searches again
+    }
+    char *key = strdup(name);
+    if (key == NULL || grow() != 0) {
+        free(key);
+        free(found);
+        return NULL;
+    }
+    entry_t *entry = find_slot(slots, num_slots, name);
+    entry->name = key;
+    entry->path = found;
+    entry->hits = 1;
+    num_entries++;
+    return found;
+}
+
+void cmd_hash_forget(const char *name) {
+    if (num_slots == 0) {
+        return;
+    }
+    entry_t *entry = find_slot(slots, num_slots, name);
+    if (entry->name == NULL) {
+        return;
+    }
+    free(entry->name);
+    free(entry->path);
+    memset(entry, 0, sizeof(entry_t));
+    num_entries--;
+    // re-insert the rest of the probe run so lookups don't stop at the hole
+    unsigned i = (entry - slots + 1) & (num_slots - 1);
+    while (slots[i].name != NULL) {
+        entry_t moved = slots[i];
+        memset(&slots[i], 0, sizeof(entry_t));  // the entry's strings now belong to its new slot only
+        *find_slot(slots, num_slots, moved.name) = moved;
+        i = (i + 1) & (num_slots - 1);
+    }
+}
+
+void cmd_hash_print(FILE *out) {
+    if (num_entries == 0) {
+        fprintf(out, "hash: hash table empty\n");
+        return;
+    }
+    fprintf(out, "hits\tcommand\n");
+    for (unsigned i = 0; i < num_slots; i++) {
+        if (slots[i].name != NULL) {
+            fprintf(out, "%4u\t%s\n", slots[i].hits, slots[i].path);
+        }
+    }
+}
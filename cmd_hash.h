@@ -0,0 +1,39 @@
+#ifndef CMD_HASH_H
+#define CMD_HASH_H
+
+#include <stdio.h>
+
+/*
+ * Shell-wide cache from command names to the programs found for them on
+ * $PATH, so each name is searched for once rather than by every exec.
+ * The whole cache is dropped whenever PATH changes.
+ */
+
+/*
+ * Resolve a command name to the program execvp() would run
+ * name: The command name
+ * Returns the program's path (owned by the cache, valid until the entry is
+ * forgotten), 'name' itself if it contains a '/', or NULL if no executable
+ * of that name is on PATH
+ */
+const char *cmd_hash_lookup(const char *name);
+
+/*
+ * Drop the cached path for a command, e.g. because running it failed. The
+ * path returned by cmd_hash_lookup() is freed, so nothing may still use it.
+ * name: The command name
+ */
+void cmd_hash_forget(const char *name);
+
+/*
+ * Drop every cached path and release the cache's memory
+ */
+void cmd_hash_clear(void);
+
+/*
+ * Print the cached commands and how often each was used, like bash's 'hash'
+ * out: Stream to print to
+ */
+void cmd_hash_print(FILE *out);
+
+#endif // CMD_HASH_H
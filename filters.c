@@ -0,0 +1,860 @@
+#define _GNU_SOURCE  // memrchr()
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "filters.h"
+#include "input_map.h"
+
+#define FILTER_BUF_SIZE (128 * 1024)
+#define MAX_SET_LEN 4096  // most bytes a tr set may expand to
+#define MEM_CHUNK (1024 * 1024)  // most handed out of a mapped input at once
+
+// every filter runs alone in its own child, so one buffer serves them all
+static char buf[FILTER_BUF_SIZE];
+
+// an input read from memory rather than with read()
+typedef struct {
+    int fd;            // descriptor the data is read in place of, -1 if none
+    const char *data;  // NULL if 'fd' turned out not to be mappable
+    size_t len;
+    size_t pos;        // how much has been read
+    input_map_t map;   // the mapping, if this module made it
+} mem_input_t;
+
+static mem_input_t given = {.fd = -1};   // standard input of a copy handed a range by filter_run_range()
+static mem_input_t mapped = {.fd = -1};  // the last input tried for mapping
+
+/*
+ * Find the memory an input can be read from, mapping it the first time if it
+ * is a regular file. Filters read their inputs one after another, so only
+ * the latest one is kept mapped.
+ * Returns the input, or NULL if it has to be read with read()
+ */
+static mem_input_t *mem_input(int fd) {
+    if (given.fd == fd) {
+        return &given;
+    } else if (mapped.fd == fd) {
+        return (mapped.data != NULL) ? &mapped : NULL;
+    }
+    input_map_close(&mapped.map);
+    mapped.fd = fd;  // even if it can't be mapped, so that isn't tried again on every read
+    mapped.data = NULL;
+    off_t pos = lseek(fd, 0, SEEK_CUR);  // a file may have been partly read already
+    if (pos == -1 || input_map_open(&mapped.map, fd) == -1 || (size_t) pos >= mapped.map.len) {
+        input_map_close(&mapped.map);
+        return NULL;
+    }
+    mapped.data = mapped.map.data;
+    mapped.len = mapped.map.len;
+    mapped.pos = pos;
+    return &mapped;
+}
+
+// whether an input is a regular file and, if so, its status; a range handed to a copy counts as a pipe
+static int is_regular(int fd, struct stat *st) {
+    return given.fd != fd && fstat(fd, st) == 0 && S_ISREG(st->st_mode);
+}
+
+// read up to 'len' bytes into 'dst', from memory if the input is mapped
+static ssize_t read_some(int fd, char *dst, size_t len) {
+    mem_input_t *mem = mem_input(fd);
+    if (mem != NULL) {
+        size_t n = (mem->len - mem->pos < len) ? mem->len - mem->pos : len;
+        memcpy(dst, mem->data + mem->pos, n);
+        mem->pos += n;
+        return n;
+    }
+    ssize_t n;
+    while ((n = read(fd, dst, len)) == -1 && errno == EINTR) {
+    }
+    return n;
+}
+
+// the next part of an input: straight from memory if it is mapped, otherwise read into 'buf'
+static ssize_t next_chunk(int fd, const char **data) {
+    mem_input_t *mem = mem_input(fd);
+    if (mem == NULL) {
+        *data = buf;
+        return read_some(fd, buf, FILTER_BUF_SIZE);
+    }
+    size_t n = (mem->len - mem->pos < MEM_CHUNK) ? mem->len - mem->pos : MEM_CHUNK;
+    *data = mem->data + mem->pos;
+    mem->pos += n;
+    return n;
+}
+
+static int write_all(const char *prog, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) {
+            fprintf(stderr, "%s: write error: %s\n", prog, strerror(errno));
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Open a file named on the command line, reporting failure like the program does
+ * quoted: nonzero for the "cannot open 'FILE' for reading" form used by head and tail
+ * Returns a descriptor (standard input for "-") or -1 on error
+ */
+static int open_input(const char *prog, const char *path, int quoted) {
+    if (strcmp(path, "-") == 0) {
+        return STDIN_FILENO;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && quoted) {
+        fprintf(stderr, "%s: cannot open '%s' for reading: %s\n", prog, path, strerror(errno));
+    } else if (fd == -1) {
+        fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+    }
+    return fd;
+}
+
+static void close_input(int fd) {
+    if (mapped.fd == fd) {
+        input_map_close(&mapped.map);
+        mapped.fd = -1;
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+}
+
+static void read_error(const char *prog, const char *name) {
+    fprintf(stderr, "%s: %s: %s\n", prog, name, strerror(errno));
+}
+
+// parse a plain decimal count, with no sign or size suffix
+static int parse_count(const char *s, unsigned long long *n) {
+    if (*s < '0' || *s > '9') {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    *n = strtoull(s, &end, 10);
+    return (errno != 0 || *end != '\0') ? -1 : 0;
+}
+
+// nonzero if the character type locale is the C one, where every byte is a character
+static int c_locale(void) {
+    const char *vars[] = {"LC_ALL", "LC_CTYPE", "LANG"};
+    for (int i = 0; i < 3; i++) {
+        const char *val = getenv(vars[i]);
+        if (val != NULL && val[0] != '\0') {
+            return strcmp(val, "C") == 0 || strcmp(val, "POSIX") == 0;
+        }
+    }
+    return 1;
+}
+
+// count the newlines in a buffer
+static size_t count_newlines(const char *data, size_t len) {
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= len) {
+        // each byte lane counts up to 255 matches before the lanes are summed
+        __m128i lanes = zero;
+        size_t block_end = i + 255 * 16;
+        if (block_end > len) {
+            block_end = len;
+        }
+        for (; i + 16 <= block_end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(v, newline));  // a match is -1
+        }
+        __m128i sums = _mm_sad_epu8(lanes, zero);
+        count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+#endif
+    for (; i < len; i++) {
+        count += (data[i] == '\n');
+    }
+    return count;
+}
+
+// copy everything from 'fd' to standard output
+static int copy_fd(const char *prog, const char *name, int fd) {
+    const char *data;
+    ssize_t n;
+    while ((n = next_chunk(fd, &data)) > 0) {
+        if (write_all(prog, data, n) == -1) {
+            return -1;
+        }
+    }
+    if (n == -1) {
+        read_error(prog, name);
+        return -1;
+    }
+    return 0;
+}
+
+// cat [FILE...]
+static int filter_cat(char **argv) {
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            return -1;
+        }
+    }
+    if (argv[1] == NULL) {
+        return (copy_fd("cat", "-", STDIN_FILENO) == 0) ? 0 : 1;
+    }
+    int status = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        int fd = open_input("cat", argv[i], 0);
+        if (fd == -1 || copy_fd("cat", argv[i], fd) == -1) {
+            status = 1;
+        }
+        if (fd != -1) {
+            close_input(fd);
+        }
+    }
+    return status;
+}
+
+/*
+ * Parse the options of head or tail: "-n N", "-nN" or "-N" (first only), and
+ * for head "-c N" too. tail also takes "-n +N" to start at line N.
+ * Returns 0 on success or -1 for anything else, including more than one file
+ */
+static int parse_head_tail(char **argv, int is_tail, unsigned long long *count, int *bytes, int *from_start,
+                           const char **path) {
+    *count = 10;
+    *bytes = 0;
+    *from_start = 0;
+    *path = "-";
+    int num_files = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        const char *arg = argv[i];
+        if (arg[0] != '-' || arg[1] == '\0') {
+            if (num_files++ > 0) {
+                return -1;  // several files are printed with headers, left to the program
+            }
+            *path = arg;
+        } else if (arg[1] == 'n' || (arg[1] == 'c' && !is_tail)) {
+            const char *val = (arg[2] != '\0') ? arg + 2 : argv[++i];
+            if (val == NULL) {
+                return -1;
+            }
+            *bytes = (arg[1] == 'c');
+            *from_start = (is_tail && val[0] == '+');
+            if (parse_count(val + *from_start, count) == -1) {
+                return -1;
+            }
+        } else if (i != 1 || parse_count(arg + 1, count) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// head [-n N | -c N | -N] [FILE]
+static int filter_head(char **argv) {
+    unsigned long long count;
+    int bytes;
+    int from_start;
+    const char *path;
+    if (parse_head_tail(argv, 0, &count, &bytes, &from_start, &path) == -1) {
+        return -1;
+    }
+    int fd = open_input("head", path, 1);
+    if (fd == -1) {
+        return 1;
+    }
+    int status = 0;
+    while (count > 0) {
+        const char *data;
+        ssize_t n = next_chunk(fd, &data);
+        if (n <= 0) {
+            if (n == -1) {
+                read_error("head", path);
+                status = 1;
+            }
+            break;
+        }
+        size_t keep = n;
+        if (bytes) {
+            keep = (count < (unsigned long long) n) ? count : (size_t) n;
+            count -= keep;
+        } else {
+            const char *end = data + n;
+            const char *p = data;
+            while (count > 0 && (p = memchr(p, '\n', end - p)) != NULL) {
+                p++;
+                count--;
+            }
+            if (count == 0) {
+                keep = p - data;
+            }
+        }
+        if (write_all("head", data, keep) == -1) {
+            status = 1;
+            break;
+        }
+    }
+    close_input(fd);
+    return status;
+}
+
+// offset in 'data' of the start of its last 'n' lines, counting an unterminated last line as one
+static size_t last_lines_start(const char *data, size_t len, unsigned long long n) {
+    if (n == 0) {
+        return len;
+    }
+    size_t pos = len;
+    if (pos > 0 && data[pos - 1] == '\n') {
+        pos--;  // the last line's own newline
+    }
+    while (pos > 0) {
+        const char *nl = memrchr(data, '\n', pos);
+        if (nl == NULL) {
+            return 0;
+        }
+        if (--n == 0) {
+            return nl + 1 - data;
+        }
+        pos = nl - data;
+    }
+    return 0;
+}
+
+// tail -n +N: skip the first N - 1 lines and copy the rest
+static int tail_from(int fd, const char *path, unsigned long long line) {
+    unsigned long long skip = (line > 0) ? line - 1 : 0;
+    const char *data;
+    ssize_t n;
+    while (skip > 0 && (n = next_chunk(fd, &data)) > 0) {
+        const char *end = data + n;
+        const char *p = data;
+        while (skip > 0 && (p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            skip--;
+        }
+        if (skip == 0 && write_all("tail", p, end - p) == -1) {
+            return 1;
+        }
+    }
+    if (skip > 0 && n == -1) {
+        read_error("tail", path);
+        return 1;
+    }
+    return (copy_fd("tail", path, fd) == 0) ? 0 : 1;
+}
+
+// tail -n N: keep only as much of the input as holds its last N lines
+static int tail_last(int fd, const char *path, unsigned long long count) {
+    mem_input_t *mem = mem_input(fd);
+    if (mem != NULL) {  // all of it is at hand already
+        const char *data = mem->data + mem->pos;
+        size_t len = mem->len - mem->pos;
+        size_t start = last_lines_start(data, len, count);
+        mem->pos = mem->len;
+        return (write_all("tail", data + start, len - start) == 0) ? 0 : 1;
+    }
+    size_t cap = FILTER_BUF_SIZE;
+    size_t len = 0;
+    char *data = malloc(cap);
+    if (data == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    for (;;) {
+        if (len == cap) {
+            size_t start = last_lines_start(data, len, count);
+            if (start >= cap / 2) {  // drop what is no longer needed
+                memmove(data, data + start, len - start);
+                len -= start;
+            } else {  // the last lines fill most of the buffer, make room for more
+                char *new_data = realloc(data, 2 * cap);
+                if (new_data == NULL) {
+                    fprintf(stderr, "malloc failed\n");
+                    free(data);
+                    return 1;
+                }
+                data = new_data;
+                cap *= 2;
+            }
+        }
+        ssize_t n = read_some(fd, data + len, cap - len);
+        if (n == -1) {
+            read_error("tail", path);
+            free(data);
+            return 1;
+        } else if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    size_t start = last_lines_start(data, len, count);
+    int status = (write_all("tail", data + start, len - start) == 0) ? 0 : 1;
+    free(data);
+    return status;
+}
+
+// tail [-n N | -n +N | -N] [FILE]
+static int filter_tail(char **argv) {
+    unsigned long long count;
+    int bytes;
+    int from_start;
+    const char *path;
+    if (parse_head_tail(argv, 1, &count, &bytes, &from_start, &path) == -1) {
+        return -1;
+    }
+    int fd = open_input("tail", path, 1);
+    if (fd == -1) {
+        return 1;
+    }
+    int status = from_start ? tail_from(fd, path, count) : tail_last(fd, path, count);
+    close_input(fd);
+    return status;
+}
+
+// character classes tr accepts as "[:name:]", in the C locale
+static const struct {
+    const char *name;
+    int (*test)(int c);
+} classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+    {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+    {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+#define NUM_CLASSES (sizeof(classes) / sizeof(classes[0]))
+
+// read one possibly escaped character of a tr set, advancing *s past it
+static unsigned char set_char(const char **s) {
+    const char *p = *s;
+    if (*p != '\\' || p[1] == '\0') {
+        *s = p + 1;
+        return *p;
+    }
+    p++;
+    unsigned char c;
+    if (*p >= '0' && *p <= '7') {
+        c = 0;
+        for (int i = 0; i < 3 && *p >= '0' && *p <= '7' && c * 8 + (*p - '0') <= 255; i++) {
+            c = c * 8 + (*p++ - '0');
+        }
+        *s = p;
+        return c;
+    }
+    const char *from = "abfnrtv";
+    const char *to = "\a\b\f\n\r\t\v";
+    const char *esc = strchr(from, *p);
+    c = (esc != NULL && *p != '\0') ? to[esc - from] : *p;
+    *s = p + 1;
+    return c;
+}
+
+#define MAX_CASE_CLASSES 16
+
+// where the [:lower:] and [:upper:] classes of a tr set were expanded
+typedef struct {
+    int num;
+    int pos[MAX_CASE_CLASSES];
+    int upper[MAX_CASE_CLASSES];
+} case_classes_t;
+
+/*
+ * Expand a tr set into the bytes it lists: characters, backslash escapes,
+ * ranges "a-z" and classes "[:name:]"
+ * allow_case_only: nonzero to accept only the [:lower:] and [:upper:] classes (for SET2)
+ * cases: Filled in with the positions of the case classes
+ * Returns the number of bytes, or -1 for anything else (e.g. "[a*]", "[=a=]")
+ */
+static int expand_set(const char *s, unsigned char *set, int allow_case_only, case_classes_t *cases) {
+    int len = 0;
+    cases->num = 0;
+    while (*s != '\0') {
+        if (s[0] == '[') {
+            if (s[1] != ':') {
+                return -1;
+            }
+            const char *close = strstr(s + 2, ":]");
+            size_t name_len = (close != NULL) ? (size_t) (close - (s + 2)) : 0;
+            unsigned k = 0;
+            while (k < NUM_CLASSES && (strlen(classes[k].name) != name_len
+                                       || strncmp(classes[k].name, s + 2, name_len) != 0)) {
+                k++;
+            }
+            if (k == NUM_CLASSES) {
+                return -1;
+            }
+            int is_case = (classes[k].test == islower || classes[k].test == isupper);
+            if (allow_case_only && !is_case) {
+                return -1;
+            }
+            if (is_case) {
+                if (cases->num == MAX_CASE_CLASSES) {
+                    return -1;
+                }
+                cases->pos[cases->num] = len;
+                cases->upper[cases->num++] = (classes[k].test == isupper);
+            }
+            for (int c = 0; c < 256; c++) {
+                if (classes[k].test(c)) {
+                    if (len == MAX_SET_LEN) {
+                        return -1;
+                    }
+                    set[len++] = c;
+                }
+            }
+            s = close + 2;
+            continue;
+        }
+        unsigned char lo = set_char(&s);
+        unsigned char hi = lo;
+        if (s[0] == '-' && s[1] != '\0') {
+            s++;
+            hi = set_char(&s);
+            if (hi < lo) {
+                return -1;  // tr reports the reversed range
+            }
+        }
+        for (int c = lo; c <= hi; c++) {
+            if (len == MAX_SET_LEN) {
+                return -1;
+            }
+            set[len++] = c;
+        }
+    }
+    return len;
+}
+
+/*
+ * Translate a buffer through 'map' in place. When the only bytes changed are
+ * one range [lo, hi], all moved by the same amount (as for "tr a-z A-Z"),
+ * 16 bytes are translated at a time.
+ */
+static void translate(char *data, size_t len, const unsigned char *map, int range, unsigned char lo,
+                      unsigned char hi) {
+    size_t i = 0;
+#ifdef __SSE2__
+    if (range) {
+        const __m128i low = _mm_set1_epi8(lo);
+        const __m128i span = _mm_set1_epi8(hi - lo);
+        const __m128i delta = _mm_set1_epi8(map[lo] - lo);
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+            __m128i off = _mm_sub_epi8(v, low);
+            __m128i in_range = _mm_cmpeq_epi8(_mm_max_epu8(off, span), span);  // off <= span, unsigned
+            v = _mm_add_epi8(v, _mm_and_si128(in_range, delta));
+            _mm_storeu_si128((__m128i *) (data + i), v);
+        }
+    }
+#else
+    (void) range;
+    (void) lo;
+    (void) hi;
+#endif
+    for (; i < len; i++) {
+        data[i] = map[(unsigned char) data[i]];
+    }
+}
+
+// tr SET1 SET2, or tr -d SET1
+static int filter_tr(char **argv) {
+    int delete = (argv[1] != NULL && strcmp(argv[1], "-d") == 0);
+    char **sets = argv + 1 + delete;
+    int num_sets = 0;
+    while (sets[num_sets] != NULL) {
+        if (sets[num_sets][0] == '-' && sets[num_sets][1] != '\0') {
+            return -1;  // -c, -s, -t and so on, or options after the first
+        }
+        num_sets++;
+    }
+    if (num_sets != (delete ? 1 : 2)) {
+        return -1;
+    }
+    static unsigned char set1[MAX_SET_LEN];
+    static unsigned char set2[MAX_SET_LEN];
+    case_classes_t cases1;
+    case_classes_t cases2;
+    int len1 = expand_set(sets[0], set1, 0, &cases1);
+    int len2 = delete ? 0 : expand_set(sets[1], set2, 1, &cases2);
+    if (len1 == -1 || len2 == -1 || (!delete && len2 == 0)) {
+        return -1;
+    }
+    // a case class in SET2 must line up with the opposite one in SET1, or tr refuses it
+    for (int j = 0; !delete && j < cases2.num; j++) {
+        int aligned = 0;
+        for (int k = 0; k < cases1.num; k++) {
+            aligned |= (cases1.pos[k] == cases2.pos[j] && cases1.upper[k] != cases2.upper[j]);
+        }
+        if (!aligned || len1 != len2) {
+            return -1;
+        }
+    }
+    if (!delete && len2 > len1) {
+        len2 = len1;  // excess characters of SET2 are ignored
+    }
+
+    unsigned char map[256];
+    for (int c = 0; c < 256; c++) {
+        map[c] = delete ? 0 : c;
+    }
+    for (int k = 0; k < len1; k++) {
+        map[set1[k]] = delete ? 1 : set2[(k < len2) ? k : len2 - 1];  // SET2 is padded with its last character
+    }
+
+    // see whether the bytes changed form one range that is shifted as a whole
+    int range = !delete;
+    int lo = -1;
+    int hi = -1;
+    for (int c = 0; c < 256 && range; c++) {
+        if (map[c] == c) {
+            continue;
+        }
+        if (lo == -1) {
+            lo = c;
+        } else if (c != hi + 1 || (unsigned char) (map[c] - c) != (unsigned char) (map[lo] - lo)) {
+            range = 0;
+        }
+        hi = c;
+    }
+    if (lo == -1) {
+        range = 0;
+    }
+
+    ssize_t n;
+    while ((n = read_some(STDIN_FILENO, buf, FILTER_BUF_SIZE)) > 0) {
+        size_t out_len = n;
+        if (delete) {
+            out_len = 0;
+            for (ssize_t i = 0; i < n; i++) {
+                buf[out_len] = buf[i];
+                out_len += !map[(unsigned char) buf[i]];
+            }
+        } else {
+            translate(buf, n, map, range, lo, hi);
+        }
+        if (write_all("tr", buf, out_len) == -1) {
+            return 1;
+        }
+    }
+    if (n == -1) {
+        fprintf(stderr, "tr: read error: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    unsigned long long lines;
+    unsigned long long words;
+    unsigned long long bytes;
+} counts_t;
+
+// count one input for wc; words only if asked, since they need a pass over every byte
+static int wc_count(int fd, const char *name, int words, counts_t *counts) {
+    // a word is a run of printable characters between white space;
+    // other bytes neither start nor end one
+    static signed char kind[256];  // 0 white space, 1 printable, -1 neither
+    for (int c = 0; c < 256 && words; c++) {
+        kind[c] = isspace(c) ? 0 : isprint(c) ? 1 : -1;
+    }
+    int in_word = 0;
+    const char *data;
+    ssize_t n;
+    while ((n = next_chunk(fd, &data)) > 0) {
+        counts->bytes += n;
+        counts->lines += count_newlines(data, n);
+        for (ssize_t i = 0; i < n && words; i++) {
+            int k = kind[(unsigned char) data[i]];
+            counts->words += (k == 1 && !in_word);
+            in_word = (k == 1) | (in_word & (k == -1));
+        }
+    }
+    if (n == -1) {
+        read_error("wc", name);
+        return -1;
+    }
+    return 0;
+}
+
+// print one line of wc output, the fields right-aligned to 'width' as wc does
+static int wc_print(const counts_t *counts, const int *fields, int width, const char *name) {
+    char line[128 + 4096];
+    const unsigned long long values[3] = {counts->lines, counts->words, counts->bytes};
+    int len = 0;
+    for (int f = 0; f < 3; f++) {
+        if (fields[f]) {
+            len += snprintf(line + len, sizeof(line) - len, "%s%*llu", (len > 0) ? " " : "", width, values[f]);
+        }
+    }
+    if (name != NULL) {
+        len += snprintf(line + len, sizeof(line) - len, " %s", name);
+    }
+    if (len >= (int) sizeof(line) - 1) {
+        len = sizeof(line) - 2;
+    }
+    line[len++] = '\n';
+    return write_all("wc", line, len);
+}
+
+// wc [-lwc] [FILE...]
+static int filter_wc(char **argv) {
+    int fields[3] = {0, 0, 0};  // lines, words, bytes
+    int num_files = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        const char *arg = argv[i];
+        if (arg[0] != '-' || arg[1] == '\0') {
+            num_files++;
+            continue;
+        }
+        for (const char *p = arg + 1; *p != '\0'; p++) {
+            const char *opt = strchr("lwc", *p);
+            if (opt == NULL) {
+                return -1;  // -m and -L depend on the locale, long options are left to wc too
+            }
+            fields[opt - "lwc"] = 1;
+        }
+    }
+    if (!fields[0] && !fields[1] && !fields[2]) {
+        fields[0] = fields[1] = fields[2] = 1;
+    }
+    if (fields[1] && !c_locale()) {
+        return -1;  // words of multibyte characters
+    }
+    int num_fields = fields[0] + fields[1] + fields[2];
+
+    char *stdin_name[] = {NULL, NULL};
+    char **names = stdin_name;  // NULL for standard input with no name printed
+    if (num_files > 0) {
+        names = malloc((num_files + 1) * sizeof(char *));
+        if (names == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            return 1;
+        }
+        int k = 0;
+        for (int i = 1; argv[i] != NULL; i++) {
+            if (argv[i][0] != '-' || argv[i][1] == '\0') {
+                names[k++] = argv[i];
+            }
+        }
+        names[k] = NULL;
+    }
+    int num_inputs = (num_files > 0) ? num_files : 1;
+    int *fds = malloc(num_inputs * sizeof(int));
+    if (fds == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        if (names != stdin_name) {
+            free(names);
+        }
+        return 1;
+    }
+
+    // the width wc uses: enough for the total size of the regular files, at
+    // least 7 if anything else is read, and no padding for one field of one input
+    int status = 0;
+    unsigned long long regular_total = 0;
+    int min_width = 1;
+    for (int i = 0; i < num_inputs; i++) {
+        fds[i] = (names[i] == NULL) ? STDIN_FILENO : open_input("wc", names[i], 0);
+        struct stat st;
+        if (fds[i] == -1) {
+            status = 1;
+        } else if (is_regular(fds[i], &st)) {
+            regular_total += st.st_size;
+        } else {
+            min_width = 7;
+        }
+    }
+    int width = 1;
+    if (!(num_inputs == 1 && num_fields == 1)) {
+        for (unsigned long long t = regular_total; t >= 10; t /= 10) {
+            width++;
+        }
+        if (width < min_width) {
+            width = min_width;
+        }
+    }
+
+    counts_t total = {0, 0, 0};
+    for (int i = 0; i < num_inputs; i++) {
+        if (fds[i] == -1) {
+            continue;
+        }
+        counts_t counts = {0, 0, 0};
+        struct stat st;
+        off_t pos;
+        if (!fields[0] && !fields[1] && is_regular(fds[i], &st)
+            && (pos = lseek(fds[i], 0, SEEK_CUR)) != -1 && pos <= st.st_size) {
+            counts.bytes = st.st_size - pos;  // a regular file's size is all -c needs
+        } else if (wc_count(fds[i], (names[i] != NULL) ? names[i] : "-", fields[1], &counts) == -1) {
+            status = 1;
+        }
+        close_input(fds[i]);
+        if (wc_print(&counts, fields, width, names[i]) == -1) {
+            status = 1;
+            break;
+        }
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    }
+    if (num_inputs > 1 && wc_print(&total, fields, width, "total") == -1) {
+        status = 1;
+    }
+    free(fds);
+    if (names != stdin_name) {
+        free(names);
+    }
+    return status;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(char **argv);
+} filters[] = {
+    {"cat", filter_cat},
+    {"head", filter_head},
+    {"tail", filter_tail},
+    {"tr", filter_tr},
+    {"wc", filter_wc},
+};
+#define NUM_FILTERS (sizeof(filters) / sizeof(filters[0]))
+
+int filter_known(const char *name) {
+    for (unsigned i = 0; i < NUM_FILTERS; i++) {
+        if (strcmp(filters[i].name, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int filter_run(char **argv) {
+    for (unsigned i = 0; i < NUM_FILTERS; i++) {
+        if (strcmp(filters[i].name, argv[0]) == 0) {
+            return filters[i].run(argv);
+        }
+    }
+    return -1;
+}
+
+int filter_run_range(char **argv, const char *data, size_t len) {
+    given.fd = STDIN_FILENO;
+    given.data = data;
+    given.len = len;
+    given.pos = 0;
+    input_map_prefetch(data, len);  // each copy faults in its own share, in parallel with the others
+    return filter_run(argv);
+}
@@ -0,0 +1,49 @@
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include <stddef.h>
+
+/*
+ * In-shell versions of a few common filters: cat, head, tail, tr and wc.
+ * With builtin filters turned on, a stage running one of these is forked
+ * off the shell as usual but calls filter_run() instead of exec'ing the
+ * program, which saves the exec and the dynamic loading that dominate on
+ * small inputs. Only the commonly used options are handled; anything else
+ * is left to the real program, so output is always the same as without the
+ * builtins. Counting newlines and translating a single range of bytes are
+ * done 16 bytes at a time with SSE2 where available. Inputs that are regular
+ * files are mapped and read in place rather than copied in with read().
+ */
+
+/*
+ * Check whether a command has an in-shell version
+ * name: Command name, argv[0] of a stage
+ * Returns nonzero if filter_run() may be able to run it
+ */
+int filter_known(const char *name);
+
+/*
+ * Run the in-shell version of a command, reading standard input and writing
+ * standard output like the program would. Output is written straight to the
+ * file descriptor, bypassing stdio. This should be called within a CHILD
+ * process of the shell, which should then _exit() with the returned status.
+ * argv: NULL-terminated argument vector of the command
+ * Returns the exit status (0 or 1), or -1 if the arguments use something the
+ * builtin doesn't support, in which case nothing has been read or written and
+ * the real program should be run instead
+ */
+int filter_run(char **argv);
+
+/*
+ * Run the in-shell version of a command as filter_run() does, but with its
+ * standard input taken from memory: a copy of a replicated stage given its
+ * share of a mapped file (see input_map.h). It is read as if it came through
+ * a pipe.
+ * argv: NULL-terminated argument vector of the command
+ * data: The input, which must stay mapped until this returns
+ * len: Length of the input
+ * Returns as for filter_run()
+ */
+int filter_run_range(char **argv, const char *data, size_t len);
+
+#endif // FILTERS_H
@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input_map.h"
+
+int input_map_open(input_map_t *map, int fd) {
+    map->data = NULL;
+    map->len = 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0 || (uint64_t) st.st_size > SIZE_MAX) {
+        return -1;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);  // aggressive readahead, and pages behind the reader go first
+    map->data = data;
+    map->len = st.st_size;
+    return 0;
+}
+
+void input_map_prefetch(const char *data, size_t len) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) data & ~(page - 1);  // madvise() wants a page-aligned start
+    if (len > 0) {
+        madvise((void *) start, (uintptr_t) data + len - start, MADV_WILLNEED);
+    }
+}
+
+void input_map_split(const char *data, size_t len, unsigned n, size_t *bounds) {
+    bounds[0] = 0;
+    for (unsigned i = 1; i < n; i++) {
+        size_t target = (size_t) ((unsigned __int128) len * i / n);
+        if (target < bounds[i - 1]) {
+            target = bounds[i - 1];  // the previous range ran past this one's share
+        }
+        if (target == 0) {
+            bounds[i] = 0;
+            continue;
+        }
+        // end the range after the newline that ends the line 'target' falls in, or at 'target' on a line start
+        const char *nl = memchr(data + target - 1, '\n', len - target + 1);
+        bounds[i] = (nl != NULL) ? (size_t) (nl + 1 - data) : len;
+    }
+    bounds[n] = len;
+}
+
+void input_map_close(input_map_t *map) {
+    if (map->data != NULL) {
+        munmap((void *) map->data, map->len);
+    }
+    map->data = NULL;
+    map->len = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef INPUT_MAP_H
+#define INPUT_MAP_H
+
+#include <stddef.h>
+
+/*
+ * Regular files read through a memory mapping instead of read(). The
+ * builtin filters read their input files this way, and a replicated stage
+ * of builtin filters fed straight from a file gets the file mapped once by
+ * the shell and carved into line-aligned ranges, one per copy, so the copies
+ * read their shares of it in parallel with no pipe in between.
+ */
+
+typedef struct {
+    const char *data;  // the whole file, read-only; NULL if nothing is mapped
+    size_t len;
+} input_map_t;
+
+/*
+ * Map a file for reading from start to end, advising the kernel that it will
+ * be read sequentially
+ * map: Where to store the mapping
+ * fd: Descriptor of the file; it may be closed once mapped
+ * Returns 0 on success or -1 if the file isn't a non-empty regular file or
+ * can't be mapped (nothing is reported, the caller should read() it instead)
+ */
+int input_map_open(input_map_t *map, int fd);
+
+/*
+ * Have the kernel start reading part of a mapping in, without waiting for it
+ * data: Start of the range (anywhere within a mapping)
+ * len: Length of the range
+ */
+void input_map_prefetch(const char *data, size_t len);
+
+/*
+ * Divide data into ranges of about the same size, each ending just after a
+ * newline (except the last, and a range that a line longer than its share
+ * takes up entirely, which leaves the ranges after it empty)
+ * data: The data to divide
+ * len: Its length
+ * n: Number of ranges
+ * bounds: Array of n + 1 offsets to fill in; range i is from bounds[i] to
+ *         bounds[i + 1], bounds[0] is 0 and bounds[n] is 'len'
+ */
+void input_map_split(const char *data, size_t len, unsigned n, size_t *bounds);
+
+/*
+ * Unmap a file mapped by input_map_open()
+ * map: The mapping, which is left empty
+ */
+void input_map_close(input_map_t *map);
+
+#endif // INPUT_MAP_H
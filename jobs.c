@@ -0,0 +1,252 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "jobs.h"
+#include "swish_funcs.h"
+
+typedef struct {
+    int id;         // job number shown by 'jobs' and taken by 'wait'
+    pid_t pid;      // the forked shell running the pipeline
+    int done;       // nonzero once the job has been reaped
+    int status;     // wait status, once done
+    char *command;  // the pipeline's tokens joined by spaces
+} job_t;
+
+// jobs in the order they were started
+static job_t *jobs = NULL;
+static int num_jobs = 0;
+static int capacity = 0;
+static int num_running = 0;
+static int limit = 0;  // most jobs running at once, 0 for one per online CPU
+
+int jobs_set_limit(const char *spec) {
+    char *end;
+    errno = 0;
+    long n = strtol(spec, &end, 10);
+    if (errno != 0 || end == spec || *end != '\0' || n < 1 || n > INT_MAX) {
+        fprintf(stderr, "Error: Invalid job limit '%s'\n", spec);
+        return -1;
+    }
+    limit = n;
+    return 0;
+}
+
+static int job_limit(void) {
+    if (limit == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        limit = (cpus > 0) ? cpus : 1;
+    }
+    return limit;
+}
+
+static job_t *find_job(int id) {
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].id == id) {
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+// mark the job run by 'pid' as finished
+static void job_exited(pid_t pid, int status) {
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].pid == pid && !jobs[i].done) {
+            jobs[i].done = 1;
+            jobs[i].status = status;
+            num_running--;
+            return;
+        }
+    }
+}
+
+// reap one job; blocks until it exits unless 'flags' has WNOHANG
+// Returns 1 if the job was reaped, 0 if it is still running, or -1 on error
+static int reap_job(job_t *job, int flags) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(job->pid, &status, flags)) == -1 && errno == EINTR) {
+    }
+    if (pid == -1) {
+        perror("waitpid");
+        if (errno == ECHILD) {  // somehow reaped already, don't wait for it forever
+            job_exited(job->pid, 0);
+        }
+        return -1;
+    }
+    if (pid == 0) {
+        return 0;
+    }
+    job_exited(pid, status);
+    return 1;
+}
+
+// reap every job that has already finished, without waiting for the rest
+static void reap_finished(void) {
+    for (int i = 0; i < num_jobs && num_running > 0; i++) {
+        if (!jobs[i].done) {
+            reap_job(&jobs[i], WNOHANG);
+        }
+    }
+}
+
+// block until some job finishes; the shell has no other children between command lines
+static int wait_any(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, 0)) == -1 && errno == EINTR) {
+    }
+    if (pid == -1) {
+        perror("waitpid");
+        return -1;
+    }
+    job_exited(pid, status);
+    return 0;
+}
+
+// drop finished jobs from the table, keeping the rest in order
+static void forget_finished(void) {
+    int n = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].done) {
+            free(jobs[i].command);
+        } else {
+            jobs[n++] = jobs[i];
+        }
+    }
+    num_jobs = n;
+    if (num_jobs == 0) {
+        free(jobs);
+        jobs = NULL;
+        capacity = 0;
+    }
+}
+
+static char *join_tokens(const strvec_t *tokens) {
+    size_t len = 1;
+    for (unsigned i = 0; i < tokens->length; i++) {
+        len += strlen(strvec_get(tokens, i)) + 1;
+    }
+    char *s = malloc(len);
+    if (s == NULL) {
+        return NULL;
+    }
+    char *w = s;
+    for (unsigned i = 0; i < tokens->length; i++) {
+        if (i > 0) {
+            *w++ = ' ';
+        }
+        const char *tok = strvec_get(tokens, i);
+        size_t tok_len = strlen(tok);
+        memcpy(w, tok, tok_len);
+        w += tok_len;
+    }
+    *w = '\0';
+    return s;
+}
+
+int jobs_start(strvec_t *tokens) {
+    reap_finished();
+    while (num_running >= job_limit()) {
+        if (wait_any() == -1) {
+            return -1;
+        }
+    }
+    if (num_jobs == capacity) {
+        int new_capacity = (capacity == 0) ? 8 : 2 * capacity;
+        job_t *new_jobs = realloc(jobs, new_capacity * sizeof(job_t));
+        if (new_jobs == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            return -1;
+        }
+        jobs = new_jobs;
+        capacity = new_capacity;
+    }
+    char *command = join_tokens(tokens);
+    if (command == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+
+    fflush(stdout);  // don't let the job inherit (and later re-flush) buffered output
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        free(command);
+        return -1;
+    } else if (pid == 0) {
+        // the shell's own input is left to the shell
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+        int ret = run_pipelined_commands(tokens);
+        fflush(stdout);
+        _exit(ret == 0 ? 0 : 1);  // not exit(), which could rewind the shell's buffered input
+    }
+
+    int id = 1;  // one more than the highest number in use, as sh does
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].id >= id) {
+            id = jobs[i].id + 1;
+        }
+    }
+    job_t *job = &jobs[num_jobs++];
+    job->id = id;
+    job->pid = pid;
+    job->done = 0;
+    job->status = 0;
+    job->command = command;
+    num_running++;
+    return id;
+}
+
+void jobs_print(FILE *out) {
+    reap_finished();
+    for (int i = 0; i < num_jobs; i++) {
+        const job_t *job = &jobs[i];
+        char state[32];
+        if (!job->done) {
+            strcpy(state, "Running");
+        } else if (WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0) {
+            strcpy(state, "Done");
+        } else if (WIFEXITED(job->status)) {
+            snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(job->status));
+        } else {
+            snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(job->status)));
+        }
+        fprintf(out, "[%d]  %-12s %s &\n", job->id, state, job->command);
+    }
+    forget_finished();
+}
+
+int jobs_wait(int id) {
+    if (id == 0) {
+        for (int i = 0; i < num_jobs; i++) {
+            if (!jobs[i].done) {
+                reap_job(&jobs[i], 0);
+            }
+        }
+        forget_finished();
+        return 0;
+    }
+    job_t *job = find_job(id);
+    if (job == NULL) {
+        return -1;
+    }
+    if (!job->done) {
+        reap_job(job, 0);
+    }
+    // only this job is forgotten, other finished jobs are still to be listed by 'jobs'
+    free(job->command);
+    memmove(job, job + 1, (&jobs[num_jobs] - (job + 1)) * sizeof(job_t));
+    num_jobs--;
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdio.h>
+
+#include "string_vector.h"
+
+/*
+ * Background jobs: pipelines started with a trailing '&'. Each job runs in a
+ * forked copy of the shell, reading from /dev/null, so the shell goes on to
+ * the next line at once. At most a set number of jobs run at the same time;
+ * starting one more first waits for a running job to finish.
+ */
+
+/*
+ * Set how many background jobs may run at once
+ * spec: A positive number, as given to -j
+ * Returns 0 on success or -1 if the number is invalid
+ */
+int jobs_set_limit(const char *spec);
+
+/*
+ * Start a pipeline as a background job, waiting for a free slot if the limit
+ * is reached
+ * tokens: Tokens of the pipeline, without the trailing '&'
+ * Returns the new job's number or -1 on error
+ */
+int jobs_start(strvec_t *tokens);
+
+/*
+ * The 'jobs' builtin: list every job with its state, like sh does. Jobs that
+ * have finished are listed one last time and then forgotten.
+ * out: Stream to print to
+ */
+void jobs_print(FILE *out);
+
+/*
+ * Wait for a background job to finish and forget it
+ * id: Number of the job to wait for, or 0 to wait for every job
+ * Returns 0 on success or -1 if there is no such job
+ */
+int jobs_wait(int id);
+
+#endif // JOBS_H
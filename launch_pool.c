@@ -0,0 +1,362 @@
+#define _GNU_SOURCE  // close_range(), CLONE_PARENT
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "launch_pool.h"
+
+#define MAX_LAUNCHERS 8
+#define MAX_OUTSTANDING 32       // requests sent to one launcher before waiting for its replies
+#define MAX_REQUEST (64 * 1024)  // larger stages are forked by the shell
+
+// which optional strings follow the working directory in a request
+enum {
+    REQ_PATH = 1,
+    REQ_IN_FILE = 2,
+    REQ_OUT_FILE = 4,
+    REQ_APPEND = 8,
+};
+
+// a request is this header and then NUL-terminated strings: the working
+// directory, the optional path, in_file and out_file, and the argv entries
+typedef struct {
+    uint32_t argc;
+    uint32_t flags;
+} request_t;
+
+typedef struct {
+    int sock;        // the shell's end of the launcher's socket, -1 once it is gone
+    pid_t pid;
+    stage_t *pending[MAX_OUTSTANDING];  // stages sent and not yet replied to, oldest first
+    int first;
+    int num_pending;
+} helper_t;
+
+static helper_t helpers[MAX_LAUNCHERS];
+static int num_helpers = 0;
+static int next_helper = 0;  // launcher to send the next request to
+static pid_t owner = 0;      // the process the pool belongs to; forked background jobs don't use it
+static int failed = 0;       // nonzero once a stage failed to start since the last launch_pool_finish()
+static char request[MAX_REQUEST];
+
+// a fork-like clone whose child belongs to our parent, the shell
+static pid_t clone_for_parent(void) {
+    return syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, 0);
+}
+
+// take the next string of a request, which is known to end in a NUL
+static const char *next_string(char **p, const char *end) {
+    if (*p >= end) {
+        return NULL;
+    }
+    const char *s = *p;
+    *p += strlen(s) + 1;
+    return s;
+}
+
+/*
+ * Start the stage described by a request, in a clone that is a child of the shell
+ * fds: The descriptors for its stdin, stdout and stderr
+ * Returns the new process's id, or a negated errno value on error
+ */
+static int32_t start_stage(char *req, size_t len, const int *fds) {
+    request_t header;
+    if (len <= sizeof(header) || req[len - 1] != '\0') {
+        return -EINVAL;
+    }
+    memcpy(&header, req, sizeof(header));
+    char *p = req + sizeof(header);
+    const char *end = req + len;
+    stage_t stage;
+    memset(&stage, 0, sizeof(stage));
+    stage.argv = malloc((header.argc + 1) * sizeof(char *));
+    if (stage.argv == NULL) {
+        return -ENOMEM;
+    }
+    const char *cwd = next_string(&p, end);
+    stage.path = (header.flags & REQ_PATH) ? next_string(&p, end) : NULL;
+    stage.in_file = (header.flags & REQ_IN_FILE) ? next_string(&p, end) : NULL;
+    stage.out_file = (header.flags & REQ_OUT_FILE) ? next_string(&p, end) : NULL;
+    stage.append = (header.flags & REQ_APPEND) != 0;
+    stage.argc = header.argc;
+    int valid = (cwd != NULL && header.argc > 0);
+    for (unsigned i = 0; i < header.argc && valid; i++) {
+        stage.argv[i] = (char *) next_string(&p, end);
+        valid = (stage.argv[i] != NULL);
+    }
+    if (!valid) {
+        free(stage.argv);
+        return -EINVAL;
+    }
+    stage.argv[header.argc] = NULL;
+
+    pid_t pid = clone_for_parent();
+    if (pid == 0) {
+        // the descriptors came in close-on-exec; the copies made here are not
+        if (dup2(fds[0], STDIN_FILENO) == -1 || dup2(fds[1], STDOUT_FILENO) == -1
+            || dup2(fds[2], STDERR_FILENO) == -1) {
+            _exit(1);
+        }
+        if (chdir(cwd) == -1) {
+            perror(cwd);
+            _exit(1);
+        }
+        run_piped_command(&stage, -1, -1);  // redirects and execs, only returns on error
+        _exit(1);
+    }
+    int err = errno;
+    free(stage.argv);
+    return (pid == -1) ? -err : pid;
+}
+
+/*
+ * Main loop of a launcher: start a stage for each request until the shell
+ * closes its end of the socket
+ */
+static void serve(int sock) {
+    for (;;) {
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct iovec iov = {request, sizeof(request)};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+        ssize_t len;
+        while ((len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+        }
+        if (len <= 0) {
+            _exit(0);  // the shell is gone
+        }
+        int fds[3] = {-1, -1, -1};
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+            && cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+        int32_t reply = (fds[2] != -1 && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+                            ? start_stage(request, len, fds) : -EINVAL;
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+            }
+        }
+        if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) == -1) {
+            _exit(0);
+        }
+    }
+}
+
+/*
+ * Set up a freshly forked launcher and run it: keep nothing of the shell's
+ * but the socket, check that it can clone children for the shell, and say so
+ */
+static void run_launcher(int sock) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);  // don't outlive the shell even if it can't close the socket
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+    }
+    close_range(STDERR_FILENO + 1, sock - 1, 0);
+    close_range(sock + 1, ~0U, 0);
+
+    // the shell reaps this test clone, or drops the launcher if cloning isn't allowed
+    pid_t pid = clone_for_parent();
+    if (pid == 0) {
+        _exit(0);
+    }
+    int32_t hello = (pid == -1) ? -errno : pid;
+    if (send(sock, &hello, sizeof(hello), MSG_NOSIGNAL) == -1 || pid == -1) {
+        _exit(0);
+    }
+    serve(sock);
+}
+
+// stop using a launcher that has failed; it exits once its socket is closed
+static void drop_helper(helper_t *h) {
+    if (h->sock != -1) {
+        close(h->sock);
+        h->sock = -1;
+    }
+}
+
+int launch_pool_start(int num_launchers) {
+    if (num_launchers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_launchers = (cpus > 0) ? cpus : 1;
+    }
+    if (num_launchers > MAX_LAUNCHERS) {
+        num_launchers = MAX_LAUNCHERS;
+    }
+    owner = getpid();
+    fflush(stdout);  // nothing buffered should be inherited
+    for (int i = 0; i < num_launchers; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+            perror("socketpair");
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            close(sv[0]);
+            close(sv[1]);
+            break;
+        } else if (pid == 0) {
+            run_launcher(sv[1]);
+            _exit(0);
+        }
+        close(sv[1]);
+
+        int32_t hello;
+        ssize_t n;
+        while ((n = recv(sv[0], &hello, sizeof(hello), 0)) == -1 && errno == EINTR) {
+        }
+        if (n == sizeof(hello) && hello > 0) {
+            waitpid(hello, NULL, 0);
+        }
+        if (n != sizeof(hello) || hello <= 0) {  // no cloning here (e.g. a sandbox), stages get forked
+            close(sv[0]);
+            waitpid(pid, NULL, 0);
+            break;
+        }
+        helper_t *h = &helpers[num_helpers++];
+        h->sock = sv[0];
+        h->pid = pid;
+        h->first = 0;
+        h->num_pending = 0;
+    }
+    return (num_helpers > 0) ? 0 : -1;
+}
+
+// wait for a launcher's reply about its oldest pending stage
+static void collect_reply(helper_t *h, reaper_t *reaper) {
+    stage_t *stage = h->pending[h->first];
+    h->first = (h->first + 1) % MAX_OUTSTANDING;
+    h->num_pending--;
+    int32_t reply = -EPIPE;
+    ssize_t n = -1;
+    while (h->sock != -1 && (n = recv(h->sock, &reply, sizeof(reply), 0)) == -1 && errno == EINTR) {
+    }
+    if (n != sizeof(reply)) {
+        drop_helper(h);
+        reply = -EPIPE;
+    }
+    if (reply < 0) {
+        fprintf(stderr, "fork: %s\n", strerror(-reply));
+        failed = 1;
+        return;
+    }
+    stage->pid = reply;
+    reaper_add(reaper, reply);
+}
+
+// append a NUL-terminated string to the request being built
+static int add_string(size_t *len, const char *s) {
+    size_t n = strlen(s) + 1;
+    if (*len + n > sizeof(request)) {
+        return -1;
+    }
+    memcpy(request + *len, s, n);
+    *len += n;
+    return 0;
+}
+
+// lay a stage out in 'request', returning its length or 0 if it doesn't fit
+static size_t build_request(const stage_t *stage) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return 0;
+    }
+    request_t header = {.argc = stage->argc, .flags = 0};
+    header.flags |= (stage->path != NULL) ? REQ_PATH : 0;
+    header.flags |= (stage->in_file != NULL) ? REQ_IN_FILE : 0;
+    header.flags |= (stage->out_file != NULL) ? REQ_OUT_FILE : 0;
+    header.flags |= stage->append ? REQ_APPEND : 0;
+    memcpy(request, &header, sizeof(header));
+    size_t len = sizeof(header);
+    if (add_string(&len, cwd) == -1 || (stage->path != NULL && add_string(&len, stage->path) == -1)
+        || (stage->in_file != NULL && add_string(&len, stage->in_file) == -1)
+        || (stage->out_file != NULL && add_string(&len, stage->out_file) == -1)) {
+        return 0;
+    }
+    for (unsigned i = 0; i < stage->argc; i++) {
+        if (add_string(&len, stage->argv[i]) == -1) {
+            return 0;
+        }
+    }
+    return len;
+}
+
+int launch_pool_submit(stage_t *stage, int in_fd, int out_fd, reaper_t *reaper) {
+    if (num_helpers == 0 || owner != getpid()) {
+        return 1;
+    }
+    helper_t *h = NULL;
+    for (int k = 0; k < num_helpers && h == NULL; k++) {
+        helper_t *candidate = &helpers[(next_helper + k) % num_helpers];
+        if (candidate->sock != -1) {
+            h = candidate;
+        }
+    }
+    next_helper = (next_helper + 1) % num_helpers;
+    if (h == NULL) {
+        return 1;
+    }
+    size_t len = build_request(stage);
+    if (len == 0) {
+        return 1;
+    }
+    if (h->num_pending == MAX_OUTSTANDING) {
+        collect_reply(h, reaper);  // make sure it isn't stuck writing replies nobody reads
+        if (h->sock == -1) {
+            return 1;
+        }
+    }
+
+    int fds[3] = {(in_fd != -1) ? in_fd : STDIN_FILENO, (out_fd != -1) ? out_fd : STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {request, len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t n;
+    while ((n = sendmsg(h->sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    if (n == -1) {
+        if (errno == EPIPE || errno == ECONNRESET) {  // the launcher died, its pending stages fail
+            drop_helper(h);
+        }
+        return 1;  // e.g. EMSGSIZE, nothing was sent
+    }
+    h->pending[(h->first + h->num_pending) % MAX_OUTSTANDING] = stage;
+    h->num_pending++;
+    return 0;
+}
+
+int launch_pool_finish(reaper_t *reaper) {
+    for (int i = 0; i < num_helpers; i++) {
+        while (helpers[i].num_pending > 0) {
+            collect_reply(&helpers[i], reaper);
+        }
+    }
+    int ret_val = failed ? -1 : 0;
+    failed = 0;
+    return ret_val;
+}
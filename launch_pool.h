@@ -0,0 +1,48 @@
+#ifndef LAUNCH_POOL_H
+#define LAUNCH_POOL_H
+
+#include "reaper.h"
+#include "swish_funcs.h"
+
+/*
+ * Pool of small launcher processes, forked off the shell when it starts and
+ * so still tiny, that start pipeline stages on the shell's behalf. The shell
+ * sends each one a description of a stage along with the descriptors for its
+ * stdin, stdout and stderr (as SCM_RIGHTS over a UNIX socket); the launcher
+ * clones itself with CLONE_PARENT, so the new process is a child of the
+ * shell and is reaped like any other, and the clone redirects and execs.
+ * Stages are handed to the launchers in turn without waiting for each to
+ * start, so several are started at once. Forking a large shell for every
+ * stage is avoided altogether.
+ */
+
+/*
+ * Start the launcher processes
+ * num_launchers: How many to start, or 0 for one per online CPU (at most 8)
+ * Returns 0 on success or -1 on error (stages are then forked as usual)
+ */
+int launch_pool_start(int num_launchers);
+
+/*
+ * Have a launcher start a stage. The descriptors can be closed as soon as
+ * this returns; the stage's pid is only known after launch_pool_finish().
+ * stage: Stage to start, with the hashed path of its program if any
+ * in_fd: Descriptor for the stage's stdin, or -1 for the shell's own
+ * out_fd: Descriptor for the stage's stdout, or -1 for the shell's own
+ * reaper: Reaper that is given the stage if waiting for a reply is needed
+ *         to make room for this request
+ * Returns 0 if the stage was handed over, 1 if the pool can't take it (there
+ * is none in this process, or the stage is too large to send) and the caller
+ * should fork it instead, or -1 on error (already reported)
+ */
+int launch_pool_submit(stage_t *stage, int in_fd, int out_fd, reaper_t *reaper);
+
+/*
+ * Wait until every stage handed to the pool has started, setting each one's
+ * pid and adding it to the reaper
+ * reaper: Reaper to add the stages to
+ * Returns 0 on success or -1 if some stage could not be started (already reported)
+ */
+int launch_pool_finish(reaper_t *reaper);
+
+#endif // LAUNCH_POOL_H
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "line_reader.h"
+
+int line_reader_open_file(line_reader_t *lr, const char *path) {
+    memset(lr, 0, sizeof(line_reader_t));
+    lr->fd = -1;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        // private and writable, so lines can be tokenized in place; only touched pages get copied
+        lr->data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (lr->data == MAP_FAILED) {
+            perror("mmap");
+            lr->data = NULL;
+            close(fd);
+            return -1;
+        }
+        madvise(lr->data, st.st_size, MADV_SEQUENTIAL);
+        lr->end = lr->map_len = st.st_size;
+    }
+    close(fd);  // the mapping stays valid
+    return 0;
+}
+
+int line_reader_open_fd(line_reader_t *lr, int fd, size_t buf_size) {
+    memset(lr, 0, sizeof(line_reader_t));
+    lr->fd = fd;
+    lr->cap = (buf_size > 0) ? buf_size : 4096;
+    lr->data = malloc(lr->cap);
+    if (lr->data == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// nonzero if data[from, to) ends in an odd run of backslashes, so the newline after it is escaped
+static int is_continued(const char *data, size_t from, size_t to) {
+    size_t n = 0;
+    while (to > from && data[to - 1] == '\\') {
+        n++;
+        to--;
+    }
+    return n % 2;
+}
+
+// double the read buffer
+static int grow(line_reader_t *lr) {
+    char *new_data = realloc(lr->data, 2 * lr->cap);
+    if (new_data == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    lr->data = new_data;
+    lr->cap *= 2;
+    return 0;
+}
+
+/*
+ * Read more input after the line being put together (which ends at 'end'),
+ * first moving it to the front of the buffer, or growing the buffer if the
+ * line already fills it
+ * lr: A reader with a descriptor
+ * Returns the number of bytes read, 0 at end of input or -1 on error
+ */
+static ssize_t refill(line_reader_t *lr) {
+    if (lr->start > 0) {
+        memmove(lr->data, lr->data + lr->start, lr->end - lr->start);
+        lr->end -= lr->start;
+        lr->scan -= lr->start;
+        lr->start = 0;
+    }
+    if (lr->end == lr->cap && grow(lr) == -1) {
+        return -1;
+    }
+    ssize_t n;
+    while ((n = read(lr->fd, lr->data + lr->end, lr->cap - lr->end)) == -1 && errno == EINTR) {
+    }
+    if (n == -1) {
+        perror("read");
+    } else {
+        lr->end += n;
+    }
+    return n;
+}
+
+// the last line, which has no newline, terminated where there is room for the NUL
+static char *last_line(line_reader_t *lr) {
+    size_t len = lr->end - lr->start;
+    char *line;
+    if (lr->fd == -1) {  // there may be no room after it in the mapping, so copy it
+        free(lr->tail);
+        line = lr->tail = malloc(len + 1);
+        if (line == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            return NULL;
+        }
+        memcpy(line, lr->data + lr->start, len);
+    } else {
+        if (lr->end == lr->cap && grow(lr) == -1) {
+            return NULL;
+        }
+        line = lr->data + lr->start;
+    }
+    line[len] = '\0';
+    lr->start = lr->scan = lr->end;
+    return line;
+}
+
+char *line_reader_next(line_reader_t *lr) {
+    if (lr->data == NULL) {  // an empty script
+        return NULL;
+    }
+    // the line is put together at data[start, w): w falls behind scan by two bytes per continuation
+    size_t w = lr->start;
+    while (1) {
+        char *nl = memchr(lr->data + lr->scan, '\n', lr->end - lr->scan);  // each byte is searched once
+        size_t seg_end = (nl != NULL) ? (size_t) (nl - lr->data) : lr->end;
+        if (w != lr->scan) {  // close the gap left by a continuation
+            memmove(lr->data + w, lr->data + lr->scan, seg_end - lr->scan);
+        }
+        w += seg_end - lr->scan;
+        lr->scan = seg_end;
+        if (nl != NULL) {
+            lr->scan++;  // past the newline
+            if (is_continued(lr->data, lr->start, w)) {
+                w--;  // drop the backslash along with the newline
+                continue;
+            }
+            lr->data[w] = '\0';  // terminate in place
+            char *line = lr->data + lr->start;
+            lr->start = lr->scan;
+            return line;
+        }
+        lr->end = lr->scan = w;  // no newline yet, anything past w was moved down
+        if (lr->fd == -1) {
+            break;
+        }
+        size_t len = w - lr->start;
+        ssize_t n = refill(lr);  // may move the line to the front of the buffer
+        w = lr->start + len;
+        if (n == -1) {
+            return NULL;
+        } else if (n == 0) {
+            break;
+        }
+    }
+    if (lr->start == lr->end) {  // end of input
+        return NULL;
+    }
+    return last_line(lr);
+}
+
+void line_reader_close(line_reader_t *lr) {
+    if (lr->fd == -1 && lr->data != NULL) {
+        munmap(lr->data, lr->map_len);
+    } else {
+        free(lr->data);
+    }
+    lr->data = NULL;
+    free(lr->tail);
+    lr->tail = NULL;
+}
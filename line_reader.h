@@ -0,0 +1,58 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <stddef.h>
+
+/*
+ * Source of command lines for the shell, with no limit on line length
+ * Scripts given by path are memory-mapped; anything else is read from a file
+ * descriptor with large read() calls into a buffer that grows to fit the
+ * longest line. A line ending in an unquoted backslash continues on the next
+ * one, with the backslash and newline removed, as in sh (except that a
+ * backslash is taken as a continuation even inside single quotes).
+ */
+typedef struct {
+    int fd;           // descriptor to read from, or -1 for a mapped script
+    char *data;       // the mapping or the read buffer; lines are terminated in place
+    size_t cap;       // size of the read buffer
+    size_t map_len;   // length of the mapping
+    size_t start;     // offset of the next line within data
+    size_t scan;      // everything from start up to here has been searched for a newline
+    size_t end;       // offset just past the data read so far (the mapping's length)
+    char *tail;       // copy of a mapped script's last line when it has no newline
+} line_reader_t;
+
+/*
+ * Open a script file for reading
+ * lr: Pointer to the reader to initialize
+ * path: Path of the script to read
+ * Returns 0 on success or -1 on error
+ */
+int line_reader_open_file(line_reader_t *lr, const char *path);
+
+/*
+ * Prepare to read lines from an already open file descriptor
+ * lr: Pointer to the reader to initialize
+ * fd: Descriptor to read from (not closed by line_reader_close())
+ * buf_size: Initial size of the read buffer, and so the most read at once
+ * Returns 0 on success or -1 on error
+ */
+int line_reader_open_fd(line_reader_t *lr, int fd, size_t buf_size);
+
+/*
+ * Retrieve the next line, without its trailing newline and with any
+ * continuations joined
+ * lr: Pointer to the reader to read from
+ * Returns the line, which the caller may modify in place (e.g. with
+ * tokenize_inplace()) and which stays valid until the next call, or NULL at
+ * end of input or on error
+ */
+char *line_reader_next(line_reader_t *lr);
+
+/*
+ * Release the resources held by a reader
+ * lr: Pointer to the reader to close
+ */
+void line_reader_close(line_reader_t *lr);
+
+#endif // LINE_READER_H
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE  // sched_setaffinity(), CPU_SET()
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "placement.h"
+
+#define MAX_NODES 64
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+typedef struct {
+    int cpu;
+    int node;     // -1 where there are no NUMA nodes in sysfs
+    int package;  // -1 for anything sysfs doesn't say
+    int l3;
+    int core;
+    int rank;     // 0 for the first SMT sibling of a core, 1 for the next...
+    int spread;   // position among the CPUs of its node with the same rank, in compact order
+} cpu_info_t;
+
+static int loaded = 0;
+static int num_cpus = 0;                 // CPUs the shell may run on
+static int compact_order[CPU_SETSIZE];
+static int spread_order[CPU_SETSIZE];
+static int cpu_node[CPU_SETSIZE];
+static int num_nodes = 0;                // nodes present, only 2 or more make a difference
+static cpu_set_t node_cpus[MAX_NODES];
+
+// read a single integer from a sysfs file about a CPU, or -1 if there is none
+static int read_id(const char *fmt, int cpu) {
+    char path[128];
+    snprintf(path, sizeof(path), fmt, cpu);
+    FILE *f = fopen(path, "re");
+    int id = -1;
+    if (f != NULL) {
+        if (fscanf(f, "%d", &id) != 1) {
+            id = -1;
+        }
+        fclose(f);
+    }
+    return id;
+}
+
+// read a CPU list such as "0-3,8-11" from sysfs into a set; returns 0 on success or -1 if there is none
+static int read_cpulist(const char *path, cpu_set_t *set) {
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        return -1;
+    }
+    CPU_ZERO(set);
+    int lo, hi;
+    while (fscanf(f, "%d", &lo) == 1) {
+        hi = lo;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &hi) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int compare_compact(const void *a, const void *b) {
+    const cpu_info_t *x = a;
+    const cpu_info_t *y = b;
+    int kx[] = {x->node, x->package, x->l3, x->core, x->cpu};
+    int ky[] = {y->node, y->package, y->l3, y->core, y->cpu};
+    for (int i = 0; i < 5; i++) {
+        if (kx[i] != ky[i]) {
+            return (kx[i] < ky[i]) ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static int compare_spread(const void *a, const void *b) {
+    const cpu_info_t *x = a;
+    const cpu_info_t *y = b;
+    int kx[] = {x->rank, x->spread, x->node, x->cpu};
+    int ky[] = {y->rank, y->spread, y->node, y->cpu};
+    for (int i = 0; i < 4; i++) {
+        if (kx[i] != ky[i]) {
+            return (kx[i] < ky[i]) ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// read the topology of the CPUs the shell may use and work out both orders
+static void load_topology(void) {
+    static cpu_info_t info[CPU_SETSIZE];
+    loaded = 1;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return;
+    }
+    for (int n = 0; n < MAX_NODES; n++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        if (read_cpulist(path, &node_cpus[n]) == 0) {
+            num_nodes++;
+        } else {
+            CPU_ZERO(&node_cpus[n]);
+        }
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        cpu_info_t *ci = &info[num_cpus++];
+        ci->cpu = cpu;
+        ci->node = -1;
+        for (int n = 0; n < MAX_NODES && ci->node == -1; n++) {
+            if (CPU_ISSET(cpu, &node_cpus[n])) {
+                ci->node = n;
+            }
+        }
+        cpu_node[cpu] = ci->node;
+        ci->package = read_id("/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        ci->l3 = read_id("/sys/devices/system/cpu/cpu%d/cache/index3/id", cpu);
+        ci->core = read_id("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        ci->rank = 0;
+        for (int i = 0; i < num_cpus - 1; i++) {  // earlier siblings on the same core
+            if (ci->core != -1 && info[i].core == ci->core && info[i].package == ci->package) {
+                ci->rank++;
+            }
+        }
+    }
+
+    qsort(info, num_cpus, sizeof(cpu_info_t), compare_compact);
+    for (int i = 0; i < num_cpus; i++) {
+        compact_order[i] = info[i].cpu;
+        info[i].spread = 0;
+        for (int j = 0; j < i; j++) {
+            if (info[j].node == info[i].node && info[j].rank == info[i].rank) {
+                info[i].spread++;
+            }
+        }
+    }
+    qsort(info, num_cpus, sizeof(cpu_info_t), compare_spread);
+    for (int i = 0; i < num_cpus; i++) {
+        spread_order[i] = info[i].cpu;
+    }
+}
+
+int placement_cpu(place_policy_t policy, unsigned slot) {
+    if (!loaded) {
+        load_topology();
+    }
+    if (policy == PLACE_NONE || num_cpus == 0) {
+        return -1;
+    }
+    return (policy == PLACE_COMPACT) ? compact_order[slot % num_cpus] : spread_order[slot % num_cpus];
+}
+
+int placement_node(int cpu) {
+    if (!loaded) {
+        load_topology();
+    }
+    if (cpu < 0 || cpu >= CPU_SETSIZE || num_nodes < 2) {
+        return -1;
+    }
+    return cpu_node[cpu];
+}
+
+int placement_apply(int cpu, int node, int nice_incr) {
+    int ret_val = 0;
+    cpu_set_t set;
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+            ret_val = -1;
+        }
+    } else if (cpu != -1) {
+        errno = EINVAL;
+        ret_val = -1;
+    } else if (node >= 0 && node < MAX_NODES && CPU_COUNT(&node_cpus[node]) > 0) {
+        if (sched_setaffinity(0, sizeof(node_cpus[node]), &node_cpus[node]) == -1) {
+            ret_val = -1;
+        }
+    }
+    if (node >= MAX_NODES) {
+        errno = EINVAL;
+        ret_val = -1;
+    } else if (node >= 0) {
+        unsigned long mask[MAX_NODES / LONG_BITS + 1] = {0};  // one spare word, see maxnode below
+        mask[node / LONG_BITS] |= 1UL << (node % LONG_BITS);
+        // the kernel counts one bit fewer than maxnode, so pass one more than the bits meant
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, MAX_NODES + 1) == -1) {
+            ret_val = -1;
+        }
+    }
+    if (nice_incr != 0) {
+        errno = 0;
+        if (nice(nice_incr) == -1 && errno != 0) {  // -1 is also a valid niceness
+            ret_val = -1;
+        }
+    }
+    return ret_val;
+}
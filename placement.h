@@ -0,0 +1,52 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+/*
+ * Placement of pipeline stages on CPUs and NUMA nodes. The machine's
+ * topology is read from sysfs the first time it is needed, limited to the
+ * CPUs the shell itself may run on, and put in an order for each policy:
+ * compact order walks SMT siblings, then cores sharing an L3 cache, then
+ * packages and nodes, so consecutive stages (which talk through a pipe)
+ * land as close together as possible; spread order gives each stage a core
+ * of its own, alternating between NUMA nodes. Without sysfs, CPUs are taken
+ * in numeric order.
+ */
+
+typedef enum {
+    PLACE_NONE = 0,  // leave it to the scheduler
+    PLACE_COMPACT,   // neighbouring stages share caches
+    PLACE_SPREAD,    // stages spread over cores and nodes
+} place_policy_t;
+
+/*
+ * The CPU for the stage started 'slot'-th in a pipeline under a policy
+ * policy: PLACE_COMPACT or PLACE_SPREAD
+ * slot: Position of the stage in launch order; slots beyond the number of
+ *       CPUs wrap around
+ * Returns the CPU number, or -1 if the policy is PLACE_NONE or the CPUs
+ * can't be determined
+ */
+int placement_cpu(place_policy_t policy, unsigned slot);
+
+/*
+ * Find the NUMA node a CPU belongs to
+ * cpu: CPU number, or -1 just to have the topology read
+ * Returns the node, or -1 on a machine with a single node (where memory
+ * policy makes no difference) or if it isn't known
+ */
+int placement_node(int cpu);
+
+/*
+ * Apply a placement to the calling process, which keeps it across exec.
+ * This should be called within a CHILD process of the shell, and only
+ * makes system calls, so it is safe after vfork(). The topology must have
+ * been read before the fork, by placement_cpu() or placement_node().
+ * cpu: CPU to pin the process to, or -1
+ * node: NUMA node to prefer for memory, and to run on if 'cpu' is -1; or -1
+ * nice_incr: Increment to the process's niceness, as for nice(1), or 0
+ * Returns 0 on success or -1 with errno set if some part couldn't be
+ * applied (the rest still is)
+ */
+int placement_apply(int cpu, int node, int nice_incr);
+
+#endif // PLACEMENT_H
@@ -0,0 +1,1270 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pump.h"
+
+#define PUMP_CHUNK 65536  // most bytes moved by one call, and size of each buffer
+#define PUMP_ROUNDS 64    // most calls one task makes before the others get a turn
+
+// kinds of task
+enum {
+    TASK_FANOUT,     // one input copied to every output (a plain copy is a fan-out to one)
+    TASK_SPLIT,      // one input dealt out to the outputs in chunks of whole lines
+    TASK_MERGE,      // several inputs interleaved onto one output a chunk of whole lines at a time
+    TASK_PARTITION,  // one input cut into a contiguous range of whole lines per output
+    TASK_ORDERED,    // several inputs concatenated onto one output in order
+};
+
+// how a fan-out moves data when nothing is pending in its buffer
+enum {
+    MOVE_SPLICE,    // splice() (and tee() for several outputs)
+    MOVE_SENDFILE,  // sendfile(), for inputs splice() refuses
+    MOVE_COPY,      // read() into the buffer, then write() to each output
+};
+
+// what a fan-out's last stall waited on, so it can alternate between them
+enum {
+    STALL_NONE,
+    STALL_IN,
+    STALL_OUT,
+};
+
+struct pump_task {
+    int kind;
+    int *in_fds;          // -1 once an input has been read to the end
+    int num_in;
+    int *out_fds;         // -1 once an output has been closed or dropped
+    int num_out;
+    int num_live;         // outputs still open (for merges, inputs still open)
+    int shared_out;       // merges: the output is the shell's standard output
+    int done;
+    int failed;
+    struct pollfd *want;  // what the task waits on after its last step, nothing if it can carry on
+    int num_want;
+    char *buf;            // data read but not yet delivered
+    size_t buf_len;
+    size_t buf_sent;      // split, merges: how much of the data being delivered was written
+    size_t *sent;         // fan-out: per output, how much of buf it already has
+    int method;           // fan-out: MOVE_*
+    int last_stall;       // fan-out: STALL_*
+    int target;           // split: output of the last chunk; merges: input being delivered
+    int next;             // merge: input to look at first for more lines
+    size_t cut;           // split, merge: length of the whole lines being delivered
+    char **line_bufs;     // merge: per input, output not yet delivered
+    size_t *line_lens;
+    int *spools;          // ordered: per input, temp file holding output that arrived early;
+                          // partition: spools[0] holds the input
+    off_t *offs;          // ordered: bytes in each spool; partition: next offset of each output's range
+    off_t *ends;          // ordered: bytes of each spool delivered; partition: end of each output's range
+    int spooling;         // partition: still reading the input into the spool
+    int own_spool;        // partition: the spool is a temp file rather than the input itself
+};
+
+void pump_set_init(pump_set_t *set) {
+    set->tasks = NULL;
+    set->num_tasks = 0;
+    set->capacity = 0;
+    set->watch_fd = -1;
+    set->on_watch = NULL;
+    set->watch_arg = NULL;
+    set->ring = NULL;
+}
+
+void pump_set_watch(pump_set_t *set, int fd, void (*on_ready)(void *arg), void *arg) {
+    set->watch_fd = fd;
+    set->on_watch = on_ready;
+    set->watch_arg = arg;
+}
+
+void pump_set_use_uring(pump_set_t *set, uring_t *ring) {
+    set->ring = ring;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+// an unlinked temp file in $TMPDIR (or /tmp), or -1 on error (already reported)
+static int make_spool(void) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0') {
+        dir = "/tmp";
+    }
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd != -1) {
+        return fd;
+    }
+    // file system without O_TMPFILE support, create and unlink a named file instead
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/swish-XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        perror("temp file");
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+// free what a task allocated, without touching its descriptors
+static void free_task(pump_task_t *task) {
+    if (task->line_bufs != NULL) {
+        for (int i = 0; i < task->num_in; i++) {
+            free(task->line_bufs[i]);
+        }
+    }
+    free(task->in_fds);
+    free(task->out_fds);
+    free(task->want);
+    free(task->buf);
+    free(task->sent);
+    free(task->line_bufs);
+    free(task->line_lens);
+    free(task->spools);
+    free(task->offs);
+    free(task->ends);
+}
+
+/*
+ * Append a task with the given descriptors to a set, allocating the state
+ * every kind uses. All descriptors except a shared output are made non-blocking.
+ * Returns the new task (to finish initializing) or NULL on error
+ */
+static pump_task_t *add_task(pump_set_t *set, int kind, const int *in_fds, int num_in,
+                             const int *out_fds, int num_out, int shared_out) {
+    if (set->num_tasks == set->capacity) {
+        int new_capacity = (set->capacity == 0) ? 4 : 2 * set->capacity;
+        pump_task_t *new_tasks = realloc(set->tasks, new_capacity * sizeof(pump_task_t));
+        if (new_tasks == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            return NULL;
+        }
+        set->tasks = new_tasks;
+        set->capacity = new_capacity;
+    }
+    pump_task_t *task = &set->tasks[set->num_tasks];
+    memset(task, 0, sizeof(pump_task_t));
+    task->kind = kind;
+    task->in_fds = malloc(num_in * sizeof(int));
+    task->out_fds = malloc(num_out * sizeof(int));
+    task->want = malloc((num_in + num_out) * sizeof(struct pollfd));
+    task->buf = malloc(PUMP_CHUNK);
+    if (task->in_fds == NULL || task->out_fds == NULL || task->want == NULL || task->buf == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        free_task(task);
+        return NULL;
+    }
+    for (int i = 0; i < num_in; i++) {
+        if (set_nonblocking(in_fds[i]) != 0) {
+            free_task(task);
+            return NULL;
+        }
+        task->in_fds[i] = in_fds[i];
+    }
+    for (int i = 0; i < num_out; i++) {
+        // standard output is shared with other processes, so its flags are left alone
+        if (!shared_out && set_nonblocking(out_fds[i]) != 0) {
+            free_task(task);
+            return NULL;
+        }
+        task->out_fds[i] = out_fds[i];
+    }
+    task->num_in = num_in;
+    task->num_out = num_out;
+    task->shared_out = shared_out;
+    task->num_live = (kind == TASK_MERGE || kind == TASK_ORDERED) ? num_in : num_out;
+    task->target = -1;
+    set->num_tasks++;
+    return task;
+}
+
+// undo add_task() for the most recently added task, after a later allocation failed
+static int drop_new_task(pump_set_t *set) {
+    fprintf(stderr, "malloc failed\n");
+    free_task(&set->tasks[--set->num_tasks]);
+    return -1;
+}
+
+int pump_add_fanout(pump_set_t *set, int in_fd, const int *out_fds, int num_out) {
+    pump_task_t *task = add_task(set, TASK_FANOUT, &in_fd, 1, out_fds, num_out, 0);
+    if (task == NULL) {
+        return -1;
+    }
+    if ((task->sent = calloc(num_out, sizeof(size_t))) == NULL) {
+        return drop_new_task(set);
+    }
+    task->method = MOVE_SPLICE;
+    return 0;
+}
+
+int pump_add_copy(pump_set_t *set, int in_fd, int out_fd) {
+    return pump_add_fanout(set, in_fd, &out_fd, 1);
+}
+
+static void partition_ranges(pump_task_t *task);
+
+int pump_add_split(pump_set_t *set, int in_fd, const int *out_fds, int num_out, int ordered) {
+    pump_task_t *task = add_task(set, ordered ? TASK_PARTITION : TASK_SPLIT, &in_fd, 1, out_fds, num_out, 0);
+    if (task == NULL) {
+        return -1;
+    }
+    if (!ordered) {
+        return 0;
+    }
+    task->spools = malloc(sizeof(int));
+    task->offs = calloc(num_out, sizeof(off_t));
+    task->ends = calloc(num_out, sizeof(off_t));
+    if (task->spools == NULL || task->offs == NULL || task->ends == NULL) {
+        return drop_new_task(set);
+    }
+    struct stat st;
+    if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode)) {  // a file can be partitioned where it is
+        off_t start = lseek(in_fd, 0, SEEK_CUR);
+        task->spools[0] = in_fd;
+        task->offs[0] = (start == -1) ? 0 : start;
+        task->ends[0] = st.st_size;
+        partition_ranges(task);
+    } else if ((task->spools[0] = make_spool()) == -1) {
+        free_task(&set->tasks[--set->num_tasks]);
+        return -1;
+    } else {
+        task->own_spool = 1;
+        task->spooling = 1;
+    }
+    return 0;
+}
+
+int pump_add_merge(pump_set_t *set, const int *in_fds, int num_in, int out_fd, int ordered) {
+    int shared_out = (out_fd == -1);
+    if (shared_out) {
+        out_fd = STDOUT_FILENO;
+    }
+    pump_task_t *task = add_task(set, ordered ? TASK_ORDERED : TASK_MERGE, in_fds, num_in, &out_fd, 1, shared_out);
+    if (task == NULL) {
+        return -1;
+    }
+    if (ordered) {
+        task->spools = malloc(num_in * sizeof(int));
+        task->offs = calloc(num_in, sizeof(off_t));
+        task->ends = calloc(num_in, sizeof(off_t));
+        if (task->spools == NULL || task->offs == NULL || task->ends == NULL) {
+            return drop_new_task(set);
+        }
+        for (int i = 0; i < num_in; i++) {
+            task->spools[i] = -1;  // created when an input has output to hold back
+        }
+        task->target = 0;
+    } else {
+        task->line_bufs = calloc(num_in, sizeof(char *));
+        task->line_lens = calloc(num_in, sizeof(size_t));
+        if (task->line_bufs == NULL || task->line_lens == NULL) {
+            return drop_new_task(set);
+        }
+    }
+    return 0;
+}
+
+static void want(pump_task_t *task, int fd, short events) {
+    task->want[task->num_want++] = (struct pollfd) {fd, events, 0};
+}
+
+static void drop_output(pump_task_t *task, int i) {
+    if (!task->shared_out) {
+        close(task->out_fds[i]);
+    }
+    task->out_fds[i] = -1;
+    if (task->kind != TASK_MERGE && task->kind != TASK_ORDERED) {
+        task->num_live--;
+    }
+}
+
+static void close_input(pump_task_t *task, int i) {
+    close(task->in_fds[i]);
+    task->in_fds[i] = -1;
+    if (task->kind == TASK_MERGE || task->kind == TASK_ORDERED) {
+        task->num_live--;
+    }
+}
+
+static void finish(pump_task_t *task) {
+    for (int i = 0; i < task->num_out; i++) {
+        if (task->out_fds[i] != -1) {
+            drop_output(task, i);
+        }
+    }
+    for (int i = 0; i < task->num_in; i++) {
+        if (task->in_fds[i] != -1) {
+            close_input(task, i);
+        }
+    }
+    if (task->kind == TASK_ORDERED) {
+        for (int i = 0; i < task->num_in; i++) {
+            if (task->spools[i] != -1) {
+                close(task->spools[i]);
+                task->spools[i] = -1;
+            }
+        }
+    } else if (task->kind == TASK_PARTITION && task->own_spool && task->spools[0] != -1) {
+        close(task->spools[0]);  // otherwise it is the input, closed above
+        task->spools[0] = -1;
+    }
+    task->num_want = 0;
+    task->done = 1;
+}
+
+// report an unexpected error from 'what' and give up on the task
+static void fail(pump_task_t *task, const char *what) {
+    perror(what);
+    task->failed = 1;
+    finish(task);
+}
+
+// write all of 'len' bytes to a regular file, returns 0 on success or -1 on error
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Fan-out
+ */
+
+// index of the first output that is still live
+static int lead_output(const pump_task_t *task) {
+    for (int i = 0; i < task->num_out; i++) {
+        if (task->out_fds[i] != -1) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Deliver buffered data to the outputs that don't have all of it yet
+ * Returns 1 if everything was delivered, 0 if an output would block
+ */
+static int flush_pending(pump_task_t *task) {
+    int blocked = 0;
+    for (int i = 0; i < task->num_out; i++) {
+        while (task->out_fds[i] != -1 && task->sent[i] < task->buf_len) {
+            ssize_t n = write(task->out_fds[i], task->buf + task->sent[i], task->buf_len - task->sent[i]);
+            if (n >= 0) {
+                task->sent[i] += n;
+            } else if (errno == EAGAIN) {
+                want(task, task->out_fds[i], POLLOUT);
+                blocked = 1;
+                break;
+            } else if (errno != EINTR) {
+                if (errno != EPIPE) {  // a reader leaving early is not an error
+                    perror("write");
+                    task->failed = 1;
+                }
+                drop_output(task, i);
+            }
+        }
+    }
+    if (blocked) {
+        return 0;
+    }
+    task->buf_len = 0;
+    memset(task->sent, 0, task->num_out * sizeof(size_t));
+    return 1;
+}
+
+/*
+ * Consume 'len' bytes from the input into the buffer, recording how much of it
+ * each output already received
+ * Returns 0 on success or -1 on error
+ */
+static int buffer_input(pump_task_t *task, size_t len, const size_t *have) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(task->in_fds[0], task->buf + got, len - got);
+        if (n > 0) {
+            got += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            // the bytes were just tee()d from this pipe, so they must be there
+            return -1;
+        }
+    }
+    task->buf_len = len;
+    for (int i = 0; i < task->num_out; i++) {
+        task->sent[i] = have[i];
+    }
+    return 0;
+}
+
+/*
+ * Move the next chunk from the input to every live output
+ * Returns the number of bytes consumed from the input, 0 at end of input, or
+ * -1 with errno set (EAGAIN if it would block)
+ */
+static ssize_t move_chunk(pump_task_t *task) {
+    int in_fd = task->in_fds[0];
+    int lead = lead_output(task);
+    if (task->method == MOVE_COPY) {
+        ssize_t n = read(in_fd, task->buf, PUMP_CHUNK);
+        if (n > 0) {
+            task->buf_len = n;
+            memset(task->sent, 0, task->num_out * sizeof(size_t));
+        }
+        return n;
+    }
+    if (task->method == MOVE_SENDFILE) {  // only used with a single output
+        return sendfile(task->out_fds[lead], in_fd, NULL, PUMP_CHUNK);
+    }
+    if (task->num_live == 1) {
+        return splice(in_fd, NULL, task->out_fds[lead], NULL, PUMP_CHUNK,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+    }
+
+    // several outputs: tee() to all but the last, then splice() the same bytes to the last
+    ssize_t len = tee(in_fd, task->out_fds[lead], PUMP_CHUNK, SPLICE_F_NONBLOCK);
+    if (len <= 0) {
+        return len;
+    }
+    size_t have[task->num_out];
+    int last = lead;
+    int short_tee = 0;
+    for (int i = 0; i < task->num_out; i++) {
+        have[i] = 0;
+        if (task->out_fds[i] != -1) {
+            last = i;
+        }
+    }
+    have[lead] = len;
+    for (int i = lead + 1; i < last; i++) {
+        if (task->out_fds[i] == -1) {
+            continue;
+        }
+        ssize_t n = tee(in_fd, task->out_fds[i], len, SPLICE_F_NONBLOCK);
+        if (n == -1 && errno == EPIPE) {
+            drop_output(task, i);
+            continue;
+        }
+        have[i] = (n > 0) ? n : 0;
+        if (have[i] < len) {
+            short_tee = 1;
+        }
+    }
+    if (!short_tee) {
+        ssize_t n = splice(in_fd, NULL, task->out_fds[last], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1 && errno == EPIPE) {
+            drop_output(task, last);
+            n = 0;
+        }
+        have[last] = (n > 0) ? n : 0;
+        if (have[last] == len) {
+            return len;
+        }
+        len -= have[last];  // the rest of this chunk is still in the input pipe
+        for (int i = 0; i < task->num_out; i++) {
+            have[i] = (i == last) ? 0 : len;
+        }
+    }
+    // some output took less than the others: consume the chunk and finish it from the buffer
+    if (buffer_input(task, len, have) != 0) {
+        errno = EIO;
+        return -1;
+    }
+    return len;
+}
+
+static void fanout_step(pump_task_t *task) {
+    for (int rounds = 0; rounds < PUMP_ROUNDS; rounds++) {
+        if (task->num_live == 0) {
+            finish(task);  // nobody left to copy to
+            return;
+        }
+        if (task->buf_len > 0 && !flush_pending(task)) {
+            return;
+        }
+        ssize_t n = move_chunk(task);
+        if (n > 0) {
+            task->last_stall = STALL_NONE;
+            continue;
+        } else if (n == 0) {
+            finish(task);
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN) {
+            // either the input is empty or an output is full; alternate so polling can't spin
+            if (task->last_stall == STALL_OUT) {
+                task->last_stall = STALL_IN;
+                want(task, task->in_fds[0], POLLIN);
+            } else {
+                task->last_stall = STALL_OUT;
+                want(task, task->out_fds[lead_output(task)], POLLOUT);
+            }
+            return;
+        } else if (errno == EPIPE) {
+            drop_output(task, lead_output(task));
+        } else if ((errno == EINVAL || errno == ENOSYS) && task->method != MOVE_COPY) {
+            // this pair of descriptors can't be spliced/sent, try the next method
+            task->method = (task->method == MOVE_SPLICE && task->num_out == 1) ? MOVE_SENDFILE : MOVE_COPY;
+        } else {
+            fail(task, "pump");
+            return;
+        }
+    }
+}
+
+/*
+ * Split: round-robin chunks of whole lines, so that no line is divided
+ * between two outputs (unless it is longer than a whole buffer)
+ */
+
+static void split_step(pump_task_t *task) {
+    for (int rounds = 0; rounds < PUMP_ROUNDS; rounds++) {
+        if (task->num_live == 0) {
+            finish(task);
+            return;
+        }
+        if (task->cut > 0) {  // deliver the whole lines at the front of the buffer
+            if (task->buf_sent == 0) {
+                // a new chunk may go to any output with room, starting after the last one used
+                ssize_t n = -1;
+                for (int tried = 0; tried < task->num_out && n == -1; tried++) {
+                    int i = (task->target + 1 + tried) % task->num_out;
+                    if (task->out_fds[i] == -1) {
+                        continue;
+                    }
+                    n = write(task->out_fds[i], task->buf, task->cut);
+                    if (n >= 0) {
+                        task->target = i;
+                    } else if (errno == EPIPE) {
+                        drop_output(task, i);
+                    } else if (errno != EAGAIN && errno != EINTR) {
+                        perror("write");
+                        task->failed = 1;
+                        drop_output(task, i);
+                    }
+                }
+                if (n == -1) {
+                    for (int i = 0; i < task->num_out; i++) {  // every output is full (or gone)
+                        if (task->out_fds[i] != -1) {
+                            want(task, task->out_fds[i], POLLOUT);
+                        }
+                    }
+                    if (task->num_live > 0) {
+                        return;
+                    }
+                    continue;
+                }
+                task->buf_sent = n;
+            } else {  // the rest of a chunk has to follow its start
+                ssize_t n = write(task->out_fds[task->target], task->buf + task->buf_sent, task->cut - task->buf_sent);
+                if (n >= 0) {
+                    task->buf_sent += n;
+                } else if (errno == EAGAIN) {
+                    want(task, task->out_fds[task->target], POLLOUT);
+                    return;
+                } else if (errno != EINTR) {
+                    if (errno != EPIPE) {
+                        perror("write");
+                        task->failed = 1;
+                    }
+                    drop_output(task, task->target);
+                    task->buf_sent = task->cut;  // the rest of the chunk is lost with its reader
+                }
+            }
+            if (task->buf_sent == task->cut) {
+                task->buf_len -= task->cut;
+                memmove(task->buf, task->buf + task->cut, task->buf_len);
+                task->cut = 0;
+                task->buf_sent = 0;
+            }
+            continue;
+        }
+
+        if (task->in_fds[0] == -1) {  // input finished and everything delivered
+            finish(task);
+            return;
+        }
+        size_t old_len = task->buf_len;
+        ssize_t n = read(task->in_fds[0], task->buf + old_len, PUMP_CHUNK - old_len);
+        if (n > 0) {
+            task->buf_len += n;
+            // the buffer held no newline before, so only the new bytes need searching
+            char *nl = memrchr(task->buf + old_len, '\n', n);
+            if (nl != NULL) {
+                task->cut = nl - task->buf + 1;
+            } else if (task->buf_len == PUMP_CHUNK) {
+                task->cut = task->buf_len;  // a line longer than the buffer has to be divided
+            }
+        } else if (n == 0) {
+            close_input(task, 0);
+            task->cut = task->buf_len;  // a last line without a newline
+        } else if (errno == EAGAIN) {
+            want(task, task->in_fds[0], POLLIN);
+            return;
+        } else if (errno != EINTR) {
+            fail(task, "read");
+            return;
+        }
+    }
+}
+
+/*
+ * Merge: each input's output is held until it ends in a newline, then all of
+ * its whole lines are written at once, so lines from different inputs never mix
+ */
+
+// write to the merge output: returns bytes written, or -1 if the task stopped or has to wait
+static ssize_t merge_write(pump_task_t *task, const char *data, size_t len) {
+    while (1) {
+        ssize_t n = write(task->out_fds[0], data, len);
+        if (n >= 0) {
+            return n;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN) {
+            want(task, task->out_fds[0], POLLOUT);
+        } else if (errno == EPIPE) {
+            finish(task);  // nobody reads the output, the inputs' writers get SIGPIPE in turn
+        } else {
+            fail(task, "write");
+        }
+        return -1;
+    }
+}
+
+static void merge_step(pump_task_t *task) {
+    for (int rounds = 0; rounds < PUMP_ROUNDS; rounds++) {
+        if (task->target != -1) {  // deliver whole lines from one input
+            char *data = task->line_bufs[task->target];
+            ssize_t n = merge_write(task, data + task->buf_sent, task->cut - task->buf_sent);
+            if (n == -1) {
+                return;
+            }
+            task->buf_sent += n;
+            if (task->buf_sent == task->cut) {
+                task->line_lens[task->target] -= task->cut;
+                memmove(data, data + task->cut, task->line_lens[task->target]);
+                task->next = (task->target + 1) % task->num_in;  // take turns
+                task->target = -1;
+                task->buf_sent = 0;
+                task->cut = 0;
+            }
+            continue;
+        }
+        if (task->num_live == 0) {
+            finish(task);
+            return;
+        }
+
+        // find an input with whole lines to deliver
+        for (int tried = 0; tried < task->num_in && task->target == -1; tried++) {
+            int i = (task->next + tried) % task->num_in;
+            if (task->in_fds[i] == -1) {
+                continue;
+            }
+            if (task->line_bufs[i] == NULL && (task->line_bufs[i] = malloc(PUMP_CHUNK)) == NULL) {
+                fprintf(stderr, "malloc failed\n");
+                task->failed = 1;
+                finish(task);
+                return;
+            }
+            size_t old_len = task->line_lens[i];
+            ssize_t n = read(task->in_fds[i], task->line_bufs[i] + old_len, PUMP_CHUNK - old_len);
+            if (n > 0) {
+                task->line_lens[i] += n;
+                char *nl = memrchr(task->line_bufs[i] + old_len, '\n', n);
+                if (nl != NULL) {
+                    task->cut = nl - task->line_bufs[i] + 1;
+                } else if (task->line_lens[i] == PUMP_CHUNK) {
+                    task->cut = PUMP_CHUNK;  // a line longer than the buffer has to be divided
+                }
+            } else if (n == 0) {
+                close_input(task, i);
+                task->cut = task->line_lens[i];  // a last line without a newline
+            } else if (errno != EAGAIN && errno != EINTR) {
+                perror("read");
+                task->failed = 1;
+                close_input(task, i);
+                task->cut = task->line_lens[i];
+            }
+            if (task->cut > 0) {
+                task->target = i;
+            }
+        }
+        if (task->target == -1 && task->num_live > 0) {
+            for (int i = 0; i < task->num_in; i++) {
+                if (task->in_fds[i] != -1) {
+                    want(task, task->in_fds[i], POLLIN);
+                }
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Partition: read the whole input into a spool (unless it is a file already),
+ * then feed each output its own contiguous range of whole lines
+ */
+
+// position just past the first newline at or after 'from', or 'end' if there is none
+static off_t line_end(pump_task_t *task, off_t from, off_t end) {
+    while (from < end) {
+        size_t len = (end - from < PUMP_CHUNK) ? end - from : PUMP_CHUNK;
+        ssize_t n = pread(task->spools[0], task->buf, len, from);
+        if (n <= 0) {
+            return end;
+        }
+        char *nl = memchr(task->buf, '\n', n);
+        if (nl != NULL) {
+            return from + (nl - task->buf) + 1;
+        }
+        from += n;
+    }
+    return end;
+}
+
+// divide the spooled input, offs[0] up to ends[0], into one range per output of about the same size
+static void partition_ranges(pump_task_t *task) {
+    off_t start = task->offs[0];
+    off_t end = task->ends[0];
+    off_t size = end - start;
+    off_t prev = start;
+    for (int i = 0; i < task->num_out; i++) {
+        off_t stop = end;
+        if (i < task->num_out - 1) {
+            off_t guess = start + size * (i + 1) / task->num_out;
+            stop = (guess <= prev) ? prev : line_end(task, guess - 1, end);
+        }
+        task->offs[i] = prev;
+        task->ends[i] = stop;
+        prev = stop;
+    }
+}
+
+static void partition_step(pump_task_t *task) {
+    for (int rounds = 0; rounds < PUMP_ROUNDS; rounds++) {
+        if (task->spooling) {
+            ssize_t n = read(task->in_fds[0], task->buf, PUMP_CHUNK);
+            if (n > 0) {
+                if (write_all(task->spools[0], task->buf, n) != 0) {
+                    fail(task, "temp file");
+                    return;
+                }
+                task->ends[0] += n;
+            } else if (n == 0) {
+                close_input(task, 0);
+                task->spooling = 0;
+                partition_ranges(task);
+            } else if (errno == EAGAIN) {
+                want(task, task->in_fds[0], POLLIN);
+                return;
+            } else if (errno != EINTR) {
+                fail(task, "read");
+                return;
+            }
+            continue;
+        }
+
+        int progress = 0;
+        task->num_want = 0;
+        for (int i = 0; i < task->num_out; i++) {
+            if (task->out_fds[i] == -1) {
+                continue;
+            }
+            if (task->offs[i] >= task->ends[i]) {
+                drop_output(task, i);  // the whole range is delivered, so the reader sees end of file
+                continue;
+            }
+            off_t left = task->ends[i] - task->offs[i];
+            size_t len = (left < PUMP_CHUNK) ? left : PUMP_CHUNK;
+            ssize_t n = sendfile(task->out_fds[i], task->spools[0], &task->offs[i], len);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {  // copy through the buffer instead
+                n = pread(task->spools[0], task->buf, len, task->offs[i]);
+                if (n > 0 && (n = write(task->out_fds[i], task->buf, n)) > 0) {
+                    task->offs[i] += n;
+                }
+            }
+            if (n > 0) {
+                progress = 1;
+            } else if (n == -1 && errno == EAGAIN) {
+                want(task, task->out_fds[i], POLLOUT);
+            } else if (n == -1 && errno == EPIPE) {
+                drop_output(task, i);
+            } else if (n == -1 && errno != EINTR) {
+                fail(task, "sendfile");
+                return;
+            }
+        }
+        if (task->num_live == 0) {
+            finish(task);
+            return;
+        }
+        if (!progress) {
+            return;
+        }
+    }
+    task->num_want = 0;  // stopped while still moving data, not to wait
+}
+
+/*
+ * Ordered merge: the current input's output is passed straight through, while
+ * output arriving early from later inputs is held in temp files until their turn
+ */
+
+// move whatever the inputs after the current one have produced into their spools
+static int spool_early_output(pump_task_t *task) {
+    for (int i = task->target + 1; i < task->num_in; i++) {
+        while (task->in_fds[i] != -1) {
+            ssize_t n = read(task->in_fds[i], task->buf, PUMP_CHUNK);
+            if (n > 0) {
+                if (task->spools[i] == -1 && (task->spools[i] = make_spool()) == -1) {
+                    return -1;
+                }
+                if (write_all(task->spools[i], task->buf, n) != 0) {
+                    perror("temp file");
+                    return -1;
+                }
+                task->offs[i] += n;
+            } else if (n == 0) {
+                close_input(task, i);
+            } else if (errno == EAGAIN) {
+                break;
+            } else if (errno != EINTR) {
+                perror("read");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void ordered_step(pump_task_t *task) {
+    if (task->buf_sent == task->buf_len && spool_early_output(task) != 0) {  // buf is free to use
+        task->failed = 1;
+        finish(task);
+        return;
+    }
+    for (int rounds = 0; rounds < PUMP_ROUNDS && task->num_want == 0; rounds++) {
+        if (task->buf_sent < task->buf_len) {
+            ssize_t n = merge_write(task, task->buf + task->buf_sent, task->buf_len - task->buf_sent);
+            if (n == -1) {
+                break;
+            }
+            task->buf_sent += n;
+            continue;
+        }
+        task->buf_len = task->buf_sent = 0;
+        int i = task->target;
+        if (i == task->num_in) {
+            finish(task);
+            return;
+        }
+        if (task->spools[i] != -1) {  // first what arrived while it wasn't this input's turn
+            if (task->ends[i] < task->offs[i]) {
+                off_t left = task->offs[i] - task->ends[i];
+                ssize_t n = pread(task->spools[i], task->buf, left < PUMP_CHUNK ? left : PUMP_CHUNK, task->ends[i]);
+                if (n <= 0) {
+                    fail(task, "temp file");
+                    return;
+                }
+                task->ends[i] += n;
+                task->buf_len = n;
+                continue;
+            }
+            close(task->spools[i]);
+            task->spools[i] = -1;
+        }
+        if (task->in_fds[i] == -1) {  // this input is done, on to the next
+            task->target++;
+            continue;
+        }
+        ssize_t n = read(task->in_fds[i], task->buf, PUMP_CHUNK);
+        if (n > 0) {
+            task->buf_len = n;
+        } else if (n == 0) {
+            close_input(task, i);
+        } else if (errno == EAGAIN) {
+            want(task, task->in_fds[i], POLLIN);
+        } else if (errno != EINTR) {
+            fail(task, "read");
+            return;
+        }
+    }
+    if (task->num_want > 0) {  // while waiting, keep the later inputs from filling their pipes
+        for (int i = task->target + 1; i < task->num_in; i++) {
+            if (task->in_fds[i] != -1) {
+                want(task, task->in_fds[i], POLLIN);
+            }
+        }
+    }
+}
+
+static void step(pump_task_t *task) {
+    task->num_want = 0;
+    switch (task->kind) {
+    case TASK_FANOUT:
+        fanout_step(task);
+        break;
+    case TASK_SPLIT:
+        split_step(task);
+        break;
+    case TASK_MERGE:
+        merge_step(task);
+        break;
+    case TASK_PARTITION:
+        partition_step(task);
+        break;
+    case TASK_ORDERED:
+        ordered_step(task);
+        break;
+    }
+}
+
+/*
+ * user_data of the ring's poll requests: the task, which of its wanted
+ * descriptors, and the task's generation when the poll was queued
+ */
+#define POLL_TAG(task, j, gen) (((uint64_t) (task) << 48) | ((uint64_t) (j) << 32) | (gen))
+#define TAG_LIMIT 0xffff        // tasks, and descriptors per task, that fit in a tag
+#define WATCH_TAG UINT64_MAX    // the poll on the watched descriptor
+#define REMOVE_TAG (UINT64_MAX - 1)  // a POLL_REMOVE, whose own completion means nothing
+
+// queue a request on the ring, flushing the queue first if it's full
+static struct io_uring_sqe *ring_sqe(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL && uring_submit(ring, 0) == 0) {
+        sqe = uring_get_sqe(ring);
+    }
+    return sqe;
+}
+
+static int ring_poll(uring_t *ring, int fd, short events, uint64_t tag) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = (unsigned short) events;
+    sqe->user_data = tag;
+    return 0;
+}
+
+static int ring_poll_remove(uring_t *ring, uint64_t tag) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = tag;
+    sqe->user_data = REMOVE_TAG;
+    return 0;
+}
+
+// a poll a task keeps on the ring for one of its descriptors
+typedef struct {
+    int fd;
+    short events;
+    int pending;   // queued and not yet completed or removed
+    uint32_t gen;  // bumped when removed, so the cancelled poll's completion is ignored
+} ring_poll_t;
+
+/*
+ * Bring a task's polls in line with what it wants after a step: polls still
+ * wanted stay queued from one wait to the next, polls no longer wanted
+ * (including any for a descriptor the step closed) are removed, and new ones
+ * are queued.
+ * i: Index of the task, for the tags
+ * polls: The task's polls, one per descriptor it has
+ * in_flight: Count of requests whose completions are outstanding, updated
+ * Returns 0 on success or -1 on error
+ */
+static int rearm(uring_t *ring, const pump_task_t *task, int i, ring_poll_t *polls, int num_polls,
+                 unsigned *in_flight) {
+    for (int k = 0; k < num_polls; k++) {
+        ring_poll_t *rp = &polls[k];
+        int wanted = 0;
+        for (int j = 0; j < task->num_want && rp->pending && !wanted; j++) {
+            wanted = (task->want[j].fd == rp->fd && task->want[j].events == rp->events);
+        }
+        if (rp->pending && !wanted) {
+            if (ring_poll_remove(ring, POLL_TAG(i, k, rp->gen)) == -1) {
+                return -1;
+            }
+            (*in_flight)++;
+            rp->pending = 0;
+            rp->gen++;
+        }
+    }
+    for (int j = 0; j < task->num_want; j++) {
+        int free_k = -1;
+        int k;
+        for (k = 0; k < num_polls; k++) {
+            if (polls[k].pending && polls[k].fd == task->want[j].fd && polls[k].events == task->want[j].events) {
+                break;  // still queued from an earlier wait
+            } else if (!polls[k].pending && free_k == -1) {
+                free_k = k;
+            }
+        }
+        if (k < num_polls) {
+            continue;
+        } else if (free_k == -1) {
+            errno = ENOSPC;  // can't happen: a task never wants more descriptors than it has
+            return -1;
+        }
+        ring_poll_t *rp = &polls[free_k];
+        rp->fd = task->want[j].fd;
+        rp->events = task->want[j].events;
+        if (ring_poll(ring, rp->fd, rp->events, POLL_TAG(i, free_k, rp->gen)) == -1) {
+            return -1;
+        }
+        (*in_flight)++;
+        rp->pending = 1;
+    }
+    return 0;
+}
+
+/*
+ * The loop of pump_run() waiting on the set's ring. A task that has to wait
+ * has a one-shot poll queued for each descriptor it wants, and the first of
+ * them to complete wakes it. Polls that didn't fire stay queued for the
+ * task's next wait, so a descriptor that keeps blocking (a full pipe, say)
+ * is registered once rather than on every wait as with poll(). Polls a task
+ * no longer wants are removed before the ring is next waited on: a poll in
+ * flight holds a reference to its file, so a pipe end the task closed would
+ * otherwise stay open and its reader would never see end of file.
+ * Everything still in flight is removed (and its completion waited for)
+ * before returning.
+ * waiting: Per task, nonzero while it is blocked
+ * Returns 0 when every task has finished or -1 if the ring failed (already reported)
+ */
+static int run_with_ring(pump_set_t *set, char *waiting) {
+    uring_t *ring = set->ring;
+    int ret_val = 0;
+    int *first = malloc((set->num_tasks + 1) * sizeof(int));  // each task's polls start at polls[first[i]]
+    if (first == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    first[0] = 0;
+    for (int i = 0; i < set->num_tasks; i++) {
+        first[i + 1] = first[i] + set->tasks[i].num_in + set->tasks[i].num_out;
+    }
+    ring_poll_t *polls = calloc(first[set->num_tasks], sizeof(ring_poll_t));
+    if (polls == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        free(first);
+        return -1;
+    }
+    unsigned in_flight = 0;  // requests queued whose completions haven't been seen yet
+    int watch_armed = 0;
+
+    while (1) {
+        int running = 0;
+        int ready = 0;  // some task stopped only to give the others a turn
+        for (int i = 0; i < set->num_tasks && ret_val == 0; i++) {
+            pump_task_t *task = &set->tasks[i];
+            if (!task->done && !waiting[i]) {
+                step(task);
+                if (rearm(ring, task, i, polls + first[i], first[i + 1] - first[i], &in_flight) == -1) {
+                    perror("io_uring");
+                    ret_val = -1;
+                }
+                waiting[i] = (task->num_want > 0);
+            }
+            if (task->done) {
+                continue;
+            }
+            running = 1;
+            if (!waiting[i]) {
+                ready = 1;
+            }
+        }
+        if (!running || ret_val == -1) {
+            break;
+        }
+        if (set->watch_fd != -1 && !watch_armed) {
+            if (ring_poll(ring, set->watch_fd, POLLIN, WATCH_TAG) == -1) {
+                perror("io_uring");
+                ret_val = -1;
+                break;
+            }
+            in_flight++;
+            watch_armed = 1;
+        }
+        if (uring_submit(ring, ready ? 0 : 1) == -1 && errno != EINTR) {
+            perror("io_uring_enter");
+            ret_val = -1;
+            break;
+        }
+
+        uint64_t tag;
+        int res;
+        while (uring_next_cqe(ring, &tag, &res)) {
+            in_flight--;
+            if (tag == WATCH_TAG) {
+                watch_armed = 0;
+                set->on_watch(set->watch_arg);
+                continue;
+            } else if (tag == REMOVE_TAG) {
+                continue;
+            }
+            int i = tag >> 48;
+            ring_poll_t *rp = &polls[first[i] + ((tag >> 32) & TAG_LIMIT)];
+            if (rp->pending && rp->gen == (uint32_t) tag) {  // not one removed meanwhile
+                rp->pending = 0;
+                waiting[i] = 0;
+            }
+        }
+    }
+
+    // take back every poll still in flight: the watch, and any left after a failure
+    if (watch_armed && ring_poll_remove(ring, WATCH_TAG) == 0) {
+        in_flight++;
+    }
+    for (int i = 0; i < set->num_tasks; i++) {
+        for (int k = first[i]; k < first[i + 1]; k++) {
+            if (polls[k].pending && ring_poll_remove(ring, POLL_TAG(i, k - first[i], polls[k].gen)) == 0) {
+                in_flight++;
+            }
+        }
+    }
+    while (in_flight > 0) {
+        if (uring_submit(ring, 1) == -1 && errno != EINTR) {
+            perror("io_uring_enter");
+            ret_val = -1;
+            break;
+        }
+        uint64_t tag;
+        int res;
+        while (uring_next_cqe(ring, &tag, &res)) {
+            in_flight--;
+        }
+    }
+    free(polls);
+    free(first);
+    return ret_val;
+}
+
+int pump_run(pump_set_t *set) {
+    if (set->num_tasks == 0) {
+        return 0;
+    }
+    void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    int max_fds = 1;  // the watched descriptor
+    for (int i = 0; i < set->num_tasks; i++) {
+        max_fds += set->tasks[i].num_in + set->tasks[i].num_out;
+    }
+    struct pollfd *fds = malloc(max_fds * sizeof(struct pollfd));
+    int *owner = malloc(max_fds * sizeof(int));
+    char *waiting = calloc(set->num_tasks, 1);  // tasks blocked until poll() says otherwise
+    if (fds == NULL || owner == NULL || waiting == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        free(fds);
+        free(owner);
+        free(waiting);
+        signal(SIGPIPE, old_handler);
+        return -1;
+    }
+
+    // if the ring fails, poll() carries on from where it left off
+    int use_poll = (set->ring == NULL || set->num_tasks >= TAG_LIMIT || max_fds >= TAG_LIMIT
+                    || run_with_ring(set, waiting) == -1);
+    while (use_poll) {
+        int nfds = 0;
+        int running = 0;
+        int ready = 0;  // some task stopped only to give the others a turn
+        for (int i = 0; i < set->num_tasks; i++) {
+            pump_task_t *task = &set->tasks[i];
+            if (!task->done && !waiting[i]) {
+                step(task);
+                waiting[i] = (task->num_want > 0);
+            }
+            if (task->done) {
+                continue;
+            }
+            running = 1;
+            if (!waiting[i]) {
+                ready = 1;
+            }
+            for (int j = 0; j < task->num_want; j++) {
+                fds[nfds] = task->want[j];
+                owner[nfds++] = i;
+            }
+        }
+        if (!running) {
+            break;
+        }
+        if (set->watch_fd != -1) {
+            fds[nfds] = (struct pollfd) {set->watch_fd, POLLIN, 0};
+            owner[nfds++] = -1;
+        }
+        if (poll(fds, nfds, ready ? 0 : -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < nfds; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            } else if (owner[i] == -1) {
+                set->on_watch(set->watch_arg);
+            } else {
+                waiting[owner[i]] = 0;
+            }
+        }
+    }
+
+    int ret_val = 0;
+    for (int i = 0; i < set->num_tasks; i++) {
+        if (set->tasks[i].failed || !set->tasks[i].done) {
+            ret_val = -1;
+        }
+    }
+    free(waiting);
+    free(fds);
+    free(owner);
+    signal(SIGPIPE, old_handler);
+    return ret_val;
+}
+
+void pump_set_free(pump_set_t *set) {
+    for (int i = 0; i < set->num_tasks; i++) {
+        pump_task_t *task = &set->tasks[i];
+        if (!task->done) {
+            finish(task);
+        }
+        free_task(task);
+    }
+    free(set->tasks);
+    pump_set_init(set);
+}
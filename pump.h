@@ -0,0 +1,125 @@
+#ifndef PUMP_H
+#define PUMP_H
+
+/*
+ * In-shell data copying for stages that don't need a separate process.
+ * Copies are registered as tasks in a pump set and then all run together
+ * from a single poll() loop, so one task stalling (e.g. on a full pipe) never
+ * holds up another. Data is moved with splice()/tee() or sendfile() so it
+ * never passes through user space when the kernel allows, falling back to
+ * read()/write() through a buffer. Given an io_uring, the set waits with
+ * poll requests queued on the ring instead, so a descriptor that stays
+ * blocked is registered once rather than on every wait.
+ */
+
+#include "uring.h"
+
+typedef struct pump_task pump_task_t;
+
+typedef struct {
+    pump_task_t *tasks;
+    int num_tasks;
+    int capacity;
+    int watch_fd;                   // extra descriptor watched while running, or -1
+    void (*on_watch)(void *arg);
+    void *watch_arg;
+    uring_t *ring;                  // io_uring to wait with instead of poll(), or NULL
+} pump_set_t;
+
+/*
+ * Initialize an empty set of copy tasks
+ * set: Pointer to the set to initialize
+ */
+void pump_set_init(pump_set_t *set);
+
+/*
+ * Add a task copying everything from one descriptor to another, e.g. from a
+ * file into the first pipe of a pipeline
+ * set: Set to add the task to
+ * in_fd: Descriptor to copy from until end of file
+ * out_fd: Descriptor to copy to
+ * Returns 0 on success or -1 on error. On success both descriptors belong to
+ * the set, which closes them when the copy finishes.
+ */
+int pump_add_copy(pump_set_t *set, int in_fd, int out_fd);
+
+/*
+ * Add a task duplicating everything read from one descriptor onto several
+ * others, with tee(2) when 'in_fd' and the outputs are pipes
+ * set: Set to add the task to
+ * in_fd: Descriptor to copy from until end of file
+ * out_fds: Descriptors to copy to. An output whose reader goes away is
+ *          dropped and the rest carry on.
+ * num_out: Number of entries in out_fds
+ * Returns 0 on success or -1 on error. On success all the descriptors belong
+ * to the set, which closes them when the copy finishes.
+ */
+int pump_add_fanout(pump_set_t *set, int in_fd, const int *out_fds, int num_out);
+
+/*
+ * Add a task dealing the lines read from one descriptor out to several others,
+ * e.g. to the copies of a replicated pipeline stage. Only whole lines are
+ * handed out (a line longer than the 64K buffer is the one exception).
+ * set: Set to add the task to
+ * in_fd: Descriptor to read from until end of file
+ * out_fds: Descriptors to deal the input out to
+ * num_out: Number of entries in out_fds
+ * ordered: Zero to hand chunks of lines to whichever output has room, so the
+ *          outputs share the work as it comes. Nonzero to give each output
+ *          one contiguous range of about the same number of bytes instead,
+ *          which takes reading the whole input first (into a temp file in
+ *          $TMPDIR, unless 'in_fd' is a regular file already).
+ * Returns 0 on success or -1 on error. On success all the descriptors belong
+ * to the set, which closes them when the copy finishes.
+ */
+int pump_add_split(pump_set_t *set, int in_fd, const int *out_fds, int num_out, int ordered);
+
+/*
+ * Add a task combining what is read from several descriptors onto one
+ * set: Set to add the task to
+ * in_fds: Descriptors to read from until end of file
+ * num_in: Number of entries in in_fds
+ * out_fd: Descriptor to write to, or -1 for the shell's standard output, which
+ *         is written with ordinary blocking writes (its flags are shared with
+ *         other processes) and is not closed
+ * ordered: Zero to interleave the inputs as their data arrives, a chunk of
+ *          whole lines at a time. Nonzero to write the inputs one after another
+ *          in order; output arriving early from later inputs is held in temp
+ *          files meanwhile, so their writers never stall.
+ * Returns 0 on success or -1 on error. On success all the descriptors belong
+ * to the set, which closes them when the copy finishes.
+ */
+int pump_add_merge(pump_set_t *set, const int *in_fds, int num_in, int out_fd, int ordered);
+
+/*
+ * Also watch a descriptor while the set runs, e.g. one that reports child exits
+ * set: Set to watch from
+ * fd: Descriptor to wait for readability on
+ * on_ready: Called from pump_run() whenever 'fd' is readable
+ * arg: Passed on to on_ready
+ */
+void pump_set_watch(pump_set_t *set, int fd, void (*on_ready)(void *arg), void *arg);
+
+/*
+ * Wait with an io_uring instead of poll() while the set runs. Nothing else
+ * may use the ring meanwhile.
+ * set: Set to run with the ring
+ * ring: The ring, with nothing in flight, or NULL to go back to poll()
+ */
+void pump_set_use_uring(pump_set_t *set, uring_t *ring);
+
+/*
+ * Run every task in the set until all of them have finished
+ * SIGPIPE is ignored meanwhile, so readers going away can't kill the shell.
+ * set: Set of tasks to run
+ * Returns 0 on success or -1 if any task failed (already reported)
+ */
+int pump_run(pump_set_t *set);
+
+/*
+ * Release a pump set, closing the descriptors of any task that didn't run
+ * set: Set to free
+ */
+void pump_set_free(pump_set_t *set);
+
+#endif // PUMP_H
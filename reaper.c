@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "reaper.h"
+
+#define MAX_EVENTS 32
+
+// a child's pid and pidfd are packed into its epoll event, pid 0 marks the signalfd
+static uint64_t pack(pid_t pid, int fd) {
+    return ((uint64_t) (uint32_t) pid << 32) | (uint32_t) fd;
+}
+
+int reaper_init(reaper_t *reaper) {
+    reaper->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reaper->epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    reaper->signal_fd = -1;
+    reaper->use_pidfd = 1;
+    sigemptyset(&reaper->old_mask);
+    reaper->num_left = 0;
+    reaper->children = NULL;
+    reaper->capacity = 0;
+    return 0;
+}
+
+// remember a child so that it can be waited for and its pidfd released
+static int track_child(reaper_t *reaper, pid_t pid, int fd) {
+    if (reaper->num_left == reaper->capacity) {
+        int new_capacity = (reaper->capacity == 0) ? 16 : 2 * reaper->capacity;
+        struct reaper_child *new_children = realloc(reaper->children, new_capacity * sizeof(struct reaper_child));
+        if (new_children == NULL) {
+            return -1;
+        }
+        reaper->children = new_children;
+        reaper->capacity = new_capacity;
+    }
+    reaper->children[reaper->num_left].pid = pid;
+    reaper->children[reaper->num_left].pidfd = fd;
+    reaper->num_left++;
+    return 0;
+}
+
+// forget a reaped child, closing its pidfd
+static void untrack_child(reaper_t *reaper, int i) {
+    if (reaper->children[i].pidfd != -1) {
+        epoll_ctl(reaper->epoll_fd, EPOLL_CTL_DEL, reaper->children[i].pidfd, NULL);
+        close(reaper->children[i].pidfd);
+    }
+    reaper->children[i] = reaper->children[--reaper->num_left];
+}
+
+static int find_child(const reaper_t *reaper, pid_t pid) {
+    for (int i = 0; i < reaper->num_left; i++) {
+        if (reaper->children[i].pid == pid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int reaper_add(reaper_t *reaper, pid_t pid) {
+    int fd = reaper->use_pidfd ? syscall(SYS_pidfd_open, pid, 0) : -1;  // always close-on-exec
+    if (fd != -1) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.u64 = pack(pid, fd)};
+        if (epoll_ctl(reaper->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd == -1) {
+        // no pidfd for this child (e.g. an old kernel), so every child is found through SIGCHLD from now on
+        reaper->use_pidfd = 0;
+    }
+    if (track_child(reaper, pid, fd) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+int reaper_arm(reaper_t *reaper) {
+    if (reaper->use_pidfd || reaper->signal_fd != -1) {
+        return 0;
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &reaper->old_mask) == -1) {
+        perror("sigprocmask");
+        return -1;
+    }
+    reaper->signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = pack(0, reaper->signal_fd)};
+    if (reaper->signal_fd == -1 || epoll_ctl(reaper->epoll_fd, EPOLL_CTL_ADD, reaper->signal_fd, &ev) == -1) {
+        perror("signalfd");
+        return -1;
+    }
+    return 0;
+}
+
+int reaper_fd(const reaper_t *reaper) {
+    return reaper->epoll_fd;
+}
+
+/*
+ * Reap whichever children without a pidfd have exited. Children that exited
+ * before SIGCHLD was blocked raised no signal, so this runs on every collect
+ * rather than only on a signal.
+ * Returns the number of children reaped
+ */
+static int sweep(reaper_t *reaper, reaper_exit_fn on_exit, void *arg) {
+    struct signalfd_siginfo info;
+    while (read(reaper->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        // only the wake-up matters, several exits can share one signal
+    }
+    int reaped = 0;
+    int status;
+    struct rusage usage;
+    for (int i = 0; i < reaper->num_left;) {
+        pid_t pid = reaper->children[i].pid;
+        if (reaper->children[i].pidfd == -1 && wait4(pid, &status, WNOHANG, &usage) == pid) {
+            untrack_child(reaper, i);  // moves the last child into slot i
+            on_exit(pid, status, &usage, arg);
+            reaped++;
+        } else {
+            i++;
+        }
+    }
+    return reaped;
+}
+
+int reaper_collect(reaper_t *reaper, int block, reaper_exit_fn on_exit, void *arg) {
+    int reaped = 0;
+    while (1) {
+        if (reaper->signal_fd != -1) {
+            reaped += sweep(reaper, on_exit, arg);
+        }
+        int timeout = (block && reaped == 0 && reaper->num_left > 0) ? -1 : 0;
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(reaper->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return -1;
+        }
+        if (n == 0) {
+            return reaped;
+        }
+        for (int i = 0; i < n; i++) {
+            pid_t pid = events[i].data.u64 >> 32;
+            int fd = (int) (uint32_t) events[i].data.u64;
+            if (pid == 0) {
+                continue;  // the signalfd, swept on the next pass
+            }
+            // a readable pidfd means the child has exited
+            int status;
+            struct rusage usage;
+            int j = find_child(reaper, pid);
+            if (j != -1 && reaper->children[j].pidfd == fd && wait4(pid, &status, WNOHANG, &usage) == pid) {
+                untrack_child(reaper, j);
+                on_exit(pid, status, &usage, arg);
+                reaped++;
+            }
+        }
+    }
+}
+
+void reaper_close(reaper_t *reaper) {
+    for (int i = 0; i < reaper->num_left; i++) {
+        if (reaper->children[i].pidfd != -1) {
+            close(reaper->children[i].pidfd);
+        }
+    }
+    free(reaper->children);
+    reaper->children = NULL;
+    reaper->num_left = 0;
+    reaper->capacity = 0;
+    if (reaper->signal_fd != -1) {
+        close(reaper->signal_fd);
+        sigprocmask(SIG_SETMASK, &reaper->old_mask, NULL);
+        reaper->signal_fd = -1;
+    }
+    close(reaper->epoll_fd);
+    reaper->epoll_fd = -1;
+}
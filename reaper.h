@@ -0,0 +1,80 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/*
+ * Event-driven reaping of a pipeline's children. Each child is watched through
+ * a pidfd registered with an epoll instance, so exits are seen as they happen,
+ * in whatever order. On kernels without pidfds, SIGCHLD is received through a
+ * signalfd instead. Either way only the children added to a reaper are waited
+ * for, so other children of the shell (such as background jobs) are left alone.
+ */
+
+typedef struct {
+    int epoll_fd;      // readable whenever some child may be ready to reap
+    int signal_fd;     // SIGCHLD when pidfds aren't available, otherwise -1
+    int use_pidfd;     // nonzero until pidfd_open() turns out to be unsupported
+    sigset_t old_mask; // signal mask to restore if SIGCHLD was blocked for the signalfd
+    int num_left;      // children added but not yet reaped, the length of children
+    struct reaper_child {
+        pid_t pid;
+        int pidfd;     // -1 if the child is found through SIGCHLD
+    } *children;       // unreaped children; any pidfds left are closed by reaper_close()
+    int capacity;
+} reaper_t;
+
+// called for each child reaped: its pid, wait status, and resources it used
+typedef void (*reaper_exit_fn)(pid_t pid, int status, const struct rusage *usage, void *arg);
+
+/*
+ * Initialize a reaper with no children
+ * reaper: Pointer to the reaper to initialize
+ * Returns 0 on success or -1 on error
+ */
+int reaper_init(reaper_t *reaper);
+
+/*
+ * Start watching a child of the shell
+ * reaper: Reaper to add the child to
+ * pid: Process id of the child, which may already have exited
+ * Returns 0 on success or -1 on error
+ */
+int reaper_add(reaper_t *reaper, pid_t pid);
+
+/*
+ * Finish setting up once every child is added. Without pidfds this is where
+ * SIGCHLD gets blocked and routed to the signalfd; it isn't done earlier so
+ * that children don't inherit the blocked signal.
+ * reaper: Reaper to arm
+ * Returns 0 on success or -1 on error
+ */
+int reaper_arm(reaper_t *reaper);
+
+/*
+ * Descriptor that becomes readable when a child may be ready to reap, for
+ * waiting on alongside other descriptors
+ * reaper: An armed reaper
+ */
+int reaper_fd(const reaper_t *reaper);
+
+/*
+ * Reap every child that has exited
+ * reaper: An armed reaper
+ * block: Nonzero to first wait until at least one child exits (if any are left)
+ * on_exit: Called for each child reaped
+ * arg: Passed on to on_exit
+ * Returns the number of children reaped or -1 on error
+ */
+int reaper_collect(reaper_t *reaper, int block, reaper_exit_fn on_exit, void *arg);
+
+/*
+ * Release a reaper's descriptors and restore the signal mask. Children not
+ * yet reaped are left to a later wait().
+ * reaper: Reaper to close
+ */
+void reaper_close(reaper_t *reaper);
+
+#endif // REAPER_H
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE  // accept4()
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmd_hash.h"
+#include "server.h"
+#include "string_vector.h"
+#include "swish_funcs.h"
+
+#define MAX_LINE (64 * 1024)  // longest command line a client may send
+#define MAX_REQUEST (PATH_MAX + MAX_LINE)
+#define CONNECT_TRIES 100     // attempts, 10ms apart, while a server is starting up
+#define MAX_PENDING 64        // connections waiting to send their request; more wait in the listen backlog
+#define REQUEST_TIMEOUT 5     // seconds a connection may take to send its request
+
+// what a worker sends back once its line has finished
+typedef struct {
+    int32_t status;        // 0 if the line succeeded, 1 otherwise
+    struct rusage usage;   // used by the line's stages and the worker running them
+} server_reply_t;
+
+// a connection accepted but whose request hasn't arrived yet
+typedef struct {
+    int fd;
+    time_t since;  // when it was accepted, CLOCK_MONOTONIC seconds
+} pending_t;
+
+static volatile sig_atomic_t stopping = 0;
+static pending_t pending[MAX_PENDING];
+static unsigned num_pending = 0;
+
+static void stop(int sig) {
+    stopping = 1;
+}
+
+// fill in the address of the socket at 'path'; returns 0 on success or -1 if the path is too long
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// the resources of a finished worker: its own plus those of every stage it waited for
+static void worker_usage(struct rusage *usage) {
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    *usage = children;
+    timeradd(&usage->ru_utime, &self.ru_utime, &usage->ru_utime);
+    timeradd(&usage->ru_stime, &self.ru_stime, &usage->ru_stime);
+    if (self.ru_maxrss > usage->ru_maxrss) {
+        usage->ru_maxrss = self.ru_maxrss;
+    }
+    usage->ru_minflt += self.ru_minflt;
+    usage->ru_majflt += self.ru_majflt;
+    usage->ru_nvcsw += self.ru_nvcsw;
+    usage->ru_nivcsw += self.ru_nivcsw;
+}
+
+/*
+ * Look up the program of every stage of a line in the command hash, so that
+ * workers forked later find it there too. A word taken for a command name
+ * that isn't one costs no more than a failed lookup.
+ */
+static void warm_commands(const strvec_t *tokens) {
+    int want_command = 1;
+    for (unsigned i = 0; i < tokens->length; i++) {
+        int kind = strvec_get_tag(tokens, i);
+        const char *word = strvec_get(tokens, i);
+        if (kind == TOK_PIPE || kind == TOK_LBRACE) {
+            want_command = 1;
+        } else if (kind == TOK_REPLICATE || kind == TOK_REPLICATE_ORDERED) {
+            want_command = 1;
+            i++;  // the number of copies
+        } else if (kind == TOK_IN || kind == TOK_OUT || kind == TOK_APPEND) {
+            i++;  // the file name
+        } else if (kind == TOK_WORD && want_command && word[0] != '@') {  // past any placement words
+            cmd_hash_lookup(word);
+            want_command = 0;
+        }
+    }
+}
+
+/*
+ * Run a client's line in a forked worker, which replies on the connection
+ * This should be called within a CHILD process of the server.
+ * conn: Connection to reply on
+ * listen_fd: The server's socket, closed here
+ * fds: The client's stdin, stdout and stderr
+ * cwd: The client's working directory
+ * tokens: The line, tokenized
+ */
+static void run_worker(int conn, int listen_fd, const int fds[3], const char *cwd, strvec_t *tokens) {
+    struct sigaction dfl = {.sa_handler = SIG_DFL};  // the worker waits for its stages as usual
+    sigaction(SIGCHLD, &dfl, NULL);
+    sigaction(SIGINT, &dfl, NULL);
+    sigaction(SIGTERM, &dfl, NULL);
+    close(listen_fd);
+    for (unsigned i = 0; i < num_pending; i++) {  // other clients' connections are the server's to close
+        if (pending[i].fd != -1 && pending[i].fd != conn) {
+            close(pending[i].fd);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) == -1) {
+            _exit(1);  // nowhere to report it; the client sees the connection close
+        }
+        close(fds[i]);
+    }
+
+    int ret = -1;
+    if (chdir(cwd) == -1) {
+        perror(cwd);
+    } else if (tokens->length == 0) {
+        ret = 0;
+    } else if (strvec_get_tag(tokens, tokens->length - 1) == TOK_BACKGROUND) {
+        fprintf(stderr, "Error: Background jobs can't be run by the server\n");
+    } else {
+        ret = run_pipelined_commands(tokens);
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    server_reply_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.status = (ret == 0) ? 0 : 1;
+    worker_usage(&reply.usage);
+    send(conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+    _exit(reply.status);  // not exit(), see launch_stage()
+}
+
+/*
+ * Take the request off a connection that has one waiting (or has been
+ * closed) and start a worker for it
+ * conn: The connection, which the worker keeps open until it replies
+ * listen_fd: The server's socket
+ * buf: Buffer of MAX_REQUEST bytes to receive the request into
+ * tokens: The server's token vector, reused from request to request
+ */
+static void serve(int conn, int listen_fd, char *buf, strvec_t *tokens) {
+    int fds[3] = {-1, -1, -1};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {buf, MAX_REQUEST - 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    ssize_t len;
+    while ((len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT)) == -1 && errno == EINTR) {
+    }
+    struct cmsghdr *cmsg = (len > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+        && cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    // the request is the working directory and the line, each NUL-terminated
+    buf[(len > 0) ? len : 0] = '\0';
+    char *cwd = buf;
+    char *line = buf + strlen(buf) + 1;
+    if (len <= 0) {
+        // closed without a request, as by another server checking whether this one is alive
+    } else if (fds[2] == -1 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || line >= buf + len) {
+        fprintf(stderr, "Error: Malformed request\n");
+    } else if (strcmp(line, "exit") == 0) {
+        server_reply_t reply;
+        memset(&reply, 0, sizeof(reply));
+        send(conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+        stopping = 1;
+    } else if (tokenize_inplace(line, tokens) != 0) {
+        dprintf(fds[1], "Failed to parse command\n");  // as the shell says it
+        server_reply_t reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.status = 1;
+        send(conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+    } else {
+        if (pipeline_opts.hash_commands) {
+            warm_commands(tokens);
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+        } else if (pid == 0) {
+            run_worker(conn, listen_fd, fds, cwd, tokens);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    strvec_reset(tokens);
+}
+
+int server_run(const char *path) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) == -1) {
+        return -1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    // a socket left behind by a server that is gone is replaced, a live one is not
+    if (connect(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Error: A server is already listening on %s\n", path);
+        close(listen_fd);
+        return -1;
+    } else if (errno == ECONNREFUSED) {
+        unlink(path);
+    }
+    mode_t old_mask = umask(077);  // only this user may connect
+    int bound = bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_mask);
+    if (bound == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+        perror(path);
+        close(listen_fd);
+        return -1;
+    }
+
+    // workers are never waited for, so they mustn't linger as zombies
+    struct sigaction sa = {.sa_handler = SIG_DFL, .sa_flags = SA_NOCLDWAIT};
+    sigaction(SIGCHLD, &sa, NULL);
+    sa = (struct sigaction) {.sa_handler = stop};  // no SA_RESTART, so accept() returns
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    char *buf = malloc(MAX_REQUEST);
+    if (buf == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        close(listen_fd);
+        unlink(path);
+        return -1;
+    }
+    strvec_t tokens;
+    strvec_init_arena(&tokens, 0);
+    // requests are only read once they have arrived, so a client that is slow to send one holds up no one else
+    struct pollfd pfds[1 + MAX_PENDING];
+    int ret_val = 0;
+    while (!stopping) {
+        pfds[0] = (struct pollfd) {.fd = listen_fd, .events = (num_pending < MAX_PENDING) ? POLLIN : 0};
+        for (unsigned i = 0; i < num_pending; i++) {
+            pfds[1 + i] = (struct pollfd) {.fd = pending[i].fd, .events = POLLIN};
+        }
+        if (poll(pfds, 1 + num_pending, 1000) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            ret_val = -1;
+            break;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (unsigned i = 0; i < num_pending; i++) {
+            if (pfds[1 + i].revents != 0) {
+                serve(pending[i].fd, listen_fd, buf, &tokens);
+                close(pending[i].fd);  // a worker has its own copy until it replies
+                pending[i].fd = -1;
+            } else if (now.tv_sec - pending[i].since >= REQUEST_TIMEOUT) {
+                close(pending[i].fd);
+                pending[i].fd = -1;
+            }
+        }
+        unsigned kept = 0;
+        for (unsigned i = 0; i < num_pending; i++) {
+            if (pending[i].fd != -1) {
+                pending[kept++] = pending[i];
+            }
+        }
+        num_pending = kept;
+        if (pfds[0].revents & POLLIN) {
+            int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn != -1) {
+                pending[num_pending++] = (pending_t) {conn, now.tv_sec};
+            } else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                perror("accept");
+                ret_val = -1;
+                break;
+            }
+        }
+    }
+    for (unsigned i = 0; i < num_pending; i++) {
+        close(pending[i].fd);
+    }
+    num_pending = 0;
+    strvec_clear(&tokens);
+    free(buf);
+    close(listen_fd);
+    unlink(path);
+    return ret_val;
+}
+
+int server_client(const char *path, const char *line, int report) {
+    struct sockaddr_un addr;
+    if (socket_address(path, &addr) == -1) {
+        return -1;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd");
+        return -1;
+    }
+    size_t cwd_len = strlen(cwd) + 1;
+    size_t line_len = strlen(line) + 1;
+    if (line_len > MAX_LINE) {
+        fprintf(stderr, "Error: Command line too long for the server\n");
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("socket");
+        return -1;
+    }
+    int tries = 0;
+    while (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        if ((errno != ENOENT && errno != ECONNREFUSED) || ++tries == CONNECT_TRIES) {
+            perror(path);
+            close(sock);
+            return -1;
+        }
+        struct timespec pause = {0, 10 * 1000 * 1000};
+        nanosleep(&pause, NULL);
+    }
+
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov[2] = {{cwd, cwd_len}, {(void *) line, line_len}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2, .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    fflush(stdout);  // anything this process printed comes before the line's output
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg");
+        close(sock);
+        return -1;
+    }
+
+    server_reply_t reply;
+    ssize_t n;
+    while ((n = recv(sock, &reply, sizeof(reply), 0)) == -1 && errno == EINTR) {
+    }
+    close(sock);
+    if (n != sizeof(reply)) {
+        if (n == -1) {
+            perror("recv");
+        } else {
+            fprintf(stderr, "Error: The server closed the connection\n");
+        }
+        return -1;
+    }
+    if (report) {
+        fprintf(stderr, "status %d  user %.3fs  sys %.3fs  maxrss %ldK\n", reply.status,
+                reply.usage.ru_utime.tv_sec + reply.usage.ru_utime.tv_usec / 1e6,
+                reply.usage.ru_stime.tv_sec + reply.usage.ru_stime.tv_usec / 1e6, reply.usage.ru_maxrss);
+    }
+    return reply.status;
+}
@@ -0,0 +1,40 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/*
+ * Server mode: a long-lived shell that runs command lines sent to it over a
+ * UNIX domain socket, so that callers starting many short pipelines don't
+ * pay for a new shell each time. A client sends the line, its working
+ * directory, and its stdin, stdout and stderr (as SCM_RIGHTS); the server
+ * forks a worker that runs the line with those descriptors, exactly as
+ * run_pipelined_commands() would in the shell, and replies with the exit
+ * status and the resources the line used. Workers run concurrently, and
+ * each starts from the server's warm state: the command hash (the server
+ * looks up every command it is sent) and the token arena. The server reads a
+ * request only once it has arrived, so a client that is slow to send one
+ * doesn't hold up the rest.
+ */
+
+/*
+ * Serve command lines on a socket until a client sends "exit" or the server
+ * gets SIGINT or SIGTERM. A stale socket left at 'path' is replaced, and the
+ * socket is removed again on the way out.
+ * path: File system path of the socket to listen on, made accessible to the
+ *       user only
+ * Returns 0 on a clean shutdown or -1 on error (already reported)
+ */
+int server_run(const char *path);
+
+/*
+ * Send one command line to a server and wait for it to finish. The line's
+ * output goes straight to this process's stdout and stderr. If the server
+ * isn't listening yet, connecting is retried for up to a second.
+ * path: Socket of the server
+ * line: Command line to run, in the server's environment but this process's
+ *       working directory
+ * report: Nonzero to print the resources the line used to stderr
+ * Returns the line's exit status (0 or 1) or -1 on error (already reported)
+ */
+int server_client(const char *path, const char *line, int report);
+
+#endif // SERVER_H
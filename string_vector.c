@@ -1,70 +1,447 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "string_vector.h"
+#include "trace.h"
 
-#define INITIAL_SIZE 4
+#define DEFAULT_ARENA_SIZE 1024
+#define MIN_INDEX_SLOTS 16
+
+struct strvec_chunk {
+    strvec_chunk_t *next;
+    size_t size;  // usable bytes in buf
+    size_t used;
+    char buf[];
+};
+
+// one distinct string of an indexed vector; its text is the element at positions[0]
+typedef struct {
+    unsigned hash;
+    unsigned count;       // occurrences, 0 once strvec_take() has removed them all
+    unsigned capacity;
+    unsigned *positions;  // indices of the occurrences, ascending; NULL if the slot was never used
+} index_slot_t;
+
+// open-addressing hash table with linear probing
+struct strvec_index {
+    unsigned num_slots;  // a power of two
+    unsigned num_used;   // slots with a positions array, including emptied ones
+    index_slot_t slots[];
+};
 
 int strvec_init(strvec_t *vec) {
     vec->length = 0;
-    vec->capacity = INITIAL_SIZE;
-    vec->data = malloc(INITIAL_SIZE * sizeof(char *));
-    if (vec->data == NULL) {
-        return 1;
+    vec->capacity = STRVEC_INLINE_ELEMS;
+    vec->flags = 0;
+    vec->tags = NULL;
+    vec->arena = NULL;
+    vec->chunk_size = 0;
+    vec->base_chunk_size = 0;
+    vec->index = NULL;
+    vec->inline_used = 0;
+    vec->data = vec->inline_data;
+    return 0;
+}
+
+// copy 's' (with 'n' bytes including the NUL) into the struct's own string space, if it fits
+static char *inline_strdup(strvec_t *vec, const char *s, size_t n) {
+    if (n > STRVEC_INLINE_BYTES - vec->inline_used) {
+        return NULL;
     }
+    char *dest = vec->inline_chars + vec->inline_used;
+    memcpy(dest, s, n);
+    vec->inline_used += n;
+    return dest;
+}
 
+// free a string of a regular vector, unless it lives in the struct
+static void free_string(strvec_t *vec, char *s) {
+    uintptr_t p = (uintptr_t) s;
+    uintptr_t start = (uintptr_t) vec->inline_chars;
+    if (p < start || p >= start + STRVEC_INLINE_BYTES) {
+        free(s);
+    }
+}
+
+int strvec_init_arena(strvec_t *vec, size_t arena_size) {
+    if (strvec_init(vec) != 0) {
+        return -1;
+    }
+    vec->flags = STRVEC_ARENA;
+    vec->chunk_size = (arena_size > 0) ? arena_size : DEFAULT_ARENA_SIZE;
+    vec->base_chunk_size = vec->chunk_size;
     return 0;
 }
 
+static void arena_free(strvec_t *vec) {
+    strvec_chunk_t *chunk = vec->arena;
+    while (chunk != NULL) {
+        strvec_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    vec->arena = NULL;
+}
+
+// copy 's' into the vector's arena, starting a new block if the current one is full
+static char *arena_strdup(strvec_t *vec, const char *s) {
+    size_t n = strlen(s) + 1;
+    char *dest = inline_strdup(vec, s, n);
+    if (dest != NULL) {
+        return dest;
+    }
+    strvec_chunk_t *chunk = vec->arena;
+    if (chunk == NULL || chunk->size - chunk->used < n) {
+        size_t size = (n > vec->chunk_size) ? n : vec->chunk_size;
+        if ((chunk = malloc(sizeof(strvec_chunk_t) + size)) == NULL) {
+            return NULL;
+        }
+        chunk->size = size;
+        chunk->used = 0;
+        chunk->next = vec->arena;
+        vec->arena = chunk;
+    }
+    dest = chunk->buf + chunk->used;
+    memcpy(dest, s, n);
+    chunk->used += n;
+    return dest;
+}
+
+// FNV-1a
+static unsigned hash_string(const char *s) {
+    unsigned h = 2166136261u;
+    for (; *s != '\0'; s++) {
+        h = (h ^ (unsigned char) *s) * 16777619u;
+    }
+    return h;
+}
+
+static void index_free(strvec_index_t *index) {
+    if (index == NULL) {
+        return;
+    }
+    for (unsigned i = 0; i < index->num_slots; i++) {
+        free(index->slots[i].positions);
+    }
+    free(index);
+}
+
+// stop indexing after a failed allocation; searches go back to scanning
+static void index_drop(strvec_t *vec) {
+    index_free(vec->index);
+    vec->index = NULL;
+    vec->flags &= ~STRVEC_INDEXED;
+}
+
+// the slot holding 's', or NULL if it doesn't occur
+static index_slot_t *index_lookup(const strvec_t *vec, const char *s, unsigned hash) {
+    const strvec_index_t *index = vec->index;
+    unsigned mask = index->num_slots - 1;
+    for (unsigned i = hash & mask;; i = (i + 1) & mask) {
+        index_slot_t *slot = (index_slot_t *) &index->slots[i];
+        if (slot->positions == NULL) {
+            return NULL;
+        }
+        if (slot->count > 0 && slot->hash == hash && strcmp(vec->data[slot->positions[0]], s) == 0) {
+            return slot;
+        }
+    }
+}
+
+// record that element 'i' occurs at position i, which is past every position recorded so far
+static int index_insert(strvec_t *vec, strvec_index_t *index, unsigned i) {
+    unsigned hash = hash_string(vec->data[i]);
+    unsigned mask = index->num_slots - 1;
+    index_slot_t *free_slot = NULL;  // first emptied slot passed, to reuse if the string is new
+    index_slot_t *slot;
+    for (unsigned k = hash & mask;; k = (k + 1) & mask) {
+        slot = &index->slots[k];
+        if (slot->positions == NULL) {
+            break;
+        }
+        if (slot->count == 0 && free_slot == NULL) {
+            free_slot = slot;
+        } else if (slot->count > 0 && slot->hash == hash && strcmp(vec->data[slot->positions[0]], vec->data[i]) == 0) {
+            break;
+        }
+    }
+    if (slot->positions == NULL || slot->count == 0) {  // a new string
+        if (free_slot != NULL) {
+            slot = free_slot;
+        }
+        if (slot->positions == NULL) {
+            if ((slot->positions = malloc(sizeof(unsigned))) == NULL) {
+                return -1;
+            }
+            slot->capacity = 1;
+            index->num_used++;
+        }
+        slot->hash = hash;
+        slot->count = 0;
+    }
+    if (slot->count == slot->capacity) {
+        unsigned *new_positions = realloc(slot->positions, 2 * slot->capacity * sizeof(unsigned));
+        if (new_positions == NULL) {
+            return -1;
+        }
+        slot->positions = new_positions;
+        slot->capacity *= 2;
+    }
+    slot->positions[slot->count++] = i;
+    return 0;
+}
+
+// build a fresh index of the whole vector, with room to grow
+static int index_rebuild(strvec_t *vec) {
+    unsigned num_slots = MIN_INDEX_SLOTS;
+    while (num_slots < 2 * vec->length) {
+        num_slots *= 2;
+    }
+    strvec_index_t *index = calloc(1, sizeof(strvec_index_t) + num_slots * sizeof(index_slot_t));
+    if (index == NULL) {
+        index_drop(vec);
+        return -1;
+    }
+    index->num_slots = num_slots;
+    for (unsigned i = 0; i < vec->length; i++) {
+        if (index_insert(vec, index, i) != 0) {
+            index_free(index);
+            index_drop(vec);
+            return -1;
+        }
+    }
+    index_free(vec->index);
+    vec->index = index;
+    return 0;
+}
+
+// index the element just appended at the end of the vector
+static void index_add(strvec_t *vec) {
+    strvec_index_t *index = vec->index;
+    if (index == NULL || (index->num_used + 1) * 4 > index->num_slots * 3) {  // keep probes short
+        index_rebuild(vec);
+    } else if (index_insert(vec, index, vec->length - 1) != 0) {
+        index_drop(vec);
+    }
+}
+
+int strvec_index(strvec_t *vec) {
+    vec->flags |= STRVEC_INDEXED;
+    return index_rebuild(vec);
+}
+
+void strvec_reset(strvec_t *vec) {
+    if (!(vec->flags & STRVEC_ARENA)) {
+        for (int i = 0; i < vec->length; i++) {
+            free_string(vec, vec->data[i]);
+        }
+    } else if (vec->arena != NULL && vec->arena->next != NULL) {
+        // arena had to grow: replace the blocks with one that fits everything next time
+        size_t total = 0;
+        for (strvec_chunk_t *chunk = vec->arena; chunk != NULL; chunk = chunk->next) {
+            total += chunk->size;
+        }
+        arena_free(vec);
+        vec->chunk_size = total;
+    } else if (vec->arena != NULL) {
+        vec->arena->used = 0;
+    }
+    vec->flags &= ~STRVEC_TAGGED;  // tags describe the old contents only
+    index_free(vec->index);        // rebuilt by the next add if still STRVEC_INDEXED
+    vec->index = NULL;
+    vec->inline_used = 0;
+    vec->length = 0;
+}
+
+void strvec_shrink(strvec_t *vec) {
+    if (vec->capacity == 0) {
+        return;
+    }
+    if ((vec->flags & STRVEC_ARENA) && vec->length == 0) {
+        arena_free(vec);
+        vec->chunk_size = vec->base_chunk_size;
+    }
+    if (vec->data == vec->inline_data) {
+        return;
+    }
+    if (vec->length <= STRVEC_INLINE_ELEMS) {
+        memcpy(vec->inline_data, vec->data, vec->length * sizeof(char *));
+        free(vec->data);
+        vec->data = vec->inline_data;
+        if (vec->tags != NULL) {
+            memcpy(vec->inline_tags, vec->tags, vec->length);
+            free(vec->tags);
+            vec->tags = vec->inline_tags;
+        }
+        vec->capacity = STRVEC_INLINE_ELEMS;
+    } else if (vec->length < vec->capacity) {
+        // a failed realloc just leaves an array larger than needed
+        char **new_data = realloc(vec->data, vec->length * sizeof(char *));
+        if (new_data == NULL) {
+            return;
+        }
+        vec->data = new_data;
+        if (vec->tags != NULL) {
+            unsigned char *new_tags = realloc(vec->tags, vec->length);
+            if (new_tags != NULL) {
+                vec->tags = new_tags;
+            }
+        }
+        vec->capacity = vec->length;
+    }
+}
+
 void strvec_clear(strvec_t *vec) {
     if (vec->capacity == 0) {
         return;
     }
-    for (int i = 0; i < vec->length; i++) {
-        free(vec->data[i]);
+    if (vec->flags & STRVEC_ARENA) {
+        arena_free(vec);
+    } else {
+        for (int i = 0; i < vec->length; i++) {
+            free_string(vec, vec->data[i]);
+        }
+    }
+    if (vec->data != vec->inline_data) {
+        free(vec->data);
+    }
+    if (vec->tags != vec->inline_tags) {
+        free(vec->tags);
     }
-    free(vec->data);
+    vec->tags = NULL;
+    vec->inline_used = 0;
+    vec->flags &= ~STRVEC_TAGGED;
+    index_drop(vec);
 
     vec->length = 0;
     vec->capacity = 0;
 }
 
-int strvec_add(strvec_t *vec, const char *s) {
-    // If vector was previously cleared, need to reinitialize
+// enlarge the underlying arrays, moving them out of the struct the first time
+static int grow(strvec_t *vec, unsigned capacity) {
+    char **new_data;
+    if (vec->data == vec->inline_data) {
+        if ((new_data = malloc(capacity * sizeof(char *))) != NULL) {
+            memcpy(new_data, vec->data, vec->length * sizeof(char *));
+        }
+    } else {
+        new_data = realloc(vec->data, capacity * sizeof(char *));
+    }
+    if (new_data == NULL) {
+        return -1;
+    }
+    vec->data = new_data;
+    if (vec->tags != NULL) {
+        unsigned char *new_tags;
+        if (vec->tags == vec->inline_tags) {
+            if ((new_tags = malloc(capacity)) != NULL) {
+                memcpy(new_tags, vec->tags, vec->length);
+            }
+        } else {
+            new_tags = realloc(vec->tags, capacity);
+        }
+        if (new_tags == NULL) {
+            return -1;
+        }
+        vec->tags = new_tags;
+    }
+    vec->capacity = capacity;
+    TRACE_MARK(TRACE_STRVEC_GROW, capacity);
+    return 0;
+}
+
+// the tags array for a vector that has none yet, sized like its data array
+static unsigned char *alloc_tags(strvec_t *vec) {
+    return (vec->data == vec->inline_data) ? vec->inline_tags : malloc(vec->capacity);
+}
+
+// make sure there is space for one more element, expanding the underlying arrays if needed
+static int make_room(strvec_t *vec) {
+    // If vector was previously cleared, need to reinitialize (in the same mode)
     if (vec->capacity == 0) {
+        unsigned int flags = vec->flags & STRVEC_ARENA;
+        size_t chunk_size = vec->chunk_size;
+        size_t base_chunk_size = vec->base_chunk_size;  // the size given at init, for strvec_shrink()
         if (strvec_init(vec) != 0) {
             return -1;
         }
+        vec->flags = flags;
+        vec->chunk_size = chunk_size;
+        vec->base_chunk_size = base_chunk_size;
     }
 
     if (vec->length == vec->capacity) {
-        // Expand underlying array
-        char **new_data = realloc(vec->data, 2* vec->capacity * sizeof(char *));
-        if (new_data == NULL) {
+        return grow(vec, 2 * vec->capacity);
+    }
+    return 0;
+}
+
+int strvec_add(strvec_t *vec, const char *s) {
+    if (make_room(vec) != 0) {
+        return -1;
+    }
+    if (vec->tags != NULL) {
+        vec->tags[vec->length] = 0;
+    }
+
+    if (vec->flags & STRVEC_ARENA) {
+        if ((vec->data[vec->length] = arena_strdup(vec, s)) == NULL) {
             return -1;
-        } else {
-            vec->data = new_data;
         }
-        vec->capacity = vec->capacity * 2;
+    } else {
+        size_t n = strlen(s) + 1;
+        if ((vec->data[vec->length] = inline_strdup(vec, s, n)) == NULL
+            && (vec->data[vec->length] = malloc(n * sizeof(char))) == NULL) {
+            return -1;
+        }
+        memcpy(vec->data[vec->length], s, n);
     }
+    vec->length++;
+    if (vec->flags & STRVEC_INDEXED) {
+        index_add(vec);
+    }
+    return 0;
+}
 
-    if ((vec->data[vec->length] = malloc((strlen(s) + 1) * sizeof(char))) == NULL) {
+int strvec_add_view(strvec_t *vec, char *s, unsigned char tag) {
+    if (!(vec->flags & STRVEC_ARENA)) {  // a regular vector would try to free 's' later
+        return -1;
+    }
+    if (make_room(vec) != 0) {
         return -1;
     }
-    strcpy(vec->data[vec->length], s);
+    if (vec->tags == NULL) {
+        if ((vec->tags = alloc_tags(vec)) == NULL) {
+            return -1;
+        }
+        memset(vec->tags, 0, vec->length);
+    }
+    vec->flags |= STRVEC_TAGGED;
+    vec->tags[vec->length] = tag;
+    vec->data[vec->length] = s;
     vec->length++;
+    if (vec->flags & STRVEC_INDEXED) {
+        index_add(vec);
+    }
     return 0;
 }
 
-char *strvec_get(const strvec_t *vec, unsigned i) {
-    if (i >= vec->length) {
-        return NULL;
-    }
+// the out-of-line copies of the functions defined inline in the header
+extern char *strvec_get(const strvec_t *vec, unsigned i);
+extern unsigned char strvec_get_tag(const strvec_t *vec, unsigned i);
+extern int strvec_find(const strvec_t *vec, const char *s);
 
-    return vec->data[i];
+int strvec_find_indexed(const strvec_t *vec, const char *s) {
+    index_slot_t *slot = index_lookup(vec, s, hash_string(s));
+    return (slot != NULL) ? (int) slot->positions[0] : -1;
 }
 
-int strvec_find(const strvec_t *vec, const char *s) {
-    for (int i = 0; i < vec->length; i++) {
+int strvec_find_last(const strvec_t *vec, const char *s) {
+    if (vec->index != NULL) {
+        index_slot_t *slot = index_lookup(vec, s, hash_string(s));
+        return (slot != NULL) ? (int) slot->positions[slot->count - 1] : -1;
+    }
+    for (int i = vec->length - 1; i >= 0; i--) {
         if (strcmp(vec->data[i], s) == 0) {
             return i;
         }
@@ -72,8 +449,26 @@ int strvec_find(const strvec_t *vec, const char *s) {
     return -1;
 }
 
-int strvec_find_last(const strvec_t *vec, const char *s) {
-    for (int i = vec->length - 1; i >= 0; i--) {
+int strvec_find_from(const strvec_t *vec, const char *s, unsigned start) {
+    if (vec->index != NULL) {
+        index_slot_t *slot = index_lookup(vec, s, hash_string(s));
+        if (slot == NULL) {
+            return -1;
+        }
+        // binary search for the first position >= start
+        unsigned lo = 0;
+        unsigned hi = slot->count;
+        while (lo < hi) {
+            unsigned mid = lo + (hi - lo) / 2;
+            if (slot->positions[mid] < start) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return (lo < slot->count) ? (int) slot->positions[lo] : -1;
+    }
+    for (unsigned i = start; i < vec->length; i++) {
         if (strcmp(vec->data[i], s) == 0) {
             return i;
         }
@@ -82,6 +477,10 @@ int strvec_find_last(const strvec_t *vec, const char *s) {
 }
 
 int strvec_num_occurrences(const strvec_t *vec, const char *s) {
+    if (vec->index != NULL) {
+        index_slot_t *slot = index_lookup(vec, s, hash_string(s));
+        return (slot != NULL) ? (int) slot->count : 0;
+    }
     int num_occurrences = 0;
     for (int i = 0; i < vec->length; i++) {
         if (strcmp(vec->data[i], s) == 0) {
@@ -96,8 +495,15 @@ void strvec_take(strvec_t *vec, unsigned n) {
         n = vec->length;
     }
 
-    for (int i = n; i < vec->length; i++) {
-        free(vec->data[i]);
+    // the removed elements hold the highest positions, so they end their lists
+    for (unsigned i = vec->length; vec->index != NULL && i > n; i--) {
+        index_slot_t *slot = index_lookup(vec, vec->data[i - 1], hash_string(vec->data[i - 1]));
+        slot->count--;  // a slot left with no positions is skipped by lookups and reused
+    }
+    if (!(vec->flags & STRVEC_ARENA)) {  // arena and inline strings are reclaimed on reset/clear
+        for (int i = n; i < vec->length; i++) {
+            free_string(vec, vec->data[i]);
+        }
     }
     vec->length = n;
 }
@@ -110,9 +516,40 @@ int strvec_slice(const strvec_t *src, strvec_t *dest, int start, int end) {
         end = src->length;
     }
 
+    if (src->flags & STRVEC_ARENA) {
+        // the strings already live in src's arena, so the slice can just point at them
+        if (strvec_init_arena(dest, src->chunk_size) != 0) {
+            return -1;
+        }
+        if (end > start) {
+            unsigned n = end - start;
+            if (n > dest->capacity && grow(dest, n) != 0) {
+                strvec_clear(dest);
+                return -1;
+            }
+            memcpy(dest->data, src->data + start, n * sizeof(char *));
+            if (src->flags & STRVEC_TAGGED) {
+                if ((dest->tags = alloc_tags(dest)) == NULL) {
+                    strvec_clear(dest);
+                    return -1;
+                }
+                memcpy(dest->tags, src->tags + start, n);
+                dest->flags |= STRVEC_TAGGED;
+            }
+            dest->length = n;
+        }
+        if (src->flags & STRVEC_INDEXED) {
+            strvec_index(dest);
+        }
+        return 0;
+    }
+
     if (strvec_init(dest) != 0) {
         return -1;
     }
+    if (src->flags & STRVEC_INDEXED) {
+        strvec_index(dest);
+    }
     for (int i = start; i < end; i++) {
         if (strvec_add(dest, strvec_get(src, i)) != 0) {
             return -1;
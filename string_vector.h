@@ -1,19 +1,87 @@
 #ifndef STRING_VECTOR_H
 #define STRING_VECTOR_H
 
+#include <stddef.h>
+#include <string.h>
+
+// strvec_t.flags: strings live in the vector's arena instead of individual allocations
+#define STRVEC_ARENA 0x1
+// strvec_t.flags: the tags array describes every element (set by strvec_add_view)
+#define STRVEC_TAGGED 0x2
+// strvec_t.flags: a hash index of the elements answers searches (set by strvec_index)
+#define STRVEC_INDEXED 0x4
+
+typedef struct strvec_chunk strvec_chunk_t;
+typedef struct strvec_index strvec_index_t;
+
+// elements a vector holds in its own struct before its arrays move to the heap
+#define STRVEC_INLINE_ELEMS 16
+// bytes of string storage in the struct, used for copied strings while they fit
+#define STRVEC_INLINE_BYTES 256
+
+/*
+ * strvec_get(), strvec_get_tag() and strvec_find() are defined here, inline,
+ * so that the loops calling them on every token can be compiled without a
+ * call per element (string_vector.c holds their external definitions).
+ */
+
+/*
+ * A vector starts out using the arrays and string space inside its own
+ * struct, so a short line needs no heap allocation at all. Since it may point
+ * into itself, a vector must not be copied or moved by value.
+ */
 typedef struct {
     unsigned int length;
     unsigned int capacity;
     char **data;
+    unsigned int flags;
+    unsigned char *tags;     // optional per-element tag, allocated by strvec_add_view
+    strvec_chunk_t *arena;   // arena blocks holding the strings, newest first (arena mode only)
+    size_t chunk_size;       // minimum size of a new arena block
+    size_t base_chunk_size;  // chunk_size given at init, restored by strvec_shrink()
+    strvec_index_t *index;   // string -> positions table, kept up to date while STRVEC_INDEXED is set
+    size_t inline_used;      // bytes of inline_chars in use
+    char *inline_data[STRVEC_INLINE_ELEMS];           // data, until it outgrows this
+    unsigned char inline_tags[STRVEC_INLINE_ELEMS];   // tags, for as long as data is inline
+    char inline_chars[STRVEC_INLINE_BYTES];           // the first strings copied in, in either mode
 } strvec_t;
 
 /*
- * Initializes a new, empty string vector
+ * Initializes a new, empty string vector. Nothing is allocated until it
+ * outgrows its inline storage.
  * vec: Pointer to the vector to initialize
  * Returns 0 on success, -1 on error
  */
 int strvec_init(strvec_t *vec);
 
+/*
+ * Initializes a new, empty string vector in arena mode. Strings added to the
+ * vector are bump-allocated from one contiguous buffer which is rewound by
+ * strvec_reset() rather than freed string by string.
+ * vec: Pointer to the vector to initialize
+ * arena_size: Initial size of the arena in bytes (0 selects a default). The
+ *             arena grows on demand if a line needs more.
+ * Returns 0 on success, -1 on error
+ */
+int strvec_init_arena(strvec_t *vec, size_t arena_size);
+
+/*
+ * Removes all entries from a string vector but keeps its memory for reuse
+ * In arena mode the arena is rewound (and merged into a single buffer if it
+ * had to grow), so refilling the vector with a similar line allocates nothing.
+ * vec: Pointer to the vector to reset
+ */
+void strvec_reset(strvec_t *vec);
+
+/*
+ * Gives back memory that a vector kept for reuse beyond what its current
+ * contents need: the pointer and tag arrays are cut down to its length (or
+ * moved back inline), and an empty arena vector's arena is released and
+ * returns to its initial size. The vector stays usable.
+ * vec: Pointer to the vector to shrink
+ */
+void strvec_shrink(strvec_t *vec);
+
 /*
  * Removes all entries from a string vector
  * The underlying memory for the vector is also freed
@@ -27,17 +95,62 @@ void strvec_clear(strvec_t *vec);
  * vec: Pointer to the vector to add to
  * s: The string to add
  * Returns 0 on success, -1 on error
- * Note: The vector stores its own copy of this string
+ * Note: The vector stores its own copy of this string (in its arena, for
+ * arena mode vectors)
  */
 int strvec_add(strvec_t *vec, const char *s);
 
+/*
+ * Add a string to an arena mode vector without copying it
+ * vec: Pointer to the vector to add to
+ * s: The string to add. It must stay valid (and unmodified) for as long as it
+ *    is referenced by the vector.
+ * tag: Caller-defined value stored alongside the element, see strvec_get_tag()
+ * Returns 0 on success, -1 on error (including if 'vec' is not in arena mode)
+ */
+int strvec_add_view(strvec_t *vec, char *s, unsigned char tag);
+
 /*
  * Retrieve an element from a string vector
  * vec: Pointer to the vector to retrieve from
  * i: Index of element to retrieve (starts at 0)
  * Returns the vector element (not a copy) on success, or NULL on error
  */
-char *strvec_get(const strvec_t *vec, unsigned i);
+inline char *strvec_get(const strvec_t *vec, unsigned i) {
+    if (i >= vec->length) {
+        return NULL;
+    }
+    return vec->data[i];
+}
+
+/*
+ * Retrieve the tag stored with an element by strvec_add_view()
+ * vec: Pointer to the vector to retrieve from
+ * i: Index of element (starts at 0)
+ * Returns the element's tag, or 0 if it has none or 'i' is out of range
+ */
+inline unsigned char strvec_get_tag(const strvec_t *vec, unsigned i) {
+    if (i >= vec->length || vec->tags == NULL) {
+        return 0;
+    }
+    return vec->tags[i];
+}
+
+/*
+ * Keep a hash index of a vector's elements, mapping each distinct string to
+ * the ascending list of positions it occurs at. strvec_find(),
+ * strvec_find_last() and strvec_num_occurrences() then take constant time and
+ * strvec_find_from() logarithmic time, instead of scanning the vector. The
+ * index is updated by strvec_add(), strvec_add_view() and strvec_take(),
+ * emptied by strvec_reset() and copied to slices. It costs a hash of every
+ * element added, so it only pays off for vectors searched many times.
+ * vec: Pointer to the vector to index
+ * Returns 0 on success or -1 on error (the vector is then searched by scanning)
+ */
+int strvec_index(strvec_t *vec);
+
+// strvec_find() for a vector with an index; not for use on its own
+int strvec_find_indexed(const strvec_t *vec, const char *s);
 
 /*
  * Search for a specific string within a string vector
@@ -45,7 +158,17 @@ char *strvec_get(const strvec_t *vec, unsigned i);
  * s: String to search for
  * Returns the index of the string within the vector if found, -1 if not found
  */
-int strvec_find(const strvec_t *vec, const char *s);
+inline int strvec_find(const strvec_t *vec, const char *s) {
+    if (vec->index != NULL) {
+        return strvec_find_indexed(vec, s);
+    }
+    for (unsigned i = 0; i < vec->length; i++) {
+        if (strcmp(vec->data[i], s) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 /*
  * Search for a specifc string within a string vector, starting from the end
@@ -55,6 +178,15 @@ int strvec_find(const strvec_t *vec, const char *s);
  */
 int strvec_find_last(const strvec_t *vec, const char *s);
 
+/*
+ * Search for a specific string within a string vector, starting at a given index
+ * vec: Pointer to the vector to search within
+ * s: String to search for
+ * start: Index to start searching from
+ * Returns the index of the first occurrence at or after 'start', -1 if not found
+ */
+int strvec_find_from(const strvec_t *vec, const char *s, unsigned start);
+
 /*
  * Determine the number of occurrences of a specific string within a vector
  * vec: Pointer to the vector to search for occurrences
@@ -73,6 +205,9 @@ void strvec_take(strvec_t *vec, unsigned n);
 /*
  * Construct a slice from a string vector. The slice is a new vector containing
  * copies of a sequence of consecutive elements from the original vector.
+ * If 'src' is an arena mode vector, the slice is an arena mode vector whose
+ * elements point into the arena of 'src' instead of being copied. Such a slice
+ * is only valid until 'src' is reset or cleared.
  * src: String vector to construct a slice from
  * dest: String vector data structure in which to store the slice. You do not
  *       need to initialize this vector beforehand.
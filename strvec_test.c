@@ -0,0 +1,177 @@
+/*
+ * Consistency check for the string vector's hash index. Applies a long,
+ * repeatable series of random additions, strvec_take()s, slices, resets and
+ * clears to indexed vectors (regular and arena mode), and after each one
+ * compares strvec_find(), strvec_find_last(), strvec_find_from() and
+ * strvec_num_occurrences() with a plain scan of the elements. Prints one
+ * summary line, or the first mismatch found.
+ * Usage: strvec_test [rounds]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_vector.h"
+
+#define NUM_WORDS 24     // a small vocabulary, so every string occurs many times
+#define MAX_LENGTH 300   // vectors are cut back once they get this long
+#define ARENA_SIZE 4096  // smaller than a full vector's strings, so arenas grow
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+// xorshift64: the same sequence on every run
+static unsigned next_random(unsigned bound) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned) (rng_state % bound);
+}
+
+// word i, or "missing" for NUM_WORDS (a string never added)
+static const char *word(unsigned i) {
+    static char words[NUM_WORDS + 1][16];
+    if (words[0][0] == '\0') {
+        for (unsigned j = 0; j < NUM_WORDS; j++) {
+            snprintf(words[j], sizeof(words[j]), "w%u", j);
+        }
+        strcpy(words[NUM_WORDS], "missing");
+    }
+    return words[i];
+}
+
+static int scan_from(const strvec_t *vec, const char *s, unsigned start) {
+    for (unsigned i = start; i < vec->length; i++) {
+        if (strcmp(vec->data[i], s) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int scan_last(const strvec_t *vec, const char *s) {
+    for (int i = vec->length - 1; i >= 0; i--) {
+        if (strcmp(vec->data[i], s) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int scan_count(const strvec_t *vec, const char *s) {
+    int count = 0;
+    for (unsigned i = 0; i < vec->length; i++) {
+        count += (strcmp(vec->data[i], s) == 0);
+    }
+    return count;
+}
+
+static unsigned long num_checks = 0;
+
+/*
+ * Compare every search on a vector with a scan
+ * vec: Vector to check
+ * what: Description of the vector and the last operation, for a mismatch
+ * round: Round number, for a mismatch
+ * Returns 0 if all agree or -1 (after reporting it) on the first mismatch
+ */
+static int check(const strvec_t *vec, const char *what, unsigned round) {
+    for (unsigned w = 0; w <= NUM_WORDS; w++) {
+        const char *s = word(w);
+        unsigned start = (vec->length > 0) ? next_random(vec->length + 1) : 0;
+        int got[4] = {strvec_find(vec, s), strvec_find_last(vec, s), strvec_find_from(vec, s, start),
+                      strvec_num_occurrences(vec, s)};
+        int want[4] = {scan_from(vec, s, 0), scan_last(vec, s), scan_from(vec, s, start), scan_count(vec, s)};
+        for (int k = 0; k < 4; k++) {
+            static const char *names[4] = {"find", "find_last", "find_from", "num_occurrences"};
+            num_checks++;
+            if (got[k] != want[k]) {
+                printf("Round %u, %s: %s(\"%s\") returned %d, expected %d (length %u, start %u)\n", round, what,
+                       names[k], s, got[k], want[k], vec->length, start);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Apply one random operation to an indexed vector, then check it and (for
+ * slices) the slice taken
+ * vec: The vector, in arena mode if 'arena' is set
+ * Returns 0 on success or -1 on a mismatch or error
+ */
+static int step(strvec_t *vec, int arena, unsigned round) {
+    const char *mode = arena ? "arena" : "regular";
+    char what[64];
+    unsigned op = next_random(100);
+    if (op < 70 || vec->length == 0) {
+        int ret = arena ? strvec_add_view(vec, (char *) word(next_random(NUM_WORDS)), 1)
+                        : strvec_add(vec, word(next_random(NUM_WORDS)));
+        if (ret != 0) {
+            printf("Round %u: adding to a %s vector failed\n", round, mode);
+            return -1;
+        }
+        snprintf(what, sizeof(what), "%s add", mode);
+    } else if (op < 85 || vec->length > MAX_LENGTH) {
+        strvec_take(vec, next_random(vec->length + 1));
+        snprintf(what, sizeof(what), "%s take", mode);
+    } else if (op < 95) {
+        strvec_t slice;
+        int start = next_random(vec->length);
+        int end = start + next_random(vec->length - start + 1);
+        if (strvec_slice(vec, &slice, start, end) != 0) {
+            printf("Round %u: slicing a %s vector failed\n", round, mode);
+            return -1;
+        }
+        snprintf(what, sizeof(what), "%s slice [%d, %d)", mode, start, end);
+        int ret = check(&slice, what, round);
+        strvec_clear(&slice);
+        if (ret != 0) {
+            return -1;
+        }
+        snprintf(what, sizeof(what), "%s vector after slicing", mode);
+    } else if (op < 98) {
+        strvec_reset(vec);
+        snprintf(what, sizeof(what), "%s reset", mode);
+    } else {
+        // start over with a fresh indexed vector
+        strvec_clear(vec);
+        if ((arena ? strvec_init_arena(vec, ARENA_SIZE) : strvec_init(vec)) != 0 || strvec_index(vec) != 0) {
+            printf("Round %u: reinitializing a %s vector failed\n", round, mode);
+            return -1;
+        }
+        snprintf(what, sizeof(what), "%s clear", mode);
+    }
+    return check(vec, what, round);
+}
+
+int main(int argc, char **argv) {
+    unsigned rounds = (argc > 1) ? (unsigned) atoi(argv[1]) : 20000;
+    strvec_t regular;
+    strvec_t arena;
+    if (strvec_init(&regular) != 0 || strvec_index(&regular) != 0 || strvec_init_arena(&arena, ARENA_SIZE) != 0
+        || strvec_index(&arena) != 0) {
+        printf("Error: Failed to set up indexed vectors\n");
+        return 1;
+    }
+    int ret_val = 0;
+    for (unsigned round = 0; round < rounds && ret_val == 0; round++) {
+        if (step(&regular, 0, round) != 0 || step(&arena, 1, round) != 0) {
+            ret_val = 1;
+        }
+    }
+
+    // a vector refilled after strvec_clear() without strvec_init() keeps its arena size
+    strvec_clear(&arena);
+    if (ret_val == 0 && (strvec_add(&arena, "again") != 0 || arena.base_chunk_size != ARENA_SIZE)) {
+        printf("Error: Arena size after clear is %zu, expected %d\n", arena.base_chunk_size, ARENA_SIZE);
+        ret_val = 1;
+    }
+    strvec_clear(&regular);
+    strvec_clear(&arena);
+    if (ret_val == 0) {
+        printf("%u rounds, %lu searches: indexed searches agree with scanning\n", rounds, num_checks);
+    }
+    return ret_val;
+}
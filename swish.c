@@ -1,47 +1,305 @@
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "cmd_hash.h"
+#include "jobs.h"
+#include "launch_pool.h"
+#include "line_reader.h"
+#include "server.h"
 #include "string_vector.h"
 #include "swish_funcs.h"
+#include "trace.h"
 
 #define CMD_LEN 512
+#define BATCH_BUF_SIZE (1 << 20)  // most read from stdin at once when reading commands from a pipe or file
+#define INTERACTIVE_BUF_SIZE 4096  // a terminal hands over one line per read() anyway
 #define PROMPT "@> "
+#define MAX_KEPT_TOKENS 4096  // token slots kept between lines; a longer line's are given back
+#define MAX_KEPT_ARENA (64 * 1024)  // likewise for bytes of token text
+#define TRACE_EVENTS (64 * 1024)  // events a SWISH_TRACE trace keeps, the latest ones
+
+/*
+ * The 'hash' builtin: with no arguments, list the command hash; with -r,
+ * empty it; otherwise look up and remember each named command
+ * tokens: Tokens of the command line, starting with "hash"
+ */
+static void builtin_hash(const strvec_t *tokens) {
+    if (tokens->length == 1) {
+        cmd_hash_print(stdout);
+        return;
+    }
+    for (unsigned i = 1; i < tokens->length; i++) {
+        const char *arg = strvec_get(tokens, i);
+        if (strcmp(arg, "-r") == 0) {
+            cmd_hash_clear();
+        } else if (cmd_hash_lookup(arg) == NULL) {
+            printf("hash: %s: not found\n", arg);
+        }
+    }
+}
+
+// whether a command line has any pipe in it, otherwise it is run as a single command;
+// one pass over the operator tags, so a quoted '|' is not mistaken for a pipe
+static int is_piped(const strvec_t *tokens) {
+    for (unsigned i = 0; i < tokens->length; i++) {
+        int kind = strvec_get_tag(tokens, i);
+        if (kind == TOK_PIPE || kind == TOK_REPLICATE || kind == TOK_REPLICATE_ORDERED) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The 'cd' builtin: change to the named directory, or to $HOME with no argument
+ * tokens: Tokens of the command line, starting with "cd"
+ */
+static void builtin_cd(const strvec_t *tokens) {
+    const char *dir = (tokens->length > 1) ? strvec_get(tokens, 1) : getenv("HOME");
+    if (dir == NULL) {
+        printf("cd: HOME not set\n");
+    } else if (chdir(dir) == -1) {
+        perror("chdir");
+    } else {
+        // programs found through a relative PATH entry such as "." are elsewhere now
+        cmd_hash_clear();
+    }
+}
+
+/*
+ * The 'wait' builtin: with no arguments, wait for every background job;
+ * otherwise wait for each job given by number ("1" or "%1")
+ * tokens: Tokens of the command line, starting with "wait"
+ */
+static void builtin_wait(const strvec_t *tokens) {
+    if (tokens->length == 1) {
+        jobs_wait(0);
+        return;
+    }
+    for (unsigned i = 1; i < tokens->length; i++) {
+        const char *arg = strvec_get(tokens, i);
+        const char *num = (arg[0] == '%') ? arg + 1 : arg;
+        char *end;
+        long id = strtol(num, &end, 10);
+        if (end == num || *end != '\0' || id < 1 || jobs_wait(id) != 0) {
+            printf("wait: %s: no such job\n", arg);
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-BFT] [-a none|compact|spread] [-C cache_dir] [-j jobs] [-l fork|spawn|vfork|pool] [-p size[,size...]] [-f script]\n"
+            "       %s -S socket\n"
+            "       %s [-T] -c socket command...\n", prog, prog, prog);
+}
+
+/*
+ * Join the words of a command line given as arguments, as for 'sh -c'
+ * argc: Number of words
+ * argv: The words
+ * Returns the line, to be freed by the caller, or NULL on error (already reported)
+ */
+static char *join_words(int argc, char **argv) {
+    size_t len = 1;
+    for (int i = 0; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+    char *line = malloc(len);
+    if (line == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return NULL;
+    }
+    line[0] = '\0';
+    for (int i = 0; i < argc; i++) {
+        if (i > 0) {
+            strcat(line, " ");
+        }
+        strcat(line, argv[i]);
+    }
+    return line;
+}
 
 int main(int argc, char **argv) {
-    strvec_t tokens;
-    strvec_init(&tokens);
-    char cmd[CMD_LEN];
+    if (pipeline_opts_from_env() != 0) {
+        return 1;
+    }
+    const char *script = NULL;
+    const char *serve_path = NULL;   // -S: run as a server on this socket
+    const char *client_path = NULL;  // -c: send the rest of the arguments to the server on this socket
+    int opt;
+    while ((opt = getopt(argc, argv, "+a:BC:c:f:Fj:l:p:S:T")) != -1) {
+        switch (opt) {
+        case 'a':
+            if (set_placement(optarg) != 0) {
+                return 1;
+            }
+            break;
+        case 'B':
+            pipeline_opts.builtin_filters = 1;
+            break;
+        case 'C':
+            pipeline_opts.cache_dir = optarg;
+            break;
+        case 'c':
+            client_path = optarg;
+            break;
+        case 'f':
+            script = optarg;
+            break;
+        case 'j':
+            if (jobs_set_limit(optarg) != 0) {
+                return 1;
+            }
+            break;
+        case 'l':
+            if (set_launcher(optarg) != 0) {
+                return 1;
+            }
+            break;
+        case 'p':
+            if (set_pipe_sizes(optarg) != 0) {
+                return 1;
+            }
+            break;
+        case 'F':
+            pipeline_opts.fail_fast = 1;
+            break;
+        case 'S':
+            serve_path = optarg;
+            break;
+        case 'T':
+            pipeline_opts.timing = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-    printf("%s", PROMPT);
-    while (fgets(cmd, CMD_LEN, stdin) != NULL) {
-        // Need to remove trailing '\n' from cmd. There are fancier ways.
-        int i = 0;
-        while (cmd[i] != '\n') {
-            i++;
+    if (client_path != NULL) {
+        if (optind == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        char *line = join_words(argc - optind, argv + optind);
+        if (line == NULL) {
+            return 1;
         }
-        cmd[i] = '\0';
+        int status = server_client(client_path, line, pipeline_opts.timing);
+        free(line);
+        return (status == 0) ? 0 : 1;
+    } else if (optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
 
-        if (tokenize(cmd, &tokens) != 0) {
-            printf("Failed to parse command\n");
-            strvec_clear(&tokens);
+    // before any child is started, so that all of them record into the trace
+    const char *trace_path = getenv("SWISH_TRACE");
+    int tracing = 0;  // nonzero once trace_start() has succeeded
+    if (trace_path != NULL && trace_path[0] != '\0') {
+        if (trace_start(TRACE_EVENTS) != 0) {
             return 1;
         }
-        if (tokens.length == 0) {
-            printf("%s", PROMPT);
-            continue;
+        tracing = 1;
+    }
+
+    // while the shell is still small; stages are forked as usual if this fails. Not for a server: a
+    // launcher's clones are children of the server, where a worker couldn't wait for them
+    if (pipeline_opts.launcher == LAUNCH_POOL && serve_path == NULL) {
+        launch_pool_start(0);
+    }
+
+    if (serve_path != NULL) {
+        int ret = server_run(serve_path);
+        if (tracing && trace_finish(trace_path) != 0) {
+            ret = -1;
+        }
+        return (ret == 0) ? 0 : 1;
+    }
+
+    // only prompt a person at a terminal; scripts and piped input run in batch mode
+    line_reader_t input;
+    int interactive = 0;
+    if (script != NULL) {
+        if (line_reader_open_file(&input, script) != 0) {
+            return 1;
         }
+    } else {
+        interactive = isatty(STDIN_FILENO);
+        if (line_reader_open_fd(&input, STDIN_FILENO, interactive ? INTERACTIVE_BUF_SIZE : BATCH_BUF_SIZE) != 0) {
+            return 1;
+        }
+    }
 
-        if (strcmp(strvec_get(&tokens, 0), "exit") == 0) {
-            strvec_clear(&tokens);
+    strvec_t tokens;
+    strvec_init_arena(&tokens, CMD_LEN);
+    char *cmd;
+
+    if (interactive) {
+        printf("%s", PROMPT);
+        fflush(stdout);  // commands are read with read(), which doesn't flush stdio like getline() would
+    }
+    while ((cmd = line_reader_next(&input)) != NULL) {
+        TRACE_BEGIN(TRACE_LINE);
+        TRACE_BEGIN(TRACE_TOKENIZE);
+        int parsed = tokenize_inplace(cmd, &tokens);  // tokens point into cmd, no copies
+        TRACE_END(TRACE_TOKENIZE, 0);
+        if (parsed != 0) {
+            printf("Failed to parse command\n");
+        }
+
+        else if (tokens.length == 0) {
+            // blank line, nothing to do
+        }
+
+        else if (strvec_get_tag(&tokens, tokens.length - 1) == TOK_BACKGROUND) {
+            strvec_take(&tokens, tokens.length - 1);
+            if (tokens.length == 0) {
+                printf("Error: Expected a command before '&'\n");
+            } else {
+                jobs_start(&tokens);
+            }
+        }
+
+        else if (strcmp(strvec_get(&tokens, 0), "exit") == 0) {
+            TRACE_END(TRACE_LINE, 0);
             break;
         }
 
-        else if (strvec_find(&tokens, "|") == -1) {
-            printf("Error: This simplified version of swish only supports piped commands\n");
+        else if (strcmp(strvec_get(&tokens, 0), "hash") == 0) {
+            builtin_hash(&tokens);
+        }
+
+        else if (strcmp(strvec_get(&tokens, 0), "cd") == 0) {
+            builtin_cd(&tokens);
+        }
+
+        else if (strcmp(strvec_get(&tokens, 0), "pwd") == 0) {
+            char cwd[PATH_MAX];
+            if (getcwd(cwd, sizeof(cwd)) == NULL) {
+                perror("getcwd");
+            } else {
+                printf("%s\n", cwd);
+            }
+        }
+
+        else if (strcmp(strvec_get(&tokens, 0), "jobs") == 0) {
+            jobs_print(stdout);
+        }
+
+        else if (strcmp(strvec_get(&tokens, 0), "wait") == 0) {
+            builtin_wait(&tokens);
+        }
+
+        else if (!is_piped(&tokens)) {
+            // a lone command needs no pipes, reaper or pumps
+            run_single_command(&tokens);
         }
 
         else {
@@ -49,9 +307,23 @@ int main(int argc, char **argv) {
             run_pipelined_commands(&tokens);
         }
 
-        strvec_clear(&tokens);
-        printf("%s", PROMPT);
+        strvec_reset(&tokens);  // keep the pointer array for the next line
+        if (tokens.capacity > MAX_KEPT_TOKENS || tokens.chunk_size > MAX_KEPT_ARENA) {
+            strvec_shrink(&tokens);  // don't hold on to what one unusually long line needed
+        }
+        TRACE_END(TRACE_LINE, 0);
+        if (interactive) {
+            printf("%s", PROMPT);
+            fflush(stdout);
+        }
     }
 
+    jobs_wait(0);  // a job file's last jobs still get to finish
+    strvec_clear(&tokens);
+    line_reader_close(&input);
+    cmd_hash_clear();
+    if (tracing && trace_finish(trace_path) != 0) {
+        return 1;
+    }
     return 0;
 }
@@ -1,257 +1,1969 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "cmd_hash.h"
+#include "filters.h"
+#include "input_map.h"
+#include "launch_pool.h"
+#include "placement.h"
+#include "pump.h"
+#include "reaper.h"
 #include "string_vector.h"
 #include "swish_funcs.h"
+#include "trace.h"
+#include "uring.h"
 
-#define MAX_ARGS 10
+extern char **environ;
+
+// shell operators, longest first so that ">>" is matched before ">"
+// tokenize_inplace() points operator tokens at these strings rather than into its input
+static struct {
+    char text[4];
+    unsigned char kind;
+} operators[] = {
+    {">>", TOK_APPEND},
+    {"||=", TOK_REPLICATE_ORDERED},
+    {"||", TOK_REPLICATE},
+    {"|", TOK_PIPE},
+    {"<", TOK_IN},
+    {">", TOK_OUT},
+    {"&", TOK_BACKGROUND},
+};
+#define NUM_OPERATORS (sizeof(operators) / sizeof(operators[0]))
+
+// returns the index in 'operators' of the operator that 's' starts with, or -1
+static int match_operator(const char *s) {
+    if (*s != '|' && *s != '<' && *s != '>' && *s != '&') {  // fast path for the common case of an ordinary character
+        return -1;
+    }
+    for (int i = 0; i < NUM_OPERATORS; i++) {
+        size_t len = strlen(operators[i].text);
+        if (strncmp(s, operators[i].text, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+int tokenize(char *s, strvec_t *tokens) {
+    for (char *tok = strtok(s, " "); tok != NULL; tok = strtok(NULL, " ")) {
+        if (strvec_add(tokens, tok) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int tokenize_inplace(char *s, strvec_t *tokens) {
+    char *r = s;  // next byte to read
+    while (1) {
+        while (is_blank(*r)) {
+            r++;
+        }
+        if (*r == '\0') {
+            return 0;
+        }
+        int op = match_operator(r);
+        if (op != -1) {
+            if (strvec_add_view(tokens, operators[op].text, operators[op].kind) != 0) {
+                return -1;
+            }
+            r += strlen(operators[op].text);
+            continue;
+        }
+
+        // a word: strip quotes and escapes by copying back over the input
+        char *start = r;
+        char *w = r;  // next byte to write, never ahead of r
+        while (*r != '\0' && !is_blank(*r) && match_operator(r) == -1) {
+            if (*r == '\'') {  // single quotes: everything up to the next quote is literal
+                r++;
+                while (*r != '\0' && *r != '\'') {
+                    *w++ = *r++;
+                }
+                if (*r == '\0') {
+                    fprintf(stderr, "Error: Unterminated quote\n");
+                    return -1;
+                }
+                r++;
+            } else if (*r == '"') {  // double quotes: only \" and \\ are escapes
+                r++;
+                while (*r != '\0' && *r != '"') {
+                    if (*r == '\\' && (r[1] == '"' || r[1] == '\\')) {
+                        r++;
+                    }
+                    *w++ = *r++;
+                }
+                if (*r == '\0') {
+                    fprintf(stderr, "Error: Unterminated quote\n");
+                    return -1;
+                }
+                r++;
+            } else if (*r == '\\' && r[1] != '\0') {  // backslash makes the next byte literal
+                r++;
+                *w++ = *r++;
+            } else {
+                *w++ = *r++;
+            }
+        }
+        // look at the delimiter before terminating the word, since w may equal r
+        int at_end = (*r == '\0');
+        op = at_end ? -1 : match_operator(r);
+        int kind = TOK_WORD;
+        if (r - start == 1 && *start == '{') {  // braces only group when unquoted and on their own, as in sh
+            kind = TOK_LBRACE;
+        } else if (r - start == 1 && *start == '}') {
+            kind = TOK_RBRACE;
+        }
+        *w = '\0';
+        if (strvec_add_view(tokens, start, kind) != 0) {
+            return -1;
+        }
+        if (at_end) {
+            return 0;
+        }
+        if (op != -1) {
+            if (strvec_add_view(tokens, operators[op].text, operators[op].kind) != 0) {
+                return -1;
+            }
+            r += strlen(operators[op].text);
+        } else {
+            r++;  // skip the blank that ended the word
+        }
+    }
+}
+
+// classify a token as one of the TOK_* kinds
+static int token_kind(const strvec_t *tokens, unsigned i) {
+    if (tokens->flags & STRVEC_TAGGED) {  // tokenized by tokenize_inplace(), quoted operators are words
+        return strvec_get_tag(tokens, i);
+    }
+    for (int j = 0; j < NUM_OPERATORS; j++) {
+        if (strcmp(tokens->data[i], operators[j].text) == 0) {
+            return operators[j].kind;
+        }
+    }
+    if (strcmp(tokens->data[i], "{") == 0) {
+        return TOK_LBRACE;
+    } else if (strcmp(tokens->data[i], "}") == 0) {
+        return TOK_RBRACE;
+    }
+    return TOK_WORD;
+}
+
+static char cat_name[] = "cat";
+
+static int is_redirect(int kind) {
+    return kind == TOK_IN || kind == TOK_OUT || kind == TOK_APPEND;
+}
+
+// any of the operators that end one stage and start the next
+static int is_pipe(int kind) {
+    return kind == TOK_PIPE || kind == TOK_REPLICATE || kind == TOK_REPLICATE_ORDERED;
+}
+
+/*
+ * Recognize a placement word ("@cpu:N", "@node:N" or "@nice:N") before a
+ * stage's command, recording it in the stage
+ * tok: The word
+ * stage: Stage it belongs to
+ * Returns 1 if the word was a placement, 0 if it is an ordinary word, or -1
+ * if it is a malformed placement (already reported)
+ */
+static int parse_placement(const char *tok, stage_t *stage) {
+    int *field;
+    long min, max;
+    if (strncmp(tok, "@cpu:", 5) == 0) {
+        field = &stage->cpu;
+        min = 0;
+        max = CPU_SETSIZE - 1;
+    } else if (strncmp(tok, "@node:", 6) == 0) {
+        field = &stage->node;
+        min = 0;
+        max = 63;
+    } else if (strncmp(tok, "@nice:", 6) == 0) {
+        field = &stage->nice;
+        min = -39;  // from the highest priority to the lowest
+        max = 39;
+    } else {
+        return 0;
+    }
+    const char *num = strchr(tok, ':') + 1;
+    char *end;
+    long val = strtol(num, &end, 10);
+    if (end == num || *end != '\0' || val < min || val > max) {
+        fprintf(stderr, "Error: Invalid placement '%s' (expected %ld to %ld)\n", tok, min, max);
+        return -1;
+    }
+    *field = val;
+    return 1;
+}
+
+/*
+ * Parse one level of a pipeline: stages up to the end of the tokens or the
+ * '}' closing the current branch, plus any fan-out branches after the last '|'
+ * tokens: Vector containing tokens input by user into shell
+ * pos: Index of the first token of this level, left at the '}' that ended it
+ *      (or at the end of the tokens)
+ * nested: Nonzero if parsing a branch, which must end in '}'
+ * pipeline: Pipeline structure to fill in, even on error so it can be freed
+ * argv_pool: Storage for every stage's argv array
+ * n: Next free slot in argv_pool
+ * Returns 0 on success or -1 on error
+ */
+static int parse_level(const strvec_t *tokens, unsigned *pos, int nested, pipeline_t *pipeline,
+                       char **argv_pool, unsigned *n) {
+    memset(pipeline, 0, sizeof(pipeline_t));
+    // first pass only counts this level's stages and branches so everything can be allocated up front
+    unsigned num_stages = 1;
+    unsigned num_branches = 0;
+    int depth = 0;
+    for (unsigned i = *pos; i < tokens->length; i++) {
+        int kind = token_kind(tokens, i);
+        if (kind == TOK_LBRACE) {
+            if (depth++ == 0) {
+                num_branches++;
+            }
+        } else if (kind == TOK_RBRACE) {
+            if (depth-- == 0) {
+                break;
+            }
+        } else if (is_pipe(kind) && depth == 0) {
+            num_stages++;
+        }
+    }
+    pipeline->stages = calloc(num_stages, sizeof(stage_t));
+    if (num_branches > 0) {
+        pipeline->branches = calloc(num_branches, sizeof(pipeline_t));
+    }
+    if (pipeline->stages == NULL || (num_branches > 0 && pipeline->branches == NULL)) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+
+    stage_t *stages = pipeline->stages;
+    for (unsigned j = 0; j < num_stages; j++) {  // filled in as placement words are found
+        stages[j].cpu = -1;
+        stages[j].node = -1;
+    }
+    unsigned cur = 0;  // index of the stage currently being filled in
+    int in_args = 1;  // arguments end at the first redirection, like run_command()
+    stages[0].argv = argv_pool + *n;
+    unsigned i;
+    for (i = *pos; i < tokens->length; i++) {
+        char *tok = tokens->data[i];
+        int kind = token_kind(tokens, i);
+        stage_t *stage = &stages[cur];
+        if (kind == TOK_RBRACE) {
+            if (!nested) {
+                fprintf(stderr, "Error: Unexpected '}'\n");
+                return -1;
+            }
+            break;
+        } else if (kind == TOK_LBRACE) {
+            if (cur == 0 || stage->argc != 0 || stage->in_file != NULL || stage->out_file != NULL
+                || stage->replicas != 0) {
+                fprintf(stderr, "Error: '{' must follow '|'\n");
+                return -1;
+            }
+            // fan-out: every group up to the end of this level is a branch
+            while (i < tokens->length && token_kind(tokens, i) == TOK_LBRACE) {
+                i++;
+                pipeline_t *branch = &pipeline->branches[pipeline->num_branches++];
+                if (parse_level(tokens, &i, 1, branch, argv_pool, n) != 0) {
+                    return -1;
+                }
+                i++;  // skip over the '}'
+            }
+            if (i < tokens->length && !(nested && token_kind(tokens, i) == TOK_RBRACE)) {
+                fprintf(stderr, "Error: Fan-out must end the pipeline\n");
+                return -1;
+            }
+            cur--;  // the branches took the place of the stage after the last '|'
+            break;
+        } else if (kind == TOK_BACKGROUND) {  // the shell strips a trailing '&' before parsing
+            fprintf(stderr, "Error: '&' must end the command\n");
+            return -1;
+        } else if (is_pipe(kind)) {
+            if (!nested && stage->argc == 0 && cur == 0 && stage->in_file != NULL && stage->out_file == NULL) {
+                // a leading "< FILE" stage just feeds the file into the pipeline, like "cat < FILE"
+                argv_pool[(*n)++] = cat_name;
+                stage->argc = 1;
+            }
+            if (stage->argc == 0) {
+                fprintf(stderr, "Error: Empty command in pipeline\n");
+                return -1;
+            }
+            argv_pool[(*n)++] = NULL;  // terminate this stage's argv, next stage starts right after
+            cur++;
+            stages[cur].argv = argv_pool + *n;
+            in_args = 1;
+            if (kind != TOK_PIPE) {  // "|| N": the next stage runs as N copies
+                char *end = NULL;
+                unsigned long copies = 0;
+                if (i + 1 < tokens->length && token_kind(tokens, i + 1) == TOK_WORD) {
+                    copies = strtoul(tokens->data[i + 1], &end, 10);
+                }
+                if (end == NULL || end == tokens->data[i + 1] || *end != '\0'
+                    || copies < 1 || copies > MAX_REPLICAS) {
+                    fprintf(stderr, "Error: Expected a number of copies (1-%d) after '%s'\n", MAX_REPLICAS, tok);
+                    return -1;
+                }
+                stages[cur].replicas = copies;
+                stages[cur].ordered = (kind == TOK_REPLICATE_ORDERED);
+                i++;  // skip over the count
+            }
+        } else if (is_redirect(kind)) {
+            if (i + 1 >= tokens->length || token_kind(tokens, i + 1) != TOK_WORD) {
+                fprintf(stderr, "Error: Missing file name after '%s'\n", tok);
+                return -1;
+            }
+            if (stage->replicas != 0) {  // the copies would all share one file
+                fprintf(stderr, "Error: A replicated stage can't redirect its input or output\n");
+                return -1;
+            }
+            char *target = tokens->data[i + 1];
+            if (kind == TOK_IN) {
+                if (stage->in_file == NULL) {  // first redirection wins, as in run_command()
+                    stage->in_file = target;
+                }
+            } else if (stage->out_file == NULL) {
+                stage->out_file = target;
+                stage->append = (kind == TOK_APPEND);
+            }
+            in_args = 0;
+            i++;  // skip over the file name
+        } else if (in_args) {
+            int placement = (stage->argc == 0 && tok[0] == '@') ? parse_placement(tok, stage) : 0;
+            if (placement == -1) {
+                return -1;
+            } else if (placement == 0) {
+                argv_pool[(*n)++] = tok;
+                stage->argc++;
+            }
+        }
+    }
+    if (nested && i >= tokens->length) {
+        fprintf(stderr, "Error: Missing '}'\n");
+        return -1;
+    }
+    if (pipeline->num_branches == 0) {  // with a fan-out the last stage was already terminated
+        if (stages[cur].argc == 0) {
+            fprintf(stderr, "Error: Empty command in pipeline\n");
+            return -1;
+        }
+        argv_pool[(*n)++] = NULL;
+    }
+    for (unsigned j = 0; j <= cur; j++) {
+        stages[j].pid = -1;
+        stages[j].in_open = -1;
+        stages[j].out_open = -1;
+    }
+    pipeline->num_stages = cur + 1;
+    *pos = i;
+    return 0;
+}
+
+int parse_pipeline(const strvec_t *tokens, pipeline_t *pipeline) {
+    unsigned num_stages = 1;
+    for (unsigned i = 0; i < tokens->length; i++) {
+        if (is_pipe(token_kind(tokens, i))) {
+            num_stages++;
+        }
+    }
+    // every token plus a NULL terminator per stage is an upper bound on argv storage
+    char **argv_pool = malloc((tokens->length + num_stages) * sizeof(char *));
+    if (argv_pool == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    unsigned pos = 0;
+    unsigned n = 0;  // next free slot in argv_pool
+    TRACE_BEGIN(TRACE_PARSE);
+    int ret_val = parse_level(tokens, &pos, 0, pipeline, argv_pool, &n);
+    TRACE_END(TRACE_PARSE, 0);
+    pipeline->argv_pool = argv_pool;
+    if (ret_val != 0) {
+        pipeline_free(pipeline);
+    }
+    return ret_val;
+}
+
+void pipeline_free(pipeline_t *pipeline) {
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        free(pipeline->stages[i].copies);
+    }
+    for (unsigned i = 0; i < pipeline->num_branches; i++) {
+        pipeline_free(&pipeline->branches[i]);
+    }
+    free(pipeline->branches);
+    free(pipeline->stages);
+    free(pipeline->argv_pool);
+    memset(pipeline, 0, sizeof(pipeline_t));
+}
+
+/*
+ * Report a failed system call like perror(), but using only write(2) so that
+ * it is safe to call from a vfork()ed child that shares the shell's memory
+ */
+static void child_error(const char *what) {
+    const char *msg = strerror(errno);
+    struct iovec iov[4] = {
+        {(void *) what, strlen(what)},
+        {": ", 2},
+        {(void *) msg, strlen(msg)},
+        {"\n", 1},
+    };
+    if (writev(STDERR_FILENO, iov, 4) == -1) {
+        return;  // nowhere left to report the error
+    }
+}
+
+/*
+ * Apply a stage's file redirections to this process's stdin and stdout
+ * This should be called within a CHILD process of the shell, and only makes
+ * async-signal-safe calls.
+ * stage: The stage whose redirections to apply
+ * Returns 0 on success or -1 on error (already reported)
+ */
+static int redirect_stage(const stage_t *stage) {
+    if (stage->in_file != NULL) {
+        int in_fd = open(stage->in_file, O_RDONLY);
+        if (in_fd == -1) {
+            child_error("Failed to open input file");
+            return -1;
+        }
+        if (dup2(in_fd, STDIN_FILENO) == -1) {
+            child_error("dup2");
+            close(in_fd);
+            return -1;
+        }
+        close(in_fd);
+    }
+    if (stage->out_file != NULL) {
+        int flags = O_WRONLY | O_CREAT | (stage->append ? O_APPEND : O_TRUNC);
+        int out_fd = open(stage->out_file, flags, S_IRUSR | S_IWUSR);
+        if (out_fd == -1) {
+            child_error("Failed to open output file");
+            return -1;
+        }
+        if (dup2(out_fd, STDOUT_FILENO) == -1) {
+            child_error("dup2");
+            close(out_fd);
+            return -1;
+        }
+        close(out_fd);
+    }
+    return 0;
+}
+
+// exec a stage's program, by its hashed path first if it has one; only returns on error
+static void exec_program(const stage_t *stage) {
+    TRACE_MARK(TRACE_EXEC, 0);
+    if (stage->path != NULL) {
+        execv(stage->path, stage->argv);
+        // the cached program may have moved, fall back to searching PATH
+    }
+    execvp(stage->argv[0], stage->argv);
+    child_error("exec");
+}
+
+/*
+ * Apply a stage's file redirections and exec its program
+ * This should be called within a CHILD process of the shell. Only
+ * async-signal-safe calls are made, so the child may come from vfork().
+ * stage: The stage to run
+ * Doesn't return on success (similar to exec) or returns -1 on error
+ */
+static int exec_stage(const stage_t *stage) {
+    TRACE_BEGIN(TRACE_DUP2);
+    int ret = redirect_stage(stage);
+    TRACE_END(TRACE_DUP2, 0);
+    if (ret == -1) {
+        return -1;
+    }
+    exec_program(stage);
+    return -1;
+}
+
+// make 'fd' the descriptor 'target', clearing close-on-exec (async-signal-safe)
+static int move_fd(int fd, int target) {
+    if (fd == target) {  // dup2() would leave the flag set
+        return fcntl(fd, F_SETFD, 0);
+    }
+    return dup2(fd, target);  // the original stays close-on-exec, so exec drops it
+}
+
+// redirect process input/output with dup2 to the appropriate pipe end (only if necessary)
+static int wire_pipes(int in_fd, int out_fd) {
+    if (in_fd != -1 && move_fd(in_fd, STDIN_FILENO) == -1) {
+        child_error("dup2");
+        return -1;
+    }
+    if (out_fd != -1 && move_fd(out_fd, STDOUT_FILENO) == -1) {
+        child_error("dup2");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Helper function to run a single command within a pipeline.
+ * stage: The parsed command to be executed, including its arguments and any
+ * file redirections.
+ * in_fd: Pipe end from which the program should read its input, or -1 if
+ *        input should not be read from a pipe.
+ * out_fd: Pipe end to which the program should write its output, or -1 if
+ *         output should not be written to a pipe.
+ * Every pipe end the shell holds is close-on-exec, so nothing needs closing
+ * here: only the two ends dup2()'d onto stdin and stdout survive the exec.
+ * Doesn't return on success (similar to exec) or returns -1 on error.
+ */
+int run_piped_command(const stage_t *stage, int in_fd, int out_fd) {
+    TRACE_BEGIN(TRACE_DUP2);
+    int ret = wire_pipes(in_fd, out_fd);
+    TRACE_END(TRACE_DUP2, 0);
+    if (ret == -1) {
+        return -1;
+    }
+    // apply file redirections and exec, only returns on error
+    exec_stage(stage);
+    return -1;
+}
+
+int run_command(strvec_t *tokens) {
+    // arguments end at the first redirection
+    int argc = tokens->length;
+    int in_idx = strvec_find(tokens, "<");
+    if (in_idx >= 0) {
+        if (in_idx + 1 >= (int) tokens->length) {
+            fprintf(stderr, "Error: Missing file name after '<'\n");
+            return -1;
+        }
+        int in_fd = open(strvec_get(tokens, in_idx + 1), O_RDONLY);
+        if (in_fd == -1) {
+            perror("Failed to open input file");
+            return -1;
+        }
+        if (dup2(in_fd, STDIN_FILENO) == -1) {
+            perror("dup2");
+            close(in_fd);
+            return -1;
+        }
+        close(in_fd);
+        argc = in_idx;
+    }
+    int append = 0;
+    int out_idx = strvec_find(tokens, ">");
+    if (out_idx == -1) {
+        out_idx = strvec_find(tokens, ">>");
+        append = (out_idx != -1);
+    }
+    if (out_idx >= 0) {
+        if (out_idx + 1 >= (int) tokens->length) {
+            fprintf(stderr, "Error: Missing file name after '%s'\n", append ? ">>" : ">");
+            return -1;
+        }
+        int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+        int out_fd = open(strvec_get(tokens, out_idx + 1), flags, S_IRUSR | S_IWUSR);
+        if (out_fd == -1) {
+            perror("Failed to open output file");
+            return -1;
+        }
+        if (dup2(out_fd, STDOUT_FILENO) == -1) {
+            perror("dup2");
+            close(out_fd);
+            return -1;
+        }
+        close(out_fd);
+        if (out_idx < argc) {
+            argc = out_idx;
+        }
+    }
+    if (argc == 0) {
+        fprintf(stderr, "Error: Missing command\n");
+        return -1;
+    }
+
+    char **argv = malloc((argc + 1) * sizeof(char *));
+    if (argv == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    for (int i = 0; i < argc; i++) {
+        argv[i] = strvec_get(tokens, i);
+    }
+    argv[argc] = NULL;
+    execvp(argv[0], argv);
+    perror("exec");
+    free(argv);
+    return -1;
+}
+
+// nonzero if a stage is to run as an in-shell filter rather than by exec
+static int uses_filter(const stage_t *stage) {
+    return pipeline_opts.builtin_filters && filter_known(stage->argv[0]);
+}
+
+/*
+ * Run the program of a copy whose filter turned out not to support its
+ * arguments: the program needs its share of the file on a descriptor, so it
+ * runs in a child of this one with a pipe in between that this process fills.
+ * This should be called within a CHILD process of the shell.
+ * stage: Copy given stage->in_data
+ * Returns the program's exit status, or -1 on error
+ */
+static int run_range_program(const stage_t *stage) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        if (move_fd(fds[0], STDIN_FILENO) == -1) {
+            child_error("dup2");
+            _exit(1);
+        }
+        exec_program(stage);
+        _exit(1);
+    }
+    close(fds[0]);
+    signal(SIGPIPE, SIG_IGN);  // the program need not read all of it
+    const char *data = stage->in_data;
+    size_t len = stage->in_len;
+    while (len > 0) {
+        ssize_t n = write(fds[1], data, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) {
+            break;  // EPIPE: the program is done with its input
+        }
+        data += n;
+        len -= n;
+    }
+    close(fds[1]);
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return -1;
+        }
+    }
+    if (WIFSIGNALED(status)) {
+        signal(WTERMSIG(status), SIG_DFL);
+        kill(getpid(), WTERMSIG(status));  // end the same way, so the shell reports it as usual
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/*
+ * Counterpart of run_piped_command() for a stage with an in-shell filter:
+ * after the same wiring, and closing every descriptor but stdin, stdout and
+ * stderr as exec would, the filter runs in this forked child, unless it
+ * doesn't support the stage's arguments and the program is exec'd after all.
+ * The child must come from fork(), not vfork().
+ * Arguments are as for run_piped_command().
+ * Returns the filter's exit status, or -1 on error
+ */
+static int run_piped_filter(const stage_t *stage, int in_fd, int out_fd) {
+    if (wire_pipes(in_fd, out_fd) == -1 || redirect_stage(stage) == -1) {
+        return -1;
+    }
+    // with no exec to close them, the other pipe ends would keep this
+    // child's own input from ever reaching end of file
+    if (close_range(STDERR_FILENO + 1, ~0U, 0) == -1) {
+        for (int fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX); fd++) {
+            close(fd);
+        }
+    }
+    if (stage->in_data != NULL) {
+        int status = filter_run_range(stage->argv, stage->in_data, stage->in_len);
+        return (status == -1) ? run_range_program(stage) : status;
+    }
+    int status = filter_run(stage->argv);
+    if (status == -1) {
+        exec_program(stage);
+    }
+    return status;
+}
+
+/*
+ * Report why posix_spawn() failed, which it doesn't say itself: it fails the
+ * same way whether a file action or the exec went wrong. The redirections are
+ * tried again here, in the order the child applies them, so that a file that
+ * can't be opened is reported as exec_stage() reports it.
+ * stage: The stage that failed to start
+ * err: Error number posix_spawn() returned
+ */
+static void report_spawn_error(const stage_t *stage, int err) {
+    if (stage->in_file != NULL) {
+        int fd = open(stage->in_file, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "Failed to open input file: %s\n", strerror(errno));
+            return;
+        }
+        close(fd);
+    }
+    if (stage->out_file != NULL) {
+        // no O_TRUNC: the child's open already truncated it if that part went through
+        int fd = open(stage->out_file, O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            fprintf(stderr, "Failed to open output file: %s\n", strerror(errno));
+            return;
+        }
+        close(fd);
+    }
+    fprintf(stderr, "%s: %s\n", stage->argv[0], strerror(err));
+}
+
+/*
+ * posix_spawn() equivalent of forking a child that calls run_piped_command():
+ * the same dup2s and file redirections are queued as file actions.
+ * Arguments are as for run_piped_command().
+ * pid: Set to the new child's process id on success
+ * Returns 0 on success or -1 on error (already reported)
+ */
+static int spawn_piped_command(stage_t *stage, int in_fd, int out_fd, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    int err = posix_spawn_file_actions_init(&actions);
+    // as in run_piped_command(), the pipe ends themselves are close-on-exec
+    if (err == 0 && in_fd != -1) {
+        err = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (err == 0 && out_fd != -1) {
+        err = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    // file redirections come after the pipes so that they take precedence, as in exec_stage()
+    if (err == 0 && stage->in_file != NULL) {
+        err = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, stage->in_file, O_RDONLY, 0);
+    }
+    if (err == 0 && stage->out_file != NULL) {
+        int flags = O_WRONLY | O_CREAT | (stage->append ? O_APPEND : O_TRUNC);
+        err = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, stage->out_file, flags, S_IRUSR | S_IWUSR);
+    }
+    if (err != 0) {
+        fprintf(stderr, "posix_spawn_file_actions: %s\n", strerror(err));
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    if (stage->path != NULL) {
+        err = posix_spawn(pid, stage->path, &actions, NULL, stage->argv, environ);
+        // ENOENT may also be from a redirection, only a program that is really gone is searched for again
+        if (err == ENOENT && access(stage->path, X_OK) != 0) {
+            stage->stale = 1;
+            stage->path = NULL;
+        }
+    }
+    if (stage->path == NULL) {
+        err = posix_spawnp(pid, stage->argv[0], &actions, NULL, stage->argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        report_spawn_error(stage, err);
+        return -1;
+    }
+    return 0;
+}
+
+pipeline_opts_t pipeline_opts = {
+    .launcher = LAUNCH_FORK,
+    .num_pipe_sizes = 0,
+    .fast_cat = 1,
+    .timing = 0,
+    .hash_commands = 1,
+    .fail_fast = 0,
+    .cache_dir = NULL,
+    .cache_limit = 64UL << 20,
+    .builtin_filters = 0,
+    .io_uring = 1,
+    .placement = PLACE_NONE,
+};
+
+/*
+ * Create the pipe that connects stage 'i' to stage 'i + 1'. Both ends are
+ * close-on-exec (children dup2() the ends they use onto stdin/stdout, which
+ * clears the flag), and the pipe is resized if a capacity was configured.
+ * fds: Where to store the read and write ends
+ * i: Index of the pipe within its pipeline
+ * Returns 0 on success or -1 on error
+ */
+static int create_pipe(int fds[2], int i) {
+    TRACE_BEGIN(TRACE_PIPE);
+    int ret = pipe2(fds, O_CLOEXEC);
+    TRACE_END(TRACE_PIPE, 0);
+    if (ret == -1) {
+        perror("pipe");
+        return -1;
+    }
+    if (pipeline_opts.num_pipe_sizes > 0) {
+        int last = pipeline_opts.num_pipe_sizes - 1;
+        unsigned long size = pipeline_opts.pipe_sizes[i < last ? i : last];
+        if (size > 0 && fcntl(fds[1], F_SETPIPE_SZ, (int) size) == -1) {
+            static int warned = 0;  // the pipe still works at its default size, so only say so once
+            if (!warned) {
+                perror("F_SETPIPE_SZ");
+                warned = 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static const char *launcher_names[] = {
+    [LAUNCH_FORK] = "fork",
+    [LAUNCH_SPAWN] = "spawn",
+    [LAUNCH_VFORK] = "vfork",
+    [LAUNCH_POOL] = "pool",
+};
+
+static const char *placement_names[] = {
+    [PLACE_NONE] = "none",
+    [PLACE_COMPACT] = "compact",
+    [PLACE_SPREAD] = "spread",
+};
+
+int set_launcher(const char *name) {
+    for (int i = 0; i < sizeof(launcher_names) / sizeof(launcher_names[0]); i++) {
+        if (strcmp(name, launcher_names[i]) == 0) {
+            pipeline_opts.launcher = i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: Unknown launcher '%s' (expected fork, spawn, vfork, or pool)\n", name);
+    return -1;
+}
+
+int set_placement(const char *name) {
+    for (int i = 0; i < sizeof(placement_names) / sizeof(placement_names[0]); i++) {
+        if (strcmp(name, placement_names[i]) == 0) {
+            pipeline_opts.placement = i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: Unknown placement '%s' (expected none, compact, or spread)\n", name);
+    return -1;
+}
+
+// parse a size in bytes with an optional K, M or G suffix, leaving 'end' after it
+static unsigned long parse_size(const char *s, char **end) {
+    unsigned long size = strtoul(s, end, 10);
+    if (*end == s) {
+        return 0;
+    }
+    if (**end == 'k' || **end == 'K') {
+        size <<= 10;
+        (*end)++;
+    } else if (**end == 'm' || **end == 'M') {
+        size <<= 20;
+        (*end)++;
+    } else if (**end == 'g' || **end == 'G') {
+        size <<= 30;
+        (*end)++;
+    }
+    return size;
+}
+
+int set_pipe_sizes(const char *spec) {
+    int n = 0;
+    const char *p = spec;
+    while (*p != '\0') {
+        if (n == MAX_PIPE_SIZES) {
+            fprintf(stderr, "Error: At most %d pipe sizes may be given\n", MAX_PIPE_SIZES);
+            return -1;
+        }
+        char *end;
+        unsigned long size = parse_size(p, &end);
+        if (end == p || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Error: Invalid pipe size list '%s'\n", spec);
+            return -1;
+        }
+        pipeline_opts.pipe_sizes[n++] = size;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    pipeline_opts.num_pipe_sizes = n;
+    return 0;
+}
+
+int set_cache_limit(const char *spec) {
+    char *end;
+    unsigned long size = parse_size(spec, &end);
+    if (end == spec || *end != '\0') {
+        fprintf(stderr, "Error: Invalid cache size '%s'\n", spec);
+        return -1;
+    }
+    pipeline_opts.cache_limit = size;
+    return 0;
+}
+
+int pipeline_opts_from_env(void) {
+    const char *val = getenv("SWISH_LAUNCHER");
+    if (val != NULL && set_launcher(val) != 0) {
+        return -1;
+    }
+    val = getenv("SWISH_PIPE_SIZE");
+    if (val != NULL && set_pipe_sizes(val) != 0) {
+        return -1;
+    }
+    val = getenv("SWISH_TIME");
+    if (val != NULL) {
+        pipeline_opts.timing = (strcmp(val, "0") != 0);
+    }
+    val = getenv("SWISH_HASH");
+    if (val != NULL) {
+        pipeline_opts.hash_commands = (strcmp(val, "0") != 0);
+    }
+    val = getenv("SWISH_FAIL_FAST");
+    if (val != NULL) {
+        pipeline_opts.fail_fast = (strcmp(val, "0") != 0);
+    }
+    val = getenv("SWISH_FAST_CAT");
+    if (val != NULL) {
+        pipeline_opts.fast_cat = (strcmp(val, "0") != 0);
+    }
+    val = getenv("SWISH_CACHE");
+    if (val != NULL && val[0] != '\0') {
+        pipeline_opts.cache_dir = val;
+    }
+    val = getenv("SWISH_BUILTINS");
+    if (val != NULL) {
+        pipeline_opts.builtin_filters = (strcmp(val, "0") != 0);
+    }
+    val = getenv("SWISH_URING");
+    if (val != NULL) {
+        pipeline_opts.io_uring = (strcmp(val, "0") != 0);
+    }
+    val = getenv("SWISH_AFFINITY");
+    if (val != NULL && set_placement(val) != 0) {
+        return -1;
+    }
+    val = getenv("SWISH_CACHE_SIZE");
+    if (val != NULL && set_cache_limit(val) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Determine whether a stage just copies one file to its output, i.e. it is
+ * "cat FILE" or "cat < FILE" with no output redirection
+ * stage: The stage to check
+ * Returns the name of the file the stage reads, or NULL if it does anything else
+ */
+static const char *plain_cat_source(const stage_t *stage) {
+    if (stage->out_file != NULL || strcmp(stage->argv[0], "cat") != 0) {
+        return NULL;
+    }
+    if (stage->argc == 1) {
+        return stage->in_file;
+    }
+    if (stage->argc == 2 && stage->in_file == NULL && stage->argv[1][0] != '-') {  // not an option, nor "-" for stdin
+        return stage->argv[1];
+    }
+    return NULL;
+}
+
+// milliseconds from 'a' to 'b'
+static double elapsed_ms(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static double timeval_ms(const struct timeval *tv) {
+    return tv->tv_sec * 1e3 + tv->tv_usec / 1e3;
+}
+
+// subtract the counters in 'b' from 'a' (ru_maxrss is a high-water mark, so it's kept)
+static void rusage_sub(struct rusage *a, const struct rusage *b) {
+    timersub(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+    timersub(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+    a->ru_nvcsw -= b->ru_nvcsw;
+    a->ru_nivcsw -= b->ru_nivcsw;
+}
+
+// running sums for report_times()
+typedef struct {
+    double user, sys;
+    long max_rss, nvcsw, nivcsw;
+} time_totals_t;
+
+static void report_row(const char *label, const stage_t *stage, time_totals_t *totals) {
+    const struct rusage *ru = &stage->usage;
+    fprintf(stderr, "%-8s %10.3f %10.3f %10.3f %10ld %8ld %8ld ",
+            label, elapsed_ms(&stage->start, &stage->end), timeval_ms(&ru->ru_utime),
+            timeval_ms(&ru->ru_stime), ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+    for (unsigned j = 0; j < stage->argc; j++) {
+        fprintf(stderr, " %s", stage->argv[j]);
+    }
+    fprintf(stderr, "%s\n", (stage->pid == -1) ? " (in shell)" : "");
+    totals->user += timeval_ms(&ru->ru_utime);
+    totals->sys += timeval_ms(&ru->ru_stime);
+    if (ru->ru_maxrss > totals->max_rss) {
+        totals->max_rss = ru->ru_maxrss;
+    }
+    totals->nvcsw += ru->ru_nvcsw;
+    totals->nivcsw += ru->ru_nivcsw;
+}
+
+// rows for one level of a pipeline, branch stages are labeled e.g. "b2.0" for stage 0 of branch 2
+static void report_level(const pipeline_t *pipeline, const char *prefix, time_totals_t *totals) {
+    char label[64];
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        const stage_t *stage = &pipeline->stages[i];
+        if (stage->copies == NULL) {
+            snprintf(label, sizeof(label), "%s%u", prefix, i);
+            report_row(label, stage, totals);
+        }
+        for (unsigned j = 0; stage->copies != NULL && j < stage->replicas; j++) {
+            snprintf(label, sizeof(label), "%s%u[%u]", prefix, i, j);  // one row per copy of a replicated stage
+            report_row(label, &stage->copies[j], totals);
+        }
+    }
+    for (unsigned i = 0; i < pipeline->num_branches; i++) {
+        snprintf(label, sizeof(label), "%sb%u.", prefix, i + 1);
+        report_level(&pipeline->branches[i], label, totals);
+    }
+}
 
 /*
- * Helper function to run a single command within a pipeline.
- * tokens: String vector containing the tokens representing the command to be
- * executed, possible redirection, and the command's arguments.
- * pipes: An array of pipe file descriptors.
- * n_pipes: Length of the 'pipes' array
- * in_idx: Index of the file descriptor in the array from which the program
- *         should read its input, or -1 if input should not be read from a pipe.
- * out_idx: Index of the file descriptor in the array to which the program
- *          should write its output, or -1 if output should not be written to
- *          a pipe.
- * Returns 0 on success or -1 on error.
+ * Print the wall time and resource usage of each stage of a finished
+ * pipeline, and totals for the whole pipeline, to stderr
+ * pipeline: The pipeline that ran
+ * start: When the pipeline was started
+ * pump: The shell's own copying for fan-outs and replicated stages when it
+ *       isn't already charged to a stage, or NULL
  */
-int run_piped_command(strvec_t *tokens, int *pipes, int n_pipes, int in_idx, int out_idx) {
-    // redirect process input/output with dup2 to the appropriate pipe end (only if necessary)
-    if (in_idx > -1) {  // only redirect STDIN if the command's input is supposed to be redirected
-        if (dup2(pipes[in_idx], STDIN_FILENO) == -1) {  // redirect command's standard input to read from the pipe instead
-            perror("dup2");
-            return -1;
+static void report_times(const pipeline_t *pipeline, const struct timespec *start, const stage_t *pump) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_totals_t totals = {0};
+    fprintf(stderr, "%-8s %10s %10s %10s %10s %8s %8s  %s\n",
+            "stage", "wall_ms", "user_ms", "sys_ms", "maxrss_kb", "vcsw", "ivcsw", "command");
+    report_level(pipeline, "", &totals);
+    if (pump != NULL) {
+        report_row("pumps", pump, &totals);
+    }
+    fprintf(stderr, "%-8s %10.3f %10.3f %10.3f %10ld %8ld %8ld\n",
+            "total", elapsed_ms(start, &end), totals.user, totals.sys, totals.max_rss,
+            totals.nvcsw, totals.nivcsw);
+}
+
+// state shared by every level of a pipeline while it is launched
+typedef struct {
+    pipeline_t *top;    // the whole pipeline, freed by a forked child that fails to exec
+    pump_set_t pumps;   // copying the shell does itself, run once everything is launched
+    reaper_t *reaper;   // watches every child started
+    int fork_failed;    // nonzero once fork() has failed, so no more stages are started
+    int fast_cat;       // nonzero if the first stage is being copied by the shell
+    unsigned num_started;  // stages launched so far, which gives the next one's placement slot
+} launch_t;
+
+/*
+ * Work out where a stage should run: its own "@cpu:"/"@node:" words, or
+ * else the placement policy's CPU for its slot, with memory from that CPU's
+ * node. The topology is read here if needed, before any fork.
+ * stage: The stage
+ * slot: Its position in launch order
+ * cpu: Set to the CPU for placement_apply(), or -1
+ * node: Set to the node for placement_apply(), or -1
+ * Returns nonzero if the child has anything to apply
+ */
+static int stage_placement(const stage_t *stage, unsigned slot, int *cpu, int *node) {
+    *cpu = stage->cpu;
+    *node = stage->node;
+    if (*cpu == -1 && *node == -1 && pipeline_opts.placement != PLACE_NONE) {
+        *cpu = placement_cpu(pipeline_opts.placement, slot);
+    }
+    if (*node == -1) {
+        *node = placement_node(*cpu);  // only on machines with several nodes
+    } else {
+        placement_node(-1);  // the child needs the node's CPUs
+    }
+    return *cpu != -1 || *node != -1 || stage->nice != 0;
+}
+
+static int launch_stage(stage_t *stage, int in_fd, int out_fd, launch_t *run);
+
+/*
+ * Start a stage whose redirection files the shell already opened: the files
+ * take the place of the pipe ends, just as they would override them in the
+ * child, and the stage is launched as if it had no redirections
+ * Arguments are as for launch_stage(). The opened files are closed afterwards.
+ */
+static int launch_opened(stage_t *stage, int in_fd, int out_fd, launch_t *run) {
+    const char *in_file = stage->in_file;
+    const char *out_file = stage->out_file;
+    int in_open = stage->in_open;
+    int out_open = stage->out_open;
+    if (in_open != -1) {
+        in_fd = in_open;
+        stage->in_file = NULL;
+    }
+    if (out_open != -1) {
+        out_fd = out_open;
+        stage->out_file = NULL;
+    }
+    stage->in_open = -1;
+    stage->out_open = -1;
+    int ret_val = launch_stage(stage, in_fd, out_fd, run);
+    stage->in_file = in_file;  // still wanted for reports and the result cache
+    stage->out_file = out_file;
+    if (in_open != -1) {
+        close(in_open);
+    }
+    if (out_open != -1) {
+        close(out_open);
+    }
+    return ret_val;
+}
+
+/*
+ * Start the process for one stage, with the hash lookup and start time recorded
+ * Arguments are as for run_piped_command().
+ * run: Launch state, whose reaper gets the new child. A failed fork() sets fork_failed.
+ * Returns 0 on success or -1 on error (already reported)
+ */
+static int launch_stage(stage_t *stage, int in_fd, int out_fd, launch_t *run) {
+    if (stage->in_open != -1 || stage->out_open != -1) {
+        return launch_opened(stage, in_fd, out_fd, run);
+    }
+    if (pipeline_opts.hash_commands) {
+        stage->path = cmd_hash_lookup(stage->argv[0]);  // NULL leaves the search to exec
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stage->start);
+    int filter = uses_filter(stage);  // needs a fork() of its own, whatever the launcher
+    int cpu, node;
+    // a placement is applied by the child itself before exec, so it needs a fork() (or vfork()) too
+    int placed = stage_placement(stage, run->num_started++, &cpu, &node);
+
+    TRACE_BEGIN(TRACE_FORK);
+    if (pipeline_opts.launcher == LAUNCH_POOL && !filter && !placed) {
+        int ret = launch_pool_submit(stage, in_fd, out_fd, run->reaper);  // the pid comes later
+        if (ret != 1) {
+            TRACE_END(TRACE_FORK, 0);
+            return ret;
         }
+        // no pool in this process (e.g. a background job), or too large a stage: fork it
     }
-    if (out_idx > -1) {  // only redirect STDOUT if the command's output is supposed to be redirected
-        if (dup2(pipes[out_idx], STDOUT_FILENO) == -1) {  // redirect command's standard output to write to the pipe instead
-            perror("dup2");
+
+    if (pipeline_opts.launcher == LAUNCH_SPAWN && !filter && !placed) {
+        int ret = spawn_piped_command(stage, in_fd, out_fd, &stage->pid);
+        TRACE_END(TRACE_FORK, stage->pid);
+        if (ret == -1) {
             return -1;
         }
+        reaper_add(run->reaper, stage->pid);
+        return 0;
     }
-    // run and execute the command, check for errors
-    if (run_command(tokens) == -1) {
-        printf("run_command error");
-        if (in_idx > -1) {
-            if (close(pipes[in_idx]) == -1) {
-                perror("close1111");
-            }
+
+    // fork (or vfork) a child process to call run_piped_command()
+    pid_t child_pid = (pipeline_opts.launcher == LAUNCH_VFORK && !filter) ? vfork() : fork();
+    if (child_pid != 0) {
+        TRACE_END(TRACE_FORK, child_pid);
+    }
+    if (child_pid == -1) {  // check for fork error, stop launching and reap what was started
+        perror("fork");
+        run->fork_failed = 1;
+        return -1;
+    } else if (child_pid == 0) {  // child process
+        if (placed && placement_apply(cpu, node, stage->nice) == -1) {
+            child_error("placement");  // the stage still runs, just not where it was asked to
         }
-        if (out_idx > -1) {
-            if (close(pipes[out_idx]) == -1) {
-                perror("close2222");
-            }
+        // stage was already parsed by the parent, just wire it up and exec (or filter)
+        int status = filter ? run_piped_filter(stage, in_fd, out_fd) : run_piped_command(stage, in_fd, out_fd);
+        if (pipeline_opts.launcher == LAUNCH_VFORK && !filter) {
+            _exit(1);  // memory is shared with the parent, so no cleanup and no stdio flushing
         }
-        return -1;
+        pump_set_free(&run->pumps);
+        pipeline_free(run->top);
+        // only reached if a filter ran or the command could not be run; not
+        // exit(), which would rewind the shell's buffered input and make it read lines again
+        fflush(stdout);
+        _exit(status == -1 ? 1 : status);
+    }  // end of child process
+    stage->pid = child_pid;
+    reaper_add(run->reaper, child_pid);
+    return 0;
+}
+
+/*
+ * Map the file a replicated stage reads and divide it between the copies on
+ * line boundaries, when every copy is to be an in-shell filter that can read
+ * its share in place. Contiguous shares in order suit both "||" and "||=".
+ * stage: Stage with replicas > 1
+ * in_fd: Descriptor the stage's input comes from
+ * num_copies: Number of copies
+ * map: Where to store the mapping, which the copies inherit
+ * Returns the num_copies + 1 offsets of the shares (to be freed), or NULL if
+ * the copies are to be fed through pipes instead
+ */
+static size_t *map_shares(const stage_t *stage, int in_fd, unsigned num_copies, input_map_t *map) {
+    if (!uses_filter(stage) || stage->in_file != NULL || in_fd == -1 || lseek(in_fd, 0, SEEK_CUR) != 0
+        || input_map_open(map, in_fd) == -1) {
+        return NULL;
+    }
+    size_t *shares = malloc((num_copies + 1) * sizeof(size_t));
+    if (shares == NULL) {
+        input_map_close(map);
+        return NULL;  // the pipes still work
     }
-    // close read/write of pipes we actually used
+    input_map_split(map->data, map->len, num_copies, shares);
+    return shares;
+}
+
+/*
+ * Start the copies of a replicated stage, each with a pipe of its own for input
+ * and one for output, and have the shell deal the stage's input out to them
+ * and merge what they write
+ * stage: Stage with replicas > 1. Its copies array is allocated here.
+ * in_fd: Descriptor the stage's input comes from
+ * out_fd: Descriptor the stage's output goes to, or -1 for the shell's stdout
+ * index: Index of the stage in its level, for sizing the new pipes
+ * run: Launch state
+ * Both descriptors belong to the shell's pumps (or are closed) afterwards.
+ * Returns 0 on success or -1 on error
+ */
+static int launch_copies(stage_t *stage, int in_fd, int out_fd, int index, launch_t *run) {
+    unsigned num_copies = stage->replicas;
     int ret_val = 0;
-    if (in_idx > -1) {
-        if (close(pipes[in_idx]) == -1) {
-            perror("close");
-            close(pipes[in_idx]);
-            ret_val = 1;
+    stage->copies = calloc(num_copies, sizeof(stage_t));
+    int *to_copies = malloc(2 * num_copies * sizeof(int));  // write ends of the copies' input pipes
+    if (stage->copies == NULL || to_copies == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        ret_val = -1;
+        num_copies = 0;
+    }
+    int *from_copies = to_copies + num_copies;  // read ends of their output pipes
+    input_map_t map;
+    size_t *shares = (num_copies > 0) ? map_shares(stage, in_fd, num_copies, &map) : NULL;
+    unsigned started = 0;
+    for (unsigned j = 0; j < num_copies && !run->fork_failed; j++) {
+        stage_t *copy = &stage->copies[j];
+        *copy = *stage;
+        copy->replicas = 0;
+        copy->copies = NULL;
+        copy->pid = -1;
+        int pipes[4] = {-1, -1, -1, -1};  // pipe 0 feeds the copy, pipe 1 carries what it writes
+        if (shares != NULL) {  // the copy reads its share of the file itself
+            copy->in_data = map.data + shares[j];
+            copy->in_len = shares[j + 1] - shares[j];
+        } else if (create_pipe(pipes, index - 1) == -1) {
+            ret_val = -1;
+            break;
+        }
+        if (create_pipe(pipes + 2, index) == -1) {
+            if (shares == NULL) {
+                close(pipes[0]);
+                close(pipes[1]);
+            }
+            ret_val = -1;
+            break;
+        }
+        if (launch_stage(copy, pipes[0], pipes[3], run) == -1) {
+            ret_val = -1;  // its pipes stay wired up, it just looks like a copy that quit at once
+        }
+        if (pipes[0] != -1) {
+            close(pipes[0]);
         }
+        close(pipes[3]);
+        to_copies[started] = pipes[1];
+        from_copies[started] = pipes[2];
+        started++;
     }
-    if (out_idx > -1) {
-        if (close(pipes[out_idx]) == -1) {
-            perror("close");
-            close(pipes[out_idx]);
-            ret_val = 1;
+    if (shares != NULL) {  // the copies have the file mapped now, the shell is done with it
+        input_map_close(&map);
+        free(shares);
+        if (started == 0) {
+            ret_val = -1;
         }
+    } else if (started > 0 && pump_add_split(&run->pumps, in_fd, to_copies, started, stage->ordered) == 0) {
+        in_fd = -1;  // the pump owns it and the input pipes now
+    } else {
+        for (unsigned j = 0; j < started; j++) {
+            close(to_copies[j]);
+        }
+        ret_val = -1;
+    }
+    if (started > 0 && pump_add_merge(&run->pumps, from_copies, started, out_fd, stage->ordered) == 0) {
+        out_fd = -1;
+    } else {
+        for (unsigned j = 0; j < started; j++) {
+            close(from_copies[j]);
+        }
+        ret_val = -1;
+    }
+    if (in_fd != -1) {
+        close(in_fd);
     }
+    if (out_fd != -1) {
+        close(out_fd);
+    }
+    free(to_copies);
     return ret_val;
 }
 
-// does most of the heavy lifting: processes tokens, forks children, closes most of the pipes, etc.
-int run_pipelined_commands(strvec_t *tokens) {
-    // count # pipes in tokens and allocate pipes array appropriately
-    int num_pipes = strvec_num_occurrences(tokens, "|");
-    int *pipe_fds = malloc(2 * sizeof(int) * num_pipes);  // allocate the pipes
-    if (pipe_fds == NULL) {  // error check malloc
-        fprintf(stderr, "malloc failed\n");
-        return -1;
-    }
-    // set up all pipes
-    for (int i = 0; i < num_pipes; i++) {
-        if (pipe(pipe_fds + (2 * i)) == -1) {
-            perror("pipe");
-            for (int j = 0; j < i; j++) {  // if error, close all created pipes
-                if (close(pipe_fds[2*j]) == -1) {
-                    free(pipe_fds);
-                    return -1;  // nested error
-                }
-                if (close(pipe_fds[2*j + 1]) == -1) {
-                    free(pipe_fds);
-                    return -1;  // nested error
-                }
+/*
+ * Start every stage of one level of a pipeline, and its branches. Pipe 'i' of
+ * the level connects stage 'i - 1' to stage 'i', and pipe 'num_stages' feeds
+ * the fan-out, if any. Stages start from the last one back, and each pipe is
+ * only created just before the stage reading from it, so the shell holds no
+ * more than two pipe ends of the level at any time, whatever its length. The
+ * level's pipes end up closed in the shell, apart from those handed to pumps.
+ * pipeline: Level to launch
+ * in_fd: Read end the first stage takes its input from, or -1 for the shell's
+ *        standard input. Always closed by the time this returns.
+ * run: Launch state
+ * Returns 0 on success or -1 on error. Stages that did start are added to
+ * run->reaper either way.
+ */
+static int launch_level(pipeline_t *pipeline, int in_fd, launch_t *run) {
+    int num_stages = pipeline->num_stages;
+    int ret_val = 0;
+    int out_fd = -1;  // write end the stage being started sends its output to, -1 for the shell's stdout
+
+    // branches are downstream of this level's stages, so they start first
+    if (pipeline->num_branches > 0) {
+        int fan_pipe[2];
+        int *fan_fds = malloc(pipeline->num_branches * sizeof(int));
+        if (fan_fds == NULL || create_pipe(fan_pipe, num_stages - 1) == -1) {
+            if (fan_fds == NULL) {
+                fprintf(stderr, "malloc failed\n");
+            }
+            free(fan_fds);
+            if (in_fd != -1) {
+                close(in_fd);
             }
-            free(pipe_fds);
             return -1;
         }
+        out_fd = fan_pipe[1];
+        int num_fan = 0;
+        for (unsigned b = 0; b < pipeline->num_branches; b++) {
+            int branch_pipe[2];
+            if (create_pipe(branch_pipe, num_stages) == -1) {
+                ret_val = -1;
+                break;
+            }
+            if (launch_level(&pipeline->branches[b], branch_pipe[0], run) == -1) {
+                ret_val = -1;
+            }
+            fan_fds[num_fan++] = branch_pipe[1];
+        }
+        if (num_fan == 0 || pump_add_fanout(&run->pumps, fan_pipe[0], fan_fds, num_fan) == -1) {
+            close(fan_pipe[0]);  // the pump owns it and the branch pipes otherwise
+            for (int b = 0; b < num_fan; b++) {
+                close(fan_fds[b]);
+            }
+        }
+        free(fan_fds);
+    }
+
+    // a leading "cat FILE" is done by the shell itself, feeding the file straight into the first pipe
+    int first_child = 0;  // index of the first stage that needs a process
+    int src_fd = -1;
+    const char *src = (run->top == pipeline && pipeline_opts.fast_cat
+                       && (num_stages > 1 || pipeline->num_branches > 0))
+                      ? plain_cat_source(&pipeline->stages[0]) : NULL;
+    if (src != NULL) {
+        first_child = 1;
+        run->fast_cat = 1;
+        src_fd = open(src, O_RDONLY | O_CLOEXEC);
+        if (src_fd == -1) {  // report it as cat would, the rest still runs with no input
+            fprintf(stderr, "cat: %s: %s\n", src, strerror(errno));
+            ret_val = -1;
+        }
     }
+
     // command forking loop
-    for (int i = num_pipes; i >= 0; i--) {  // loop "backwards" through the commands
-        // values to pass to run_piped_command()
-        int in_idx = 2 * (i - 1);  // index of the read end of the input pipe
-        int out_idx = (2 * (i + 1)) - 1;  // index of the write end of the output pipe
-
-        if (i == 0) {  // if first command, set in_idx = -1 to indicate that it shouldn't redirect its input
-            in_idx = -1;
-        } else if (i == num_pipes) {  // if last command, set out_idx = -1 to indicate that it shouldn't redirect its output
-            out_idx = -1;
-        }
-        // fork a child process to call run_piped_command()
-        pid_t child_pid = fork();
-        if (child_pid == -1) {  // check for fork error, cleanup
-            perror("fork");
-            for (int j = 0; j < num_pipes; j++) {
-                if (close(pipe_fds[2*j]) == -1) {
-                    exit(1); // nested error
-                }
-                if (close(pipe_fds[2*j + 1]) == -1) {
-                    exit(1); // nested error
-                }
+    int i;
+    for (i = num_stages - 1; i >= first_child && !run->fork_failed; i--) {  // loop "backwards" through the commands
+        stage_t *stage = &pipeline->stages[i];
+        int stage_in = in_fd;  // the first stage reads from the level's input
+        int prev_out = -1;  // write end left for stage i - 1
+        if (i == 1 && src != NULL && src_fd != -1 && stage->replicas > 1) {
+            stage_in = src_fd;  // splitting can read the file itself, no need to copy it into a pipe first
+            src_fd = -1;
+        } else if (i > 0) {
+            int pipe_fds[2];
+            if (create_pipe(pipe_fds, i - 1) == -1) {
+                ret_val = -1;
+                break;
             }
-            exit(1);  // exit process with error, should be noticed by the waiting parent
-        } else if (child_pid == 0) {  // child process
-            // close unused pipes and handle errors
-            for (int j = 0; j < num_pipes; j++) {  // close all but 2 pipe ends we need
-                if ((2 * j != in_idx) && close(pipe_fds[2 * j]) == -1) {
-                    perror("close");
-                    for (int k = 2 * j; k < 2 * num_pipes; k++) {  // make sure every pipe available is closed before child terminates
-                        if (close(pipe_fds[k]) == -1) {
-                            exit(1); // nested error
-                        }
-                    }
-                    exit(1);  // exit process with error, should be noticed by the waiting parent
-                }
-                if ((2 * j + 1) != out_idx && close(pipe_fds[2 * j + 1]) == -1) {
-                    perror("close");
-                    for (int k = 2 * j + 1; k < 2 * num_pipes; k++) {  // make sure every pipe available is closed before child terminates
-                        if (close(pipe_fds[k]) == -1) {
-                            exit(1); // nested error
-                        }
-                    }
-                    exit(1);  // exit process with error, should be noticed by the waiting parent
-                }
+            stage_in = pipe_fds[0];
+            prev_out = pipe_fds[1];
+        } else {
+            in_fd = -1;  // handed to stage 0
+        }
+        if (stage->replicas > 1) {  // the shell sits between the copies and the pipes on either side
+            if (launch_copies(stage, stage_in, out_fd, i, run) == -1) {  // takes both descriptors
+                ret_val = -1;
             }
-            // trim tokens, extract the command token, call run_piped_command
-            int tokenator = num_pipes;
-            int idx;
-            int end_target_token = tokens->length;  // exclusive right-bound of our target command token
-            while (tokenator > i) {  // each child starts with unique copy of the full tokens strvec, so we need to chop off the last (num_pipes - i) commands
-                if ((idx = strvec_find_last(tokens, "|")) == -1) {  // pipe char not found, there should be one if this loop was entered
-                    strvec_clear(tokens);
-                    if (in_idx > -1) {  // if input was redirected to a pipe, close that pipe
-                        if (close(pipe_fds[in_idx]) == -1) { 
-                            perror("close");
-                            // continue to close out_idx before exiting
-                        }
-                    }
-                    if (out_idx > -1) {  // if output was redirected to a pipe, close that pipe
-                        if (close(pipe_fds[out_idx]) == -1) { 
-                            perror("close");
-                        }
-                    }
-                    exit(1);  // exit process with error, should be noticed by the waiting parent 
-                }
-                end_target_token = idx;  // update end_target_token
-                strvec_take(tokens, end_target_token);  // chop off pipe character, its preceding space, and the last token
-                tokenator--;
-            }
-            int remaining = strvec_num_occurrences(tokens, "|");
-            if (remaining > 0) {  // not first command, still need to find beginning of target command from the last |
-                strvec_t command_token;
-                idx = strvec_find_last(tokens, "|");  // index of | preceding target command
-                idx++;
-                if (strvec_slice(tokens, &command_token, idx, end_target_token) == -1) {  // command_token = " <target_command>"
-                    strvec_clear(&command_token);
-                    if (in_idx > -1) {  // if input was redirected to a pipe, close that pipe
-                        if (close(pipe_fds[in_idx]) == -1) { 
-                            perror("close");
-                            // continue to close out_idx before exiting
-                        }
-                    }
-                    if (out_idx > -1) {  // if output was redirected to a pipe, close that pipe
-                        if (close(pipe_fds[out_idx]) == -1) { 
-                            perror("close");
-                        }
-                    }
-                    exit(1);  // exit process with error, should be noticed by the waiting parent 
-                }
-                if (run_piped_command(&command_token, pipe_fds, num_pipes, in_idx, out_idx) == -1) {  // send command_token off to be ran
-                    strvec_clear(&command_token);
-                    if (in_idx > -1) {  // if input was redirected to a pipe, close that pipe
-                        if (close(pipe_fds[in_idx]) == -1) { 
-                            perror("close");
-                            // continue to close out_idx before exiting
-                        }
-                    }
-                    if (out_idx > -1) {  // if output was redirected to a pipe, close that pipe
-                        if (close(pipe_fds[out_idx]) == -1) { 
-                            perror("close");
-                        }
-                    }
-                    exit(1);  // exit process with error, should be noticed by the waiting parent 
-                }
-                // piped command ran successfully
-                strvec_clear(&command_token);
-            } else {  // first token
-                if (run_piped_command(tokens, pipe_fds, num_pipes, in_idx, out_idx) == -1) {  // send first token off to be ran
-                    strvec_clear(tokens);
-                    if (in_idx > -1) {  // if input was redirected to a pipe, close that pipe
-                        if (close(pipe_fds[in_idx]) == -1) { 
-                            perror("close");
-                            // continue to close out_idx before exiting
-                        }
-                    }
-                    if (out_idx > -1) {  // if output was redirected to a pipe, close that pipe
-                        if (close(pipe_fds[out_idx]) == -1) { 
-                            perror("close");
-                        }
-                    }
-                    exit(1);  // exit process with error, should be noticed by the waiting parent 
-                }
+        } else {
+            if (launch_stage(stage, stage_in, out_fd, run) == -1) {
+                ret_val = -1;  // this stage failed to start, the rest of the pipeline still runs
             }
-            // relevant pipe ends closed after use in run_pipelined_command
-            exit(0);  // exit normally unless failed to close in_idx/out_idx
-        }  // end of child process
+            // close this stage's pipe ends in the parent ASAP
+            if (stage_in != -1) {
+                close(stage_in);
+            }
+            if (out_fd != -1) {
+                close(out_fd);
+            }
+        }
+        out_fd = prev_out;
     }  // end of command loop
 
-    // close all pipes in parent ASAP
-    for (int i = 0; i < 2 * num_pipes; i++) {
-        if (close(pipe_fds[i]) == -1) {
-            perror("close");
-            close(pipe_fds[i]);
-            free(pipe_fds);
+    if (i == 0 && src_fd != -1 && out_fd != -1) {  // everything but the cat stage started
+        if (pump_add_copy(&run->pumps, src_fd, out_fd) == 0) {
+            out_fd = -1;  // the pump owns it and the file now
+            src_fd = -1;
+        } else {
+            ret_val = -1;
+        }
+    }
+    // whatever wasn't handed on because launching stopped early
+    if (src_fd != -1) {
+        close(src_fd);
+    }
+    if (out_fd != -1) {
+        close(out_fd);
+    }
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    return ret_val;
+}
+
+// queue an open of one redirection file, whose descriptor will be stored in 'slot'
+static int queue_open(uring_t *ring, const char *path, int flags, int *slot) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->open_flags = flags | O_CLOEXEC;
+    sqe->len = S_IRUSR | S_IWUSR;
+    sqe->user_data = (uintptr_t) slot;
+    return 0;
+}
+
+// queue opens for the redirections of every stage in a level and its branches; returns how many
+static unsigned queue_redirects(pipeline_t *pipeline, uring_t *ring) {
+    unsigned queued = 0;
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        stage_t *stage = &pipeline->stages[i];
+        if (stage->replicas > 1) {
+            continue;  // every copy opens the files for itself
+        }
+        if (stage->in_file != NULL && queue_open(ring, stage->in_file, O_RDONLY, &stage->in_open) == 0) {
+            queued++;
+        }
+        int flags = O_WRONLY | O_CREAT | (stage->append ? O_APPEND : O_TRUNC);  // as in redirect_stage()
+        if (stage->out_file != NULL && queue_open(ring, stage->out_file, flags, &stage->out_open) == 0) {
+            queued++;
+        }
+    }
+    for (unsigned b = 0; b < pipeline->num_branches; b++) {
+        queued += queue_redirects(&pipeline->branches[b], ring);
+    }
+    return queued;
+}
+
+/*
+ * Open the redirection files of a whole pipeline with one io_uring submission,
+ * rather than one open() in each child. This is only a head start: a file that
+ * fails to open here (or doesn't fit in the ring) is left for the child to open,
+ * which then reports the error exactly as without the ring.
+ * pipeline: Pipeline whose stages' in_open and out_open to fill in
+ * ring: The shell's ring, with nothing in flight
+ */
+static void open_redirects(pipeline_t *pipeline, uring_t *ring) {
+    unsigned queued = queue_redirects(pipeline, ring);
+    while (queued > 0) {
+        if (uring_submit(ring, queued) == -1 && errno != EINTR) {
+            return;  // nothing was opened, so the children still will be
+        }
+        uint64_t slot;
+        int res;
+        while (uring_next_cqe(ring, &slot, &res)) {
+            *(int *) (uintptr_t) slot = (res >= 0) ? res : -1;
+            queued--;
+        }
+    }
+}
+
+// close any redirection files opened ahead for stages that never started
+static void close_redirects(pipeline_t *pipeline) {
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        stage_t *stage = &pipeline->stages[i];
+        if (stage->in_open != -1) {
+            close(stage->in_open);
+            stage->in_open = -1;
+        }
+        if (stage->out_open != -1) {
+            close(stage->out_open);
+            stage->out_open = -1;
+        }
+    }
+    for (unsigned b = 0; b < pipeline->num_branches; b++) {
+        close_redirects(&pipeline->branches[b]);
+    }
+}
+
+// the stage of a pipeline (or of one of its branches) run by process 'pid', or NULL
+static stage_t *find_stage(pipeline_t *pipeline, pid_t pid) {
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        stage_t *stage = &pipeline->stages[i];
+        if (stage->pid == pid) {
+            return stage;
+        }
+        for (unsigned j = 0; stage->copies != NULL && j < stage->replicas; j++) {
+            if (stage->copies[j].pid == pid) {
+                return &stage->copies[j];
+            }
+        }
+    }
+    for (unsigned i = 0; i < pipeline->num_branches; i++) {
+        stage_t *stage = find_stage(&pipeline->branches[i], pid);
+        if (stage != NULL) {
+            return stage;
+        }
+    }
+    return NULL;
+}
+
+// signal every process of a pipeline that is still running
+static void kill_rest(pipeline_t *pipeline, int sig) {
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        stage_t *stage = &pipeline->stages[i];
+        if (stage->pid > 0 && !stage->reaped) {
+            kill(stage->pid, sig);
+        }
+        for (unsigned j = 0; stage->copies != NULL && j < stage->replicas; j++) {
+            if (stage->copies[j].pid > 0 && !stage->copies[j].reaped) {
+                kill(stage->copies[j].pid, sig);
+            }
+        }
+    }
+    for (unsigned i = 0; i < pipeline->num_branches; i++) {
+        kill_rest(&pipeline->branches[i], sig);
+    }
+}
+
+// what the reaper callbacks need while a pipeline finishes
+typedef struct {
+    pipeline_t *pipeline;
+    reaper_t *reaper;
+    int failed;    // some stage exited with a nonzero status or was killed
+    int stopping;  // fail-fast mode has killed the rest of the pipeline
+} reap_state_t;
+
+// reaper callback: record how a stage ended, and stop the rest of the pipeline if it failed in fail-fast mode
+static void stage_exited(pid_t pid, int status, const struct rusage *usage, void *arg) {
+    reap_state_t *state = arg;
+    stage_t *stage = find_stage(state->pipeline, pid);
+    if (stage == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stage->end);
+    stage->usage = *usage;
+    stage->reaped = 1;
+    // a failed stage whose cached program is gone shouldn't use the cache again
+    if (stage->path != NULL && status != 0 && stage->path != stage->argv[0]
+        && access(stage->path, X_OK) != 0) {
+        stage->stale = 1;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return;
+    }
+    // dying of SIGPIPE only means a later stage finished early, which is how pipelines end
+    int broken_pipe = WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE;
+    if (!broken_pipe) {
+        state->failed = 1;
+    }
+    if (WIFSIGNALED(status) && !broken_pipe && !state->stopping) {  // report crashes and kills, as sh does
+        fprintf(stderr, "%s: %s%s\n", stage->argv[0], strsignal(WTERMSIG(status)),
+                WCOREDUMP(status) ? " (core dumped)" : "");
+    }
+    if (pipeline_opts.fail_fast && !broken_pipe && !state->stopping) {
+        state->stopping = 1;
+        kill_rest(state->pipeline, SIGTERM);
+    }
+}
+
+// pump watch callback: reap whichever children have exited so far
+static void reap_ready(void *arg) {
+    reap_state_t *state = arg;
+    reaper_collect(state->reaper, 0, stage_exited, state);
+}
+
+// programs whose only effect is their output (given none of the options below), so replaying it is the same as running them
+static const char *pure_filters[] = {"cat", "head", "tail", "tr", "wc", "sort", "grep", "cut", NULL};
+
+static int is_pure_filter(const stage_t *stage) {
+    unsigned i = 0;
+    while (pure_filters[i] != NULL && strcmp(stage->argv[0], pure_filters[i]) != 0) {
+        i++;
+    }
+    if (pure_filters[i] == NULL) {
+        return 0;
+    }
+    if (strcmp(stage->argv[0], "sort") == 0) {
+        for (unsigned j = 1; j < stage->argc; j++) {
+            const char *arg = stage->argv[j];
+            if (strncmp(arg, "--output", 8) == 0 || strncmp(arg, "--compress", 10) == 0
+                || (arg[0] == '-' && arg[1] != '-' && strchr(arg, 'o') != NULL)) {  // sort -o writes a file
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Drop the hash entries of every stage (and copy) of a level and its branches
+ * found stale. Only done once the whole pipeline has finished: other stages
+ * running the same command borrow the same path from the hash.
+ */
+static void forget_stale(const pipeline_t *pipeline) {
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        const stage_t *stage = &pipeline->stages[i];
+        for (unsigned j = 0; j < ((stage->copies != NULL) ? stage->replicas : 0); j++) {
+            if (stage->copies[j].stale) {
+                cmd_hash_forget(stage->copies[j].argv[0]);
+            }
+        }
+        if (stage->stale) {
+            cmd_hash_forget(stage->argv[0]);
+        }
+    }
+    for (unsigned i = 0; i < pipeline->num_branches; i++) {
+        forget_stale(&pipeline->branches[i]);
+    }
+}
+
+// whether any stage of a level (or its branches) could do more than produce output: run a program that
+// isn't a pure filter, or write to a file other than the top level's last stage's
+static int has_side_effects(const pipeline_t *pipeline, int top) {
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        const stage_t *stage = &pipeline->stages[i];
+        int last = top && i + 1 == pipeline->num_stages && pipeline->num_branches == 0;
+        if (!is_pure_filter(stage) || (stage->out_file != NULL && !last)) {
+            return 1;
+        }
+    }
+    for (unsigned i = 0; i < pipeline->num_branches; i++) {
+        if (has_side_effects(&pipeline->branches[i], 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// add every file a level (and its branches) might read to a cache key: those read through '<', and every
+// word naming an existing file, as an operand anywhere in the pipeline could ("sort - b.txt", "grep -f pats")
+static int add_input_files(const pipeline_t *pipeline, cache_key_t *key) {
+    for (unsigned i = 0; i < pipeline->num_stages; i++) {
+        const stage_t *stage = &pipeline->stages[i];
+        if (stage->in_file != NULL && cache_key_add_file(key, stage->in_file) == -1) {
             return -1;
         }
+        for (unsigned j = 1; j < stage->argc; j++) {
+            struct stat st;
+            if (stat(stage->argv[j], &st) == -1) {
+                continue;  // not a file (an option or a pattern), or one that's missing, which fails the run
+            }
+            if (cache_key_add_file(key, stage->argv[j]) == -1) {
+                return -1;  // a directory or device, whose contents the key can't follow
+            }
+        }
     }
-    
-    // wait for all children to finish, check their exit status for errors
-    int status;
-    int ret_val = 0;
-    for (int i = 0; i < (num_pipes + 1); i++) {
-        wait(&status);
-        if (WIFEXITED(status)) {  // check if exited normally
-            int child_ret_val = WEXITSTATUS(status);  // check the return value
-            if (child_ret_val != 0) {  // if child exited abnormally, return error
-                ret_val = -1;  // set ret_val to avoid redundant freeing and closing, which will happen next anyway
+    for (unsigned i = 0; i < pipeline->num_branches; i++) {
+        if (add_input_files(&pipeline->branches[i], key) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Build the result cache key for a pipeline: its tokens with their kinds (so
+ * a quoted '|' differs from a pipe), the working directory and PATH, and the
+ * identity of every file it reads
+ * pipeline: The parsed pipeline
+ * tokens: The tokens it was parsed from
+ * key: Initialized key to fill in
+ * Returns 0 on success or -1 if the pipeline's result can't be cached, because
+ * it reads the shell's stdin, runs a program other than a pure filter, writes
+ * files besides its final output or names a file the key can't follow
+ */
+static int pipeline_cache_key(const pipeline_t *pipeline, const strvec_t *tokens, cache_key_t *key) {
+    const stage_t *first = &pipeline->stages[0];
+    if ((first->in_file == NULL && plain_cat_source(first) == NULL) || has_side_effects(pipeline, 1)) {
+        return -1;
+    }
+    for (unsigned i = 0; i < tokens->length; i++) {
+        unsigned char tag = strvec_get_tag(tokens, i);
+        const char *tok = strvec_get(tokens, i);
+        if (cache_key_add(key, &tag, 1) == -1 || cache_key_add(key, tok, strlen(tok) + 1) == -1) {
+            return -1;
+        }
+    }
+    char cwd[PATH_MAX];
+    const char *path = getenv("PATH");
+    if (getcwd(cwd, sizeof(cwd)) == NULL || cache_key_add(key, cwd, strlen(cwd) + 1) == -1
+        || cache_key_add(key, path ? path : "", path ? strlen(path) + 1 : 1) == -1) {
+        return -1;
+    }
+    return add_input_files(pipeline, key);
+}
+
+/*
+ * Copy a pipeline's recorded or cached output to where it was meant to go
+ * fd: Descriptor holding the output
+ * len: Length of the output
+ * out_file: The last stage's output file, or NULL for stdout
+ * append: Nonzero if out_file is appended to
+ * Returns 0 on success or -1 on error
+ */
+static int deliver_output(int fd, off_t len, const char *out_file, int append) {
+    if (out_file == NULL) {
+        fflush(stdout);
+        return cache_copy(fd, len, STDOUT_FILENO);
+    }
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+    int out_fd = open(out_file, flags, S_IRUSR | S_IWUSR);  // the same as exec_stage()
+    if (out_fd == -1) {
+        fprintf(stderr, "Failed to open output file: %s\n", strerror(errno));
+        return -1;
+    }
+    int ret_val = cache_copy(fd, len, out_fd);
+    close(out_fd);
+    return ret_val;
+}
+
+// does most of the heavy lifting: parses tokens once, forks children, closes most of the pipes, etc.
+int run_pipelined_commands(strvec_t *tokens) {
+    // split tokens into stages once, children just index into the result
+    pipeline_t pipeline;
+    if (parse_pipeline(tokens, &pipeline) == -1) {
+        return -1;
+    }
+    reaper_t reaper;
+    if (reaper_init(&reaper) == -1) {
+        pipeline_free(&pipeline);
+        return -1;
+    }
+
+    // with a result cache, replay the saved output or record this run's: the shell's
+    // stdout points at the recording while the pipeline runs, so every child inherits it
+    cache_key_t key;
+    cache_key_init(&key);
+    int record_fd = -1;
+    char *record_path = NULL;
+    int saved_stdout = -1;
+    stage_t *last = &pipeline.stages[pipeline.num_stages - 1];
+    const char *out_file = last->out_file;
+    int append = last->append;
+    if (pipeline_opts.cache_dir != NULL && pipeline_cache_key(&pipeline, tokens, &key) == 0) {
+        off_t len;
+        int hit_fd = cache_lookup(pipeline_opts.cache_dir, &key, &len);
+        if (hit_fd != -1) {
+            int ret_val = deliver_output(hit_fd, len, out_file, append);
+            close(hit_fd);
+            cache_key_free(&key);
+            reaper_close(&reaper);
+            pipeline_free(&pipeline);
+            return ret_val;
+        }
+        record_fd = cache_create(pipeline_opts.cache_dir, &record_path);
+        fflush(stdout);
+        if (record_fd != -1 && ((saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3)) == -1
+                                || dup2(record_fd, STDOUT_FILENO) == -1)) {
+            perror("dup2");
+            if (saved_stdout != -1) {
+                close(saved_stdout);
             }
-        } else {  // child process terminated abnormally
-            ret_val = -1;  // set ret_val to avoid redundant freeing and closing, which will happen next anyway
+            cache_discard(record_fd, record_path);
+            record_fd = -1;
+        }
+        if (record_fd != -1) {
+            last->out_file = NULL;  // recorded like stdout, then delivered to the file
+        }
+    }
+
+    launch_t run = {.top = &pipeline, .reaper = &reaper, .fork_failed = 0, .fast_cat = 0, .num_started = 0};
+    pump_set_init(&run.pumps);
+    uring_t *ring = pipeline_opts.io_uring ? uring_shared() : NULL;
+    pump_set_use_uring(&run.pumps, ring);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ring != NULL) {
+        open_redirects(&pipeline, ring);
+    }
+    fflush(stdout);  // don't let children inherit (and later re-flush) buffered output
+    int ret_val = launch_level(&pipeline, -1, &run);
+    close_redirects(&pipeline);
+    if (launch_pool_finish(&reaper) == -1) {  // learn the pids of stages the pool started
+        ret_val = -1;
+    }
+    if (reaper_arm(&reaper) == -1) {
+        ret_val = -1;
+    }
+
+    // with everything started, the shell does its own share of the copying, reaping children as they exit
+    reap_state_t state = {.pipeline = &pipeline, .reaper = &reaper, .failed = 0, .stopping = 0};
+    if (ret_val == -1 && pipeline_opts.fail_fast) {  // some stage couldn't even start
+        state.stopping = 1;
+        kill_rest(&pipeline, SIGTERM);
+    }
+    pump_set_watch(&run.pumps, reaper_fd(&reaper), reap_ready, &state);
+    stage_t pump = {.argc = 0, .pid = -1};
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &pump.start);
+    int num_pumps = run.pumps.num_tasks;
+    TRACE_BEGIN(TRACE_PUMP);
+    if (pump_run(&run.pumps) == -1 && !state.stopping) {  // stopping early makes pumps fail too
+        ret_val = -1;
+    }
+    TRACE_END(TRACE_PUMP, 0);
+    pump_set_free(&run.pumps);
+    clock_gettime(CLOCK_MONOTONIC, &pump.end);
+    getrusage(RUSAGE_SELF, &pump.usage);
+    rusage_sub(&pump.usage, &before);
+    if (run.fast_cat) {  // charge the shell's own work during the copy to the cat stage
+        stage_t *stage = &pipeline.stages[0];
+        stage->start = pump.start;
+        stage->end = pump.end;
+        stage->usage = pump.usage;
+    }
+
+    // wait for the rest of the children to finish
+    TRACE_BEGIN(TRACE_WAIT);
+    while (reaper.num_left > 0) {
+        if (reaper_collect(&reaper, 1, stage_exited, &state) == -1) {
+            ret_val = -1;
+            break;
+        }
+    }
+    TRACE_END(TRACE_WAIT, 0);
+    reaper_close(&reaper);
+    if (state.failed) {
+        ret_val = -1;
+    }
+
+    if (record_fd != -1) {  // pass the output on, and keep it if the run succeeded
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        struct stat st;
+        if (fstat(record_fd, &st) == -1 || deliver_output(record_fd, st.st_size, out_file, append) == -1) {
+            ret_val = -1;
+        }
+        if (ret_val == 0) {
+            cache_commit(pipeline_opts.cache_dir, &key, record_fd, record_path, pipeline_opts.cache_limit);
+        } else {
+            cache_discard(record_fd, record_path);
         }
     }
+    cache_key_free(&key);
 
-    free(pipe_fds);  // free pipe array
+    if (pipeline_opts.timing) {
+        report_times(&pipeline, &start, (num_pumps > 0 && !run.fast_cat) ? &pump : NULL);
+    }
+    forget_stale(&pipeline);
+    pipeline_free(&pipeline);
     return ret_val;
 }
+
+int run_single_command(strvec_t *tokens) {
+    pipeline_t pipeline;  // parsed like a pipeline, so redirections follow the same rules
+    if (parse_pipeline(tokens, &pipeline) == -1) {
+        return -1;
+    }
+    stage_t *stage = &pipeline.stages[0];
+    if (pipeline_opts.hash_commands) {
+        stage->path = cmd_hash_lookup(stage->argv[0]);
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stage->start = start;
+    int cpu, node;
+    int placed = stage_placement(stage, 0, &cpu, &node);
+    fflush(stdout);  // don't let the child inherit (and later re-flush) buffered output
+    TRACE_BEGIN(TRACE_FORK);
+    pid_t child_pid = fork();
+    if (child_pid != 0) {
+        TRACE_END(TRACE_FORK, child_pid);
+    }
+    if (child_pid == -1) {
+        perror("fork");
+        pipeline_free(&pipeline);
+        return -1;
+    } else if (child_pid == 0) {
+        if (placed && placement_apply(cpu, node, stage->nice) == -1) {
+            child_error("placement");
+        }
+        // redirects and execs, only returns on error or once a filter has run
+        int status = uses_filter(stage) ? run_piped_filter(stage, -1, -1) : exec_stage(stage);
+        pipeline_free(&pipeline);
+        fflush(stdout);
+        _exit(status == -1 ? 1 : status);  // not exit(), see launch_stage()
+    }
+    stage->pid = child_pid;
+
+    int status;
+    TRACE_BEGIN(TRACE_WAIT);
+    while (wait4(child_pid, &status, 0, &stage->usage) == -1) {
+        if (errno != EINTR) {
+            perror("wait4");
+            TRACE_END(TRACE_WAIT, 0);
+            pipeline_free(&pipeline);
+            return -1;
+        }
+    }
+    TRACE_END(TRACE_WAIT, 0);
+    clock_gettime(CLOCK_MONOTONIC, &stage->end);
+    // a failed command whose cached program is gone shouldn't use the cache again
+    if (stage->path != NULL && status != 0 && stage->path != stage->argv[0]
+        && access(stage->path, X_OK) != 0) {
+        cmd_hash_forget(stage->argv[0]);
+    }
+    if (WIFSIGNALED(status) && WTERMSIG(status) != SIGPIPE) {  // report crashes and kills, as for a pipeline stage
+        fprintf(stderr, "%s: %s%s\n", stage->argv[0], strsignal(WTERMSIG(status)),
+                WCOREDUMP(status) ? " (core dumped)" : "");
+    }
+    if (pipeline_opts.timing) {
+        report_times(&pipeline, &start, NULL);
+    }
+    pipeline_free(&pipeline);
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
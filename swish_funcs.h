@@ -1,16 +1,99 @@
 #ifndef SWISH_FUNCS_H
 #define SWISH_FUNCS_H
 
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "placement.h"
+#include "string_vector.h"
+
+// Token tags recorded by tokenize_inplace(), see strvec_get_tag()
+enum {
+    TOK_WORD = 0,  // command name, argument, or file name (including quoted operators)
+    TOK_PIPE,      // |
+    TOK_IN,        // <
+    TOK_OUT,       // >
+    TOK_APPEND,    // >>
+    TOK_LBRACE,    // { starting a fan-out branch (only as a word of its own)
+    TOK_RBRACE,    // } ending a fan-out branch (only as a word of its own)
+    TOK_REPLICATE,         // ||, a pipe into a stage run as several copies
+    TOK_REPLICATE_ORDERED, // ||=, the same, keeping the output in input order
+    TOK_BACKGROUND,        // &, ending a command line that runs as a background job
+};
+
+#define MAX_REPLICAS 64  // most copies of one stage
+
+/*
+ * One command within a parsed pipeline. The argv and file name pointers refer
+ * to strings owned by the token vector the pipeline was parsed from, so the
+ * token vector must outlive the pipeline.
+ */
+typedef struct stage {
+    char **argv;           // NULL-terminated argument vector, ready for execvp
+    unsigned argc;         // number of entries in argv (excluding the NULL)
+    const char *in_file;   // file to redirect standard input from, or NULL
+    const char *out_file;  // file to redirect standard output to, or NULL
+    int append;            // nonzero if out_file should be appended to (">>")
+    unsigned replicas;     // copies to run with the input split between them ("|| N"), 0 for just one
+    int ordered;           // nonzero if the copies' output must keep the input's order ("||= N")
+    const char *path;      // program found for argv[0] by the command hash, or NULL to search PATH
+    int in_open;           // in_file already opened by the shell, or -1 for the child to open it
+    int out_open;          // out_file already opened by the shell, or -1
+    int cpu;               // CPU to run on, from "@cpu:N" or the placement policy, or -1
+    int node;              // NUMA node to take memory from (and run on) from "@node:N", or -1
+    int nice;              // niceness increment from "@nice:N", or 0
+    const char *in_data;   // share of a file the shell mapped, read by a copy in place of a pipe, or NULL
+    size_t in_len;         // length of in_data
+    // filled in while the pipeline runs
+    pid_t pid;             // process running the stage, or -1 if run by the shell itself
+    struct timespec start; // when the stage was launched
+    struct timespec end;   // when the stage finished
+    struct rusage usage;   // resources used by the stage
+    int reaped;            // nonzero once the process has been waited for
+    int stale;             // path turned out to be gone; the hash forgets it once the pipeline is done
+    struct stage *copies;  // the process for each copy if replicas > 1, the stage itself is unused
+} stage_t;
+
+/*
+ * A sequence of commands connected by pipes, optionally ending in a fan-out:
+ * "a | b | { c } { d | e }" copies the output of b to both the c and the
+ * "d | e" branches, each of which is a pipeline of its own.
+ */
+typedef struct pipeline {
+    unsigned num_stages;
+    stage_t *stages;
+    unsigned num_branches;     // pipelines fed a copy of the last stage's output, if any
+    struct pipeline *branches;
+    char **argv_pool;          // backing storage for every stage's argv array (top level only)
+} pipeline_t;
+
 /*
  * Divide a string with substrings separated by a single space (" ")
- * into tokens . These tokens should be stored in the 'tokens' vector using
+ * into tokens. These tokens should be stored in the 'tokens' vector using
  * "strvec_add".
  * s: String to tokenize
- * vec: Pointer to vector in which to store tokens
+ * tokens: Pointer to vector in which to store tokens
  * Returns 0 on success or -1 on error
  */
 int tokenize(char *s, strvec_t *tokens);
 
+/*
+ * Split a command line into tokens in place, without copying. Words are
+ * separated by any run of blanks, and the operators "|", "||", "||=", "<",
+ * ">", ">>" and "&" are recognized with or without surrounding blanks. Single quotes make
+ * everything up to the closing quote literal; inside double quotes only \"
+ * and \\ are escapes; elsewhere a backslash makes the next character literal.
+ * Quoting a word that looks like an operator (e.g. '|') keeps it a word.
+ * s: String to tokenize. It is modified (quotes are removed and NULs are
+ *    written between words) and the tokens point into it, so it must outlive
+ *    the tokens.
+ * tokens: Arena mode vector in which to store the tokens. Each token is tagged
+ *         with its TOK_* kind.
+ * Returns 0 on success or -1 on error (such as an unterminated quote)
+ */
+int tokenize_inplace(char *s, strvec_t *tokens);
+
 /*
  * Run a user-specified command (including arguments)
  * This should be called within a CHILD process of the shell
@@ -19,16 +102,165 @@ int tokenize(char *s, strvec_t *tokens);
  */
 int run_command(strvec_t *tokens);
 
+/*
+ * Run one parsed stage within a CHILD process of the shell: dup2() the given
+ * pipe ends onto stdin and stdout, apply the stage's file redirections and
+ * exec its program
+ * stage: The stage to run
+ * in_fd: Descriptor for standard input, or -1 to keep the current one
+ * out_fd: Descriptor for standard output, or -1 to keep the current one
+ * Doesn't return on success (similar to exec) or returns -1 on error
+ */
+int run_piped_command(const stage_t *stage, int in_fd, int out_fd);
+
+// How pipeline stages are started
+typedef enum {
+    LAUNCH_FORK = 0,  // fork(), then dup2() and exec in the child
+    LAUNCH_SPAWN,     // posix_spawnp() with file actions doing the same wiring
+    LAUNCH_VFORK,     // vfork(), the child only rewires fds and execs
+    LAUNCH_POOL,      // handed to pre-forked launcher processes (see launch_pool.h)
+} launcher_t;
+
+#define MAX_PIPE_SIZES 32
+
+// Tunables for run_pipelined_commands()
+typedef struct {
+    launcher_t launcher;
+    // capacity in bytes for each pipe of a pipeline (0 keeps the kernel default);
+    // pipes beyond the end of the list use the last entry
+    unsigned long pipe_sizes[MAX_PIPE_SIZES];
+    int num_pipe_sizes;
+    // nonzero to have the shell copy a leading "cat FILE" / "< FILE" stage into
+    // the first pipe itself with splice(), instead of running cat
+    int fast_cat;
+    // nonzero to print wall time and resource usage of every stage to stderr
+    int timing;
+    // nonzero to resolve command names through the shell's command hash
+    int hash_commands;
+    // nonzero to kill the rest of a pipeline (with SIGTERM) as soon as one stage
+    // fails, rather than letting the other stages run to completion
+    int fail_fast;
+    // directory of saved pipeline results to replay instead of rerunning a
+    // pipeline over unchanged input, or NULL to always run pipelines
+    const char *cache_dir;
+    unsigned long cache_limit;  // most bytes kept in cache_dir
+    // nonzero to run cat, head, tail, tr and wc stages with the shell's own
+    // versions in a forked child, without exec (see filters.h)
+    int builtin_filters;
+    // nonzero to use io_uring, where the kernel has it, to open a pipeline's
+    // redirection files in one batch and to wait on the shell's own copying
+    int io_uring;
+    // how stages without "@cpu:" or "@node:" are placed on CPUs (see placement.h)
+    place_policy_t placement;
+} pipeline_opts_t;
+
+extern pipeline_opts_t pipeline_opts;
+
+/*
+ * Select how pipeline stages are started
+ * name: One of "fork", "spawn", "vfork", or "pool"
+ * Returns 0 on success or -1 if the name is not recognized
+ */
+int set_launcher(const char *name);
+
+/*
+ * Select how pipeline stages are placed on CPUs
+ * name: One of "none", "compact", or "spread"
+ * Returns 0 on success or -1 if the name is not recognized
+ */
+int set_placement(const char *name);
+
+/*
+ * Set the capacity of the pipes connecting pipeline stages
+ * spec: Comma-separated list of sizes in bytes, each optionally suffixed by K
+ *       or M, e.g. "1M" for every pipe or "64K,1M" for a small first pipe
+ * Returns 0 on success or -1 if the list is malformed
+ */
+int set_pipe_sizes(const char *spec);
+
+/*
+ * Set the most disk space the result cache may use
+ * spec: Size in bytes, optionally suffixed by K, M or G
+ * Returns 0 on success or -1 if the size is malformed
+ */
+int set_cache_limit(const char *spec);
+
+/*
+ * Initialize pipeline_opts from the environment. Recognized variables:
+ *   SWISH_LAUNCHER: launcher name, as for set_launcher()
+ *   SWISH_PIPE_SIZE: pipe capacities, as for set_pipe_sizes()
+ *   SWISH_FAST_CAT: "0" to always run a leading cat as a separate process
+ *   SWISH_TIME: anything but "0" to report per-stage timing
+ *   SWISH_HASH: "0" to search PATH on every exec instead of using the command hash
+ *   SWISH_FAIL_FAST: anything but "0" to stop a pipeline when one stage fails
+ *   SWISH_CACHE: directory for the result cache, which is off unless this is set
+ *   SWISH_CACHE_SIZE: limit on the result cache, as for set_cache_limit()
+ *   SWISH_BUILTINS: anything but "0" to run common filters without exec
+ *   SWISH_URING: "0" to use poll() and per-child open() instead of io_uring
+ *   SWISH_AFFINITY: placement policy, as for set_placement()
+ * Returns 0 on success or -1 if a variable has an invalid value
+ */
+int pipeline_opts_from_env(void);
+
+/*
+ * Split a vector of tokens into the stages of a pipeline. Performs one pass
+ * over the tokens, separating stages at each "|" and recording any "<", ">",
+ * or ">>" redirections for each stage. A first stage consisting only of
+ * "< FILE" is treated as "cat < FILE". After the last "|", one or more
+ * "{ ... }" groups make a fan-out, each group being parsed as a pipeline of
+ * its own (groups can themselves end in a fan-out). "|| N" or "||= N" in
+ * place of a "|" marks the next stage to be run as N copies. Words
+ * "@cpu:N", "@node:N" and "@nice:N" before a stage's command set where and
+ * at what priority it runs.
+ * tokens: Vector containing tokens input by user into shell
+ * pipeline: Pipeline structure to fill in. Release with pipeline_free().
+ * Returns 0 on success or -1 on error (malformed pipeline or out of memory)
+ */
+int parse_pipeline(const strvec_t *tokens, pipeline_t *pipeline);
+
+/*
+ * Release the memory held by a pipeline produced by parse_pipeline()
+ * pipeline: Pipeline to free
+ */
+void pipeline_free(pipeline_t *pipeline);
+
 /*
  * Run a sequence of commands in a shell pipeline. For each program 'i' in the
  * sequence, standard input is consumed from the output of program 'i-1' while
  * standard output is sent as the standard input of program 'i+1'. The
  * exceptions are the first program, which does not have a predecessor program
  * from which to consume output, and the last program, which does not have a
- * successor program to which to send output.
+ * successor program to which to send output. If the pipeline ends in a
+ * fan-out, the shell copies the last program's output to every branch itself
+ * (with tee(2) and splice(2)), so the producer runs only once. A stage
+ * marked "|| N" runs as N processes: the shell deals its input out to them in
+ * chunks of whole lines and merges their output, which with "||= N" is kept
+ * in input order by giving each copy one contiguous part of the input.
+ * Children are reaped as they exit; a stage that is killed by a signal other
+ * than SIGPIPE is reported, and in fail-fast mode the first failure kills the
+ * rest of the pipeline. With a result cache, a pipeline whose input comes only
+ * from files (by "<" or a leading "cat FILE"), whose stages are all pure
+ * filters (cat, head, tail, tr, wc, sort without -o, grep and cut) and whose
+ * output only goes to stdout or the last stage's ">"/">>" file has its output
+ * saved once it succeeds; the same tokens over the same unchanged files
+ * (every file named anywhere in the pipeline) later replay that output
+ * without running anything.
  * tokens: Vector containing tokens input by user into shell.
  * Returns 0 on success or -1 on error.
  */
 int run_pipelined_commands(strvec_t *tokens);
 
+/*
+ * Run a command line without any pipes: fork a single child that applies the
+ * redirections and execs, and wait for it. The redirections follow the same
+ * rules as run_command() (and parse_pipeline()), but with no limit on the
+ * number of arguments. Nothing else is set up, so this is cheaper than a
+ * one-stage pipeline. A child killed by a
+ * signal other than SIGPIPE is reported, and -T timing is printed as for a
+ * pipeline.
+ * tokens: Vector containing tokens input by user into shell
+ * Returns 0 if the command exited with status 0, or -1 otherwise
+ */
+int run_single_command(strvec_t *tokens);
+
 #endif // SWISH_FUNCS_H
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct trace_buf {
+    uint64_t next;          // records claimed so far, by every process
+    uint32_t mask;          // capacity - 1
+    pid_t owner;            // the process that writes the trace out
+    struct timespec start;
+    size_t size;            // of the mapping
+    trace_record_t records[];
+};
+
+trace_buf_t *trace_buf = NULL;
+
+static const char *event_names[TRACE_NUM_EVENTS] = {
+    [TRACE_LINE] = "line",
+    [TRACE_TOKENIZE] = "tokenize",
+    [TRACE_PARSE] = "parse",
+    [TRACE_PIPE] = "pipe",
+    [TRACE_FORK] = "fork",
+    [TRACE_DUP2] = "dup2",
+    [TRACE_EXEC] = "exec",
+    [TRACE_PUMP] = "pump",
+    [TRACE_WAIT] = "wait",
+    [TRACE_STRVEC_GROW] = "strvec_grow",
+};
+
+// what each event's arg means, NULL if it has none
+static const char *arg_names[TRACE_NUM_EVENTS] = {
+    [TRACE_FORK] = "pid",
+    [TRACE_STRVEC_GROW] = "capacity",
+};
+
+int trace_start(unsigned num_events) {
+    unsigned capacity = 1;
+    while (capacity < num_events) {
+        capacity <<= 1;
+    }
+    size_t size = sizeof(trace_buf_t) + capacity * sizeof(trace_record_t);
+    // shared, so that every child forked from here on records into the same ring
+    trace_buf_t *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    buf->next = 0;
+    buf->mask = capacity - 1;
+    buf->owner = getpid();
+    buf->size = size;
+    clock_gettime(CLOCK_MONOTONIC, &buf->start);
+    trace_buf = buf;
+    return 0;
+}
+
+void trace_record(trace_event_t event, char phase, int64_t arg) {
+    trace_buf_t *buf = trace_buf;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);  // from the vDSO, no system call
+    uint64_t i = __atomic_fetch_add(&buf->next, 1, __ATOMIC_RELAXED);
+    trace_record_t *rec = &buf->records[i & buf->mask];
+    rec->ns = (now.tv_sec - buf->start.tv_sec) * 1000000000ULL + now.tv_nsec - buf->start.tv_nsec;
+    rec->arg = arg;
+    rec->pid = getpid();  // not cached: a vfork()ed child shares our memory
+    rec->event = event;
+    rec->phase = phase;
+}
+
+// a record and its place in the ring, so that records with the same time keep the order they were claimed in
+typedef struct {
+    trace_record_t rec;
+    uint64_t seq;
+} sorted_record_t;
+
+static int compare_records(const void *a, const void *b) {
+    const sorted_record_t *x = a;
+    const sorted_record_t *y = b;
+    if (x->rec.ns != y->rec.ns) {
+        return (x->rec.ns < y->rec.ns) ? -1 : 1;
+    }
+    return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+int trace_finish(const char *path) {
+    trace_buf_t *buf = trace_buf;
+    if (buf == NULL || buf->owner != getpid()) {
+        return 0;
+    }
+    trace_buf = NULL;
+    uint64_t end = __atomic_load_n(&buf->next, __ATOMIC_ACQUIRE);
+    uint64_t capacity = (uint64_t) buf->mask + 1;
+    uint64_t first = (end > capacity) ? end - capacity : 0;  // older ones were overwritten
+    size_t n = end - first;
+    sorted_record_t *sorted = malloc((n > 0 ? n : 1) * sizeof(sorted_record_t));
+    if (sorted == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        munmap(buf, buf->size);
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        sorted[i].rec = buf->records[(first + i) & buf->mask];
+        sorted[i].seq = first + i;
+    }
+    munmap(buf, buf->size);
+    qsort(sorted, n, sizeof(sorted_record_t), compare_records);
+
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        free(sorted);
+        return -1;
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        const trace_record_t *rec = &sorted[i].rec;
+        if (rec->phase == '\0' || rec->event >= TRACE_NUM_EVENTS) {
+            continue;  // claimed by a process that exited (or was killed) before filling it in
+        }
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d",
+                (written++ > 0) ? "," : "", event_names[rec->event], rec->phase,
+                (unsigned long long) (rec->ns / 1000), (unsigned long long) (rec->ns % 1000), rec->pid, rec->pid);
+        if (rec->phase == 'i') {
+            fprintf(out, ",\"s\":\"t\"");  // an instant scoped to its process's track
+        }
+        if (arg_names[rec->event] != NULL && rec->phase != 'B') {
+            fprintf(out, ",\"args\":{\"%s\":%lld}", arg_names[rec->event], (long long) rec->arg);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n]}\n");
+    free(sorted);
+    if (fclose(out) == EOF) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Tracing of the shell's own hot path: tokenizing, parsing, pipe creation,
+ * fork, the child's dup2()s, exec and waiting. Events go into a ring buffer
+ * mapped shared before any child is started, so the children (including
+ * vfork()ed ones, launchers and background jobs) record into the same
+ * buffer, and the whole pipeline ends up on one timeline. The shell that set
+ * the buffer up writes it out as Chrome trace JSON when it exits, for
+ * chrome://tracing or Perfetto; once the ring is full the oldest events are
+ * overwritten.
+ *
+ * A trace point costs one predictable branch while tracing is off, and
+ * nothing when built with -DSWISH_NO_TRACE ('make TRACE=0').
+ */
+
+typedef enum {
+    TRACE_LINE = 0,     // one command line, from reading it to running it
+    TRACE_TOKENIZE,
+    TRACE_PARSE,        // splitting tokens into stages
+    TRACE_PIPE,         // creating one pipe
+    TRACE_FORK,         // in the parent, whichever launcher is used; arg is the pid
+    TRACE_DUP2,         // in the child, wiring pipes and opening redirections
+    TRACE_EXEC,         // instant, in the child just before exec
+    TRACE_PUMP,         // the shell's own copying
+    TRACE_WAIT,         // waiting for the stages still running
+    TRACE_STRVEC_GROW,  // instant; arg is the new capacity
+    TRACE_NUM_EVENTS
+} trace_event_t;
+
+// one recorded event, 24 bytes
+typedef struct {
+    uint64_t ns;     // since tracing started, CLOCK_MONOTONIC
+    int64_t arg;
+    int32_t pid;
+    uint16_t event;  // a trace_event_t
+    char phase;      // 'B'egin, 'E'nd or 'i'nstant, as in the Chrome format
+} trace_record_t;
+
+typedef struct trace_buf trace_buf_t;
+
+extern trace_buf_t *trace_buf;  // the shared buffer, NULL while tracing is off
+
+/*
+ * Start tracing. This should be called before the shell starts any child
+ * that should be traced (in particular, before the launch pool).
+ * num_events: Capacity of the ring, rounded up to a power of two
+ * Returns 0 on success or -1 on error (already reported)
+ */
+int trace_start(unsigned num_events);
+
+/*
+ * Write the events recorded so far as Chrome trace JSON, oldest first, and
+ * stop tracing. Only the process that called trace_start() writes anything.
+ * path: File to write
+ * Returns 0 on success or -1 on error (already reported)
+ */
+int trace_finish(const char *path);
+
+/*
+ * Record an event; use the TRACE_* macros rather than calling this directly.
+ * Only makes async-signal-safe calls, so it may be used after vfork().
+ * event: What happened
+ * phase: 'B', 'E' or 'i'
+ * arg: Value shown with the event, or 0
+ */
+void trace_record(trace_event_t event, char phase, int64_t arg);
+
+#ifdef SWISH_NO_TRACE
+#define TRACE_BEGIN(event) ((void) 0)
+#define TRACE_END(event, arg) ((void) 0)
+#define TRACE_MARK(event, arg) ((void) 0)
+#else
+#define TRACE_BEGIN(event)                            \
+    do {                                              \
+        if (__builtin_expect(trace_buf != NULL, 0)) { \
+            trace_record((event), 'B', 0);            \
+        }                                             \
+    } while (0)
+#define TRACE_END(event, arg)                         \
+    do {                                              \
+        if (__builtin_expect(trace_buf != NULL, 0)) { \
+            trace_record((event), 'E', (arg));        \
+        }                                             \
+    } while (0)
+#define TRACE_MARK(event, arg)                        \
+    do {                                              \
+        if (__builtin_expect(trace_buf != NULL, 0)) { \
+            trace_record((event), 'i', (arg));        \
+        }                                             \
+    } while (0)
+#endif
+
+#endif // TRACE_H
@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define SHARED_ENTRIES 256
+
+int uring_init(uring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);  // close-on-exec already
+    if (ring->fd == -1) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_NODROP)) {  // before 5.5 a full completion queue loses events
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    ring->entries = p.sq_entries;
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_ktail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    ring->sq_tail = *ring->sq_ktail;
+    return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_tail - head >= ring->entries) {
+        return NULL;
+    }
+    unsigned i = ring->sq_tail & *ring->sq_mask;
+    ring->sq_array[i] = i;  // slots are used in order, so the indirection is the identity
+    ring->sq_tail++;
+    ring->queued++;
+    memset(&ring->sqes[i], 0, sizeof(struct io_uring_sqe));
+    return &ring->sqes[i];
+}
+
+int uring_submit(uring_t *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    long n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait_nr, flags, NULL, 0);
+    if (n == -1) {
+        if (errno != EINTR) {  // the kernel took none of them, and won't later either
+            ring->sq_tail -= ring->queued;
+            ring->queued = 0;
+            __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+        }
+        return -1;
+    }
+    ring->queued -= (n < ring->queued) ? n : ring->queued;  // any left are taken by the next call
+    return 0;
+}
+
+int uring_next_cqe(uring_t *ring, uint64_t *user_data, int *res) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void uring_free(uring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+uring_t *uring_shared(void) {
+    static uring_t ring;
+    static pid_t owner = 0;     // process the ring was set up by, 0 if none
+    static int unavailable = 0;
+    pid_t self = getpid();
+    if (owner == self) {
+        return &ring;
+    } else if (unavailable) {
+        return NULL;
+    }
+    if (owner != 0) {  // a forked child: unmap the parent's ring before making its own
+        munmap(ring.sqes, ring.sqes_size);
+        if (ring.cq_ring != ring.sq_ring) {
+            munmap(ring.cq_ring, ring.cq_ring_size);
+        }
+        munmap(ring.sq_ring, ring.sq_ring_size);
+        owner = 0;  // the descriptor is left alone: it is close-on-exec, and may be reused by now
+    }
+    if (uring_init(&ring, SHARED_ENTRIES) == -1) {
+        unavailable = 1;  // no io_uring (ENOSYS) or not allowed to use it (EPERM)
+        return NULL;
+    }
+    owner = self;
+    return &ring;
+}
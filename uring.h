@@ -0,0 +1,86 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A minimal io_uring, set up and driven with the raw system calls (there is
+ * no liburing dependency). The shell uses one to wait on all of its pumps'
+ * descriptors without re-registering them on every wait, and to open all of
+ * a pipeline's redirection files with a single system call. On kernels
+ * without io_uring (or where it is disabled) uring_shared() returns NULL and
+ * callers go back to poll() and ordinary open().
+ */
+
+typedef struct {
+    int fd;
+    unsigned entries;             // size of the submission queue
+    unsigned sq_tail;             // our copy of the tail, published by uring_submit()
+    unsigned queued;              // entries filled in but not yet handed to the kernel
+    unsigned *sq_head;
+    unsigned *sq_ktail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;                // the mappings, for uring_free()
+    size_t sq_ring_size;
+    void *cq_ring;                // the same as sq_ring on kernels with a single mapping
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/*
+ * Set up an io_uring
+ * ring: Ring to initialize
+ * entries: Size of the submission queue (the completion queue is twice that)
+ * Returns 0 on success or -1 if the kernel has no usable io_uring (errno set,
+ * nothing reported)
+ */
+int uring_init(uring_t *ring, unsigned entries);
+
+/*
+ * Get a cleared submission queue entry to fill in
+ * ring: Ring to queue on
+ * Returns the entry, or NULL if the queue is full and needs uring_submit() first
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/*
+ * Hand the queued entries to the kernel, optionally waiting for completions
+ * ring: Ring to submit on
+ * wait_nr: Completions to wait for (counting those already waiting), or 0
+ * Returns 0 on success or -1 on error, with errno set. After EINTR the
+ * entries are still queued (or were submitted before the wait was
+ * interrupted); after any other error they are dropped.
+ */
+int uring_submit(uring_t *ring, unsigned wait_nr);
+
+/*
+ * Take the next completion, if there is one
+ * ring: Ring to take it from
+ * user_data: Set to the user_data of the entry that completed
+ * res: Set to its result (negative errno on failure)
+ * Returns 1 if a completion was taken or 0 if there was none
+ */
+int uring_next_cqe(uring_t *ring, uint64_t *user_data, int *res);
+
+/*
+ * Tear down a ring. Anything still in flight is cancelled by the kernel.
+ * ring: Ring to free
+ */
+void uring_free(uring_t *ring);
+
+/*
+ * The shell's ring, set up the first time it is asked for. A child process
+ * that asks gets a ring of its own rather than its parent's.
+ * Returns the ring, or NULL if io_uring isn't available
+ */
+uring_t *uring_shared(void);
+
+#endif // URING_H